@@ -0,0 +1,176 @@
+#pragma once
+
+#include "light_manager.hpp"
+
+// Hierarchical depth for occlusion culling. The large occluders of a view
+// are drawn depth only, and a compute chain reduces that depth into a mip
+// chain where every texel holds the farthest depth under it. Level 0 is
+// half the depth buffer, padded up to a power of two, so texel i of level
+// n always covers depth texels [i << (n + 1), (i + 1) << (n + 1)) and an
+// instance's screen rectangle falls within 2x2 texels of some level.
+class DepthPyramid {
+public:
+	// after the shadow maps and the visibility buffer's id texture
+	static constexpr GLint TEXTURE_UNIT = 2 * LightManager::MAX_SHADER_LIGHTS + 1;
+	static constexpr GLuint WORKGROUP_SIZE = 8;
+
+private:
+	struct Self {
+		std::unique_ptr<ShaderProgram> depth_program;
+		GLint l_projlmat = -1;
+		std::unique_ptr<ShaderProgram> downsample_program;
+		GLint l_depth = -1;
+		GLint l_from_depth = -1;
+		GLint l_depth_size = -1;
+
+		GLuint fbo = 0;
+		GLuint depth_texture = 0;
+		GLuint pyramid = 0;
+		glm::ivec2 resolution = glm::ivec2(0);
+		glm::ivec2 pyramid_size = glm::ivec2(0);
+		GLint levels = 0;
+	} self;
+
+	DepthPyramid() = default;
+
+	static GLint NextPowerOfTwo(GLint x) {
+		GLint p = 1;
+		while (p < x) { p *= 2; }
+		return p;
+	}
+
+	void resize(glm::ivec2 res) {
+		if (res == self.resolution) { return; }
+		self.resolution = res;
+
+		if (self.fbo) {
+			glDeleteFramebuffers(1, &self.fbo);
+			glDeleteTextures(1, &self.depth_texture);
+			glDeleteTextures(1, &self.pyramid);
+		}
+
+		glCreateTextures(GL_TEXTURE_2D, 1, &self.depth_texture);
+		glTextureStorage2D(self.depth_texture, 1, GL_DEPTH_COMPONENT32F, res.x, res.y);
+		glTextureParameteri(self.depth_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(self.depth_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		self.pyramid_size = glm::max(
+			glm::ivec2(NextPowerOfTwo(res.x), NextPowerOfTwo(res.y)) / 2, glm::ivec2(1)
+		);
+		self.levels = 1;
+		while ((std::max(self.pyramid_size.x, self.pyramid_size.y) >> self.levels) > 0) {
+			self.levels++;
+		}
+		glCreateTextures(GL_TEXTURE_2D, 1, &self.pyramid);
+		glTextureStorage2D(self.pyramid, self.levels, GL_R32F, self.pyramid_size.x, self.pyramid_size.y);
+		glTextureParameteri(self.pyramid, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTextureParameteri(self.pyramid, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+		glCreateFramebuffers(1, &self.fbo);
+		glNamedFramebufferTexture(self.fbo, GL_DEPTH_ATTACHMENT, self.depth_texture, 0);
+		glNamedFramebufferDrawBuffer(self.fbo, GL_NONE);
+		glNamedFramebufferReadBuffer(self.fbo, GL_NONE);
+
+		if (glCheckNamedFramebufferStatus(self.fbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "ERROR::FRAMEBUFFER:: Depth pyramid is not complete!\n";
+		}
+	}
+
+	void downsample() {
+		auto& program = self.downsample_program;
+		program->use();
+		program->uniform(self.l_depth, TEXTURE_UNIT);
+		program->uniform(self.l_depth_size, glm::vec2(self.resolution));
+		glBindTextureUnit(TEXTURE_UNIT, self.depth_texture);
+
+		for (GLint level = 0; level < self.levels; level++) {
+			glm::ivec2 size = glm::max(
+				glm::ivec2(self.pyramid_size.x >> level, self.pyramid_size.y >> level), glm::ivec2(1)
+			);
+			program->uniform(self.l_from_depth, (GLint) (level == 0));
+			if (level > 0) {
+				glBindImageTexture(0, self.pyramid, level - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+			}
+			glBindImageTexture(1, self.pyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glDispatchCompute(
+				(size.x + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, (size.y + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE, 1
+			);
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+
+public:
+	DepthPyramid(const DepthPyramid&) = delete;
+	DepthPyramid& operator=(const DepthPyramid&) = delete;
+	DepthPyramid(DepthPyramid&& other) = delete;
+	DepthPyramid& operator=(DepthPyramid&& other) = delete;
+
+	~DepthPyramid() {
+		if (self.fbo) {
+			glDeleteFramebuffers(1, &self.fbo);
+			glDeleteTextures(1, &self.depth_texture);
+			glDeleteTextures(1, &self.pyramid);
+		}
+	}
+
+	static std::optional<std::unique_ptr<DepthPyramid>> New() {
+		auto depth_program_opt = ShaderProgram::New("shaders/shadow.vert", "shaders/shadow.frag");
+		if (!depth_program_opt.has_value()) {
+			std::cerr << "Could not load occluder depth shader program.\n";
+			return std::nullopt;
+		}
+		auto downsample_program_opt = ShaderProgram::NewCompute(
+			"shaders/depth_pyramid.comp",
+			{ { "WORKGROUP_SIZE", std::to_string(WORKGROUP_SIZE) } }
+		);
+		if (!downsample_program_opt.has_value()) {
+			std::cerr << "Could not load depth pyramid shader program.\n";
+			return std::nullopt;
+		}
+
+		auto pyramid = std::unique_ptr<DepthPyramid>(new DepthPyramid());
+		auto& self = pyramid->self;
+
+		self.depth_program = std::move(depth_program_opt.value());
+		self.l_projlmat = self.depth_program->location("projlmat");
+		self.downsample_program = std::move(downsample_program_opt.value());
+		self.l_depth = self.downsample_program->location("depth");
+		self.l_from_depth = self.downsample_program->location("from_depth");
+		self.l_depth_size = self.downsample_program->location("depth_size");
+
+		return pyramid;
+	}
+
+	// Draws the occluders of view_projection through draw_occluders, with
+	// the depth program current, and rebuilds the pyramid from them.
+	// Leaves the default framebuffer bound.
+	void render(
+		const glm::mat4& view_projection, glm::ivec2 res,
+		const std::function<void(const glm::mat4&)>& draw_occluders
+	) {
+		resize(res);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, self.fbo);
+		glViewport(0, 0, (GLsizei) res.x, (GLsizei) res.y);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+
+		self.depth_program->use();
+		self.depth_program->uniform(self.l_projlmat, view_projection);
+		draw_occluders(view_projection);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		downsample();
+	}
+
+	// Binds the pyramid to TEXTURE_UNIT for the culling pass.
+	void bind() const {
+		glBindTextureUnit(TEXTURE_UNIT, self.pyramid);
+	}
+
+	// Resolution of the depth the pyramid was built from.
+	glm::ivec2 get_resolution() const {
+		return self.resolution;
+	}
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+// GPU timings and depth complexity of the forward passes. Queries are read
+// back LATENCY frames later so measuring never stalls the pipeline.
+class FrameStats {
+public:
+	enum class Pass {
+		DepthPrepass = 0,
+		Shading = 1,
+	};
+
+	static constexpr int NUM_PASSES = 2;
+	static constexpr int LATENCY = 3;
+	static constexpr float SMOOTHING = 0.05f;
+	// used until the pre-pass itself has been timed once
+	static constexpr float OVERDRAW_THRESHOLD = 1.5f;
+
+private:
+	struct FrameQueries {
+		std::array<GLuint, NUM_PASSES> timers = {};
+		std::array<bool, NUM_PASSES> timed = {};
+		GLuint samples = 0;
+		bool counted = false;
+		bool prepass = false;
+		GLint64 pixels = 0;
+		bool pending = false;
+	};
+
+	struct Self {
+		std::array<FrameQueries, LATENCY> frames;
+		int current = 0;
+
+		float overdraw = 0.f;
+		float shading_ms = 0.f;
+		float prepass_ms = 0.f;
+		bool prepass_timed = false;
+		bool shading_prepass = false;
+
+		bool recommended = false;
+	} self;
+
+	FrameStats() = default;
+
+	static bool available(GLuint query) {
+		GLint ready = 0;
+		glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &ready);
+		return ready;
+	}
+
+	static float elapsed_ms(GLuint query) {
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+		return (float) (ns / 1.0e6);
+	}
+
+	static float smooth(float average, float sample) {
+		return average == 0.f ? sample : average + (sample - average) * SMOOTHING;
+	}
+
+	void collect(FrameQueries& frame) {
+		if (!frame.pending) { return; }
+		frame.pending = false;
+
+		for (int i = 0; i < NUM_PASSES; i++) {
+			if (frame.timed[i] && !available(frame.timers[i])) { return; }
+		}
+		if (frame.counted && !available(frame.samples)) { return; }
+
+		// shading cost is only comparable between frames in the same mode
+		if (frame.prepass != self.shading_prepass) {
+			self.shading_prepass = frame.prepass;
+			self.shading_ms = 0.f;
+		}
+
+		int prepass = (int) Pass::DepthPrepass;
+		int shading = (int) Pass::Shading;
+		if (frame.timed[prepass]) {
+			self.prepass_ms = smooth(self.prepass_ms, elapsed_ms(frame.timers[prepass]));
+			self.prepass_timed = true;
+		}
+		if (frame.timed[shading]) {
+			self.shading_ms = smooth(self.shading_ms, elapsed_ms(frame.timers[shading]));
+		}
+		if (frame.counted && frame.pixels > 0) {
+			GLuint64 samples = 0;
+			glGetQueryObjectui64v(frame.samples, GL_QUERY_RESULT, &samples);
+			self.overdraw = smooth(self.overdraw, (float) samples / (float) frame.pixels);
+		}
+	}
+
+	void report() {
+		bool recommended = prepass_recommended();
+		if (recommended == self.recommended) { return; }
+		self.recommended = recommended;
+
+		std::cout << (recommended
+			? "Depth pre-pass worth enabling"
+			: "Depth pre-pass not worth enabling")
+			<< " (overdraw " << self.overdraw << "x, shading "
+			<< self.shading_ms << " ms, pre-pass ";
+		if (self.prepass_timed) {
+			std::cout << self.prepass_ms << " ms)\n";
+		} else {
+			std::cout << "not measured)\n";
+		}
+	}
+
+public:
+	FrameStats(const FrameStats&) = delete;
+	FrameStats& operator=(const FrameStats&) = delete;
+	FrameStats(FrameStats&& other) = delete;
+	FrameStats& operator=(FrameStats&& other) = delete;
+
+	~FrameStats() {
+		for (auto& frame : self.frames) {
+			glDeleteQueries(NUM_PASSES, frame.timers.data());
+			glDeleteQueries(1, &frame.samples);
+		}
+	}
+
+	static std::unique_ptr<FrameStats> New() {
+		auto stats = std::unique_ptr<FrameStats>(new FrameStats());
+		auto& self = stats->self;
+
+		for (auto& frame : self.frames) {
+			glCreateQueries(GL_TIME_ELAPSED, NUM_PASSES, frame.timers.data());
+			glCreateQueries(GL_SAMPLES_PASSED, 1, &frame.samples);
+		}
+
+		return stats;
+	}
+
+	void begin_frame(bool prepass) {
+		self.current = (self.current + 1) % LATENCY;
+		auto& frame = self.frames[self.current];
+		collect(frame);
+		report();
+
+		frame.timed.fill(false);
+		frame.counted = false;
+		frame.prepass = prepass;
+		frame.pixels = 0;
+	}
+
+	// The first depth tested pass of the frame also counts the samples that
+	// pass, which is the overdraw the shading pass would see on its own.
+	void begin_pass(Pass pass) {
+		auto& frame = self.frames[self.current];
+		glBeginQuery(GL_TIME_ELAPSED, frame.timers[(int) pass]);
+		if (!frame.counted) {
+			glBeginQuery(GL_SAMPLES_PASSED, frame.samples);
+		}
+	}
+
+	void end_pass(Pass pass, glm::ivec2 res) {
+		auto& frame = self.frames[self.current];
+		glEndQuery(GL_TIME_ELAPSED);
+		frame.timed[(int) pass] = true;
+		if (!frame.counted) {
+			glEndQuery(GL_SAMPLES_PASSED);
+			frame.counted = true;
+			frame.pixels = (GLint64) res.x * res.y;
+		}
+		frame.pending = true;
+	}
+
+	float get_overdraw() const {
+		return self.overdraw;
+	}
+
+	float get_pass_ms(Pass pass) const {
+		return pass == Pass::DepthPrepass ? self.prepass_ms : self.shading_ms;
+	}
+
+	// A pre-pass pays off when the shading it saves on overdrawn fragments
+	// costs more than drawing the scene's depth once more.
+	bool prepass_recommended() const {
+		if (self.overdraw <= 1.f || self.shading_ms == 0.f) { return false; }
+
+		if (!self.prepass_timed) {
+			return self.overdraw > OVERDRAW_THRESHOLD;
+		}
+
+		float saved = self.shading_prepass
+			? self.shading_ms * (self.overdraw - 1.f)
+			: self.shading_ms * (1.f - 1.f / self.overdraw);
+		return saved > self.prepass_ms;
+	}
+};
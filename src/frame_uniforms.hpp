@@ -0,0 +1,77 @@
+#pragma once
+
+// Owner of the Frame uniform block from shaders/frame.glsl. The buffer stays
+// bound to BINDING, so programs read it without any per-program setup.
+class FrameUniforms {
+public:
+	static constexpr GLuint BINDING = 0;
+	static constexpr ShaderProgram::Uniform BLOCK = ShaderProgram::Uniform("Frame");
+
+	// std140 layout of the Frame block
+	struct Data {
+		glm::mat4 view;
+		glm::mat4 projection;
+		glm::mat4 view_projection;
+		glm::mat4 inv_view_projection;
+		glm::vec3 cam_pos;
+		float time;
+	};
+
+private:
+	struct Self {
+		GLuint ubo = 0;
+		Data data;
+	} self;
+
+	FrameUniforms() = default;
+
+public:
+	FrameUniforms(const FrameUniforms&) = delete;
+	FrameUniforms& operator=(const FrameUniforms&) = delete;
+	FrameUniforms(FrameUniforms&& other) = delete;
+	FrameUniforms& operator=(FrameUniforms&& other) = delete;
+
+	~FrameUniforms() {
+		glDeleteBuffers(1, &self.ubo);
+	}
+
+	static std::unique_ptr<FrameUniforms> New() {
+		auto frame_uniforms = std::unique_ptr<FrameUniforms>(new FrameUniforms());
+		auto& self = frame_uniforms->self;
+
+		glCreateBuffers(1, &self.ubo);
+		glNamedBufferStorage(self.ubo, sizeof(Data), nullptr, GL_DYNAMIC_STORAGE_BIT);
+		glBindBufferBase(GL_UNIFORM_BUFFER, BINDING, self.ubo);
+
+		return frame_uniforms;
+	}
+
+	// Reports programs whose Frame block would not see this buffer.
+	static bool check(const ShaderProgram* program) {
+		GLint binding = program->block_binding(BLOCK);
+		if (binding != -1 && binding != (GLint) BINDING) {
+			std::cerr << "Frame block is bound to " << binding
+				<< " instead of " << BINDING << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	void update(
+		const glm::mat4& view, const glm::mat4& projection,
+		glm::vec3 cam_pos, float time
+	) {
+		auto& data = self.data;
+		data.view = view;
+		data.projection = projection;
+		data.view_projection = projection * view;
+		data.inv_view_projection = glm::inverse(data.view_projection);
+		data.cam_pos = cam_pos;
+		data.time = time;
+		glNamedBufferSubData(self.ubo, 0, sizeof(Data), &data);
+	}
+
+	const Data& get_data() const {
+		return self.data;
+	}
+};
@@ -0,0 +1,85 @@
+#pragma once
+
+// Camera frustum as six planes (xyz normal pointing inside, w offset),
+// extracted from a view-projection matrix.
+struct Frustum {
+	std::array<glm::vec4, 6> planes;
+	// Where the view is from, homogeneous: the eye with w 1 in a perspective
+	// view, the direction back towards the viewer with w 0 in an
+	// orthographic one.
+	glm::vec4 eye;
+
+	static Frustum FromMatrix(const glm::mat4& m) {
+		glm::vec4 row_x = glm::vec4(m[0][0], m[1][0], m[2][0], m[3][0]);
+		glm::vec4 row_y = glm::vec4(m[0][1], m[1][1], m[2][1], m[3][1]);
+		glm::vec4 row_z = glm::vec4(m[0][2], m[1][2], m[2][2], m[3][2]);
+		glm::vec4 row_w = glm::vec4(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+		Frustum frustum;
+		frustum.planes = {
+			row_w + row_x, row_w - row_x,
+			row_w + row_y, row_w - row_y,
+			row_w + row_z, row_w - row_z,
+		};
+		for (auto& plane : frustum.planes) {
+			plane /= glm::length(glm::vec3(plane));
+		}
+
+		// the point every view ray meets, or the direction they all share,
+		// maps to clip space (0, 0, -z, 0)
+		glm::vec4 eye = glm::inverse(m) * glm::vec4(0.f, 0.f, -1.f, 0.f);
+		if (std::abs(eye.w) > 1e-6f * glm::length(glm::vec3(eye))) {
+			eye /= eye.w;
+		} else {
+			eye = glm::vec4(glm::normalize(glm::vec3(eye)), 0.f);
+		}
+		frustum.eye = eye;
+		return frustum;
+	}
+
+	bool intersects_sphere(glm::vec3 center, float radius) const {
+		for (const auto& plane : planes) {
+			if (glm::dot(glm::vec3(plane), center) + plane.w < -radius) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A box is outside a plane when its corner furthest along the normal is.
+	bool intersects_box(glm::vec3 lo, glm::vec3 hi) const {
+		for (const auto& plane : planes) {
+			glm::vec3 n = glm::vec3(plane);
+			glm::vec3 corner = glm::vec3(
+				n.x >= 0.f ? hi.x : lo.x, n.y >= 0.f ? hi.y : lo.y, n.z >= 0.f ? hi.z : lo.z
+			);
+			if (glm::dot(n, corner) + plane.w < 0.f) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A cone is outside a plane when both its apex and the point of its base
+	// rim furthest along the plane normal are.
+	bool intersects_cone(glm::vec3 apex, glm::vec3 dir, float height, float angle) const {
+		if (angle >= glm::half_pi<float>()) {
+			return intersects_sphere(apex, height);
+		}
+
+		glm::vec3 base = apex + dir * height;
+		float radius = height * std::tan(angle);
+		for (const auto& plane : planes) {
+			glm::vec3 n = glm::vec3(plane);
+			if (glm::dot(n, apex) + plane.w >= 0.f) { continue; }
+
+			glm::vec3 across = n - dir * glm::dot(n, dir);
+			float across_len = glm::length(across);
+			glm::vec3 rim = across_len > 1e-6f ? base + across * (radius / across_len) : base;
+			if (glm::dot(n, rim) + plane.w < 0.f) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
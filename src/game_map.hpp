@@ -1,6 +1,10 @@
 #pragma once
 
 #include "object.hpp"
+#include "light_baker.hpp"
+#include "instance_culling.hpp"
+#include "software_occlusion.hpp"
+#include "scene_graph.hpp"
 
 using ShapeCreator = InstantiableMesh::Shape_Creator;
 using ShapeSource = std::variant<ShapeCreator, std::string>;
@@ -26,10 +30,29 @@ static const ShapeMap shape_map = {
 };
 
 class GameMap {
+public:
+	static constexpr GLuint BAKED_LIGHTING_BINDING = 7;
+	static constexpr const char* BAKED_LIGHTING_FILE = "baked_lighting.bin";
+
 private:
 	struct Self {
+		// before meshes, so it outlives the VAOs referring to it
+		std::unique_ptr<GeometryArena> arena;
+		// likewise outlives the instances that remove themselves from it
+		std::unique_ptr<InstanceBvh> bvh;
+		std::vector<InstantiableMesh*> bvh_meshes;
+		std::vector<uint64_t> visible;
+		std::vector<int64_t> visible_handles;
 		std::unordered_map<std::string, std::unique_ptr<InstantiableMesh>> meshes;
 		std::vector<std::unique_ptr<Instance>> instances;
+		// null when the culling program is unavailable
+		std::unique_ptr<InstanceCulling> culling;
+		// culls on the CPU even with the culling program there
+		bool cpu_culling = false;
+		std::unique_ptr<SoftwareOcclusion> occlusion;
+		// built from the instances as they are this frame
+		bool occlusion_ready = false;
+		std::unique_ptr<SceneGraph> graph;
 
 		Camera* camera;
 		LightManager* light_manager;
@@ -41,6 +64,10 @@ private:
 		Light* point_1;
 		Light* point_2;
 
+		Instance* cornell_box;
+		Light* cornell_lamp;
+		GLuint baked_buffer = 0;
+
 		Instance* animate_heart;
 		double time = 0;
 
@@ -53,15 +80,29 @@ private:
 
 private:
 	void create_meshes() {
+		self.arena = GeometryArena::New();
+		GeometryArena* arena = self.arena.get();
 		for (const auto& [k, v] : shape_map) {
 			if (std::holds_alternative<std::string>(v)) {
 				auto& file_obj = std::get<std::string>(v);
-				self.meshes.insert({ k, InstantiableMesh::FromFile(file_obj) });
+				self.meshes.insert({ k, InstantiableMesh::FromFile(
+					arena, file_obj, GL_TRIANGLES, InstanceStorage::Persistent
+				) });
 			} else if (std::holds_alternative<ShapeCreator>(v)) {
 				auto& shape_func = std::get<ShapeCreator>(v);
-				self.meshes.insert({ k, InstantiableMesh::FromShape(shape_func) });
+				self.meshes.insert({ k, InstantiableMesh::FromShape(
+					arena, shape_func, GL_TRIANGLES, InstanceStorage::Persistent
+				) });
 			}
 		}
+		arena->commit();
+
+		self.bvh = InstanceBvh::New();
+		self.occlusion = SoftwareOcclusion::New();
+		for (const auto& [k, v] : self.meshes) {
+			v->set_spatial_index(self.bvh.get(), (uint32_t) self.bvh_meshes.size());
+			self.bvh_meshes.push_back(v.get());
+		}
 	}
 
 	InstantiableMesh* get_mesh(const std::string& name) {
@@ -85,9 +126,8 @@ private:
 		glm::vec3 pos, glm::vec3 size, glm::vec3 col
 	) {
 		auto inst = create_instance(object);
-		inst->set_frame(glm::translate(glm::mat4(1.f), pos));
-		inst->set_size(size);
 		inst->set_color(glm::vec4(col, 1.f));
+		inst->set_transform(glm::translate(glm::mat4(1.f), pos), size);
 		return inst;
 	}
 
@@ -96,9 +136,22 @@ private:
 		glm::vec3 pos, glm::vec3 axis, float angle, glm::vec3 size, glm::vec3 col
 	) {
 		auto inst = create_instance(object);
-		inst->set_frame(glm::rotate(glm::translate(glm::mat4(1.f), pos), glm::radians(angle), axis));
+		inst->set_color(glm::vec4(col, 1.f));
+		inst->set_transform(
+			glm::rotate(glm::translate(glm::mat4(1.f), pos), glm::radians(angle), axis), size
+		);
+		return inst;
+	}
+
+	// Places an instance relative to group, at pos in the group's frame.
+	Instance* create_instance_in(
+		SceneGraph::Node group, InstantiableMesh* object,
+		glm::vec3 pos, glm::vec3 size, glm::vec3 col
+	) {
+		auto inst = create_instance(object);
 		inst->set_size(size);
 		inst->set_color(glm::vec4(col, 1.f));
+		self.graph->add(group, glm::translate(glm::mat4(1.f), pos), inst);
 		return inst;
 	}
 
@@ -231,7 +284,7 @@ private:
 			glm::vec3(0.632f, 0.769f, 0.550f)
 		);
 
-		create_instance_with_rot(
+		self.cornell_box = create_instance_with_rot(
 			cornell_box,
 			glm::vec3(120.f, 30.f, 60.f),
 			glm::vec3(0.f, 1.f, 0.f),
@@ -249,47 +302,49 @@ private:
 			glm::vec3(0.9f, 0.f, 0.f)
 		);
 
-		glm::vec3 base = glm::vec3(120.f, 30.f, -80.f);
+		SceneGraph::Node room = self.graph->add(
+			SceneGraph::NONE, glm::translate(glm::mat4(1.f), glm::vec3(120.f, 30.f, -80.f))
+		);
 
 		//top
-		create_instance_with(
-			box,
-			base + glm::vec3(0.f, -25.f, 0.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(0.f, -25.f, 0.f),
 			glm::vec3(102.f, 5.f, 102.f),
 			glm::vec3(0.772f)
 		);
 		// sides
-		create_instance_with(
-			box,
-			base + glm::vec3(0.f, 0.f, 50.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(0.f, 0.f, 50.f),
 			glm::vec3(100.f, 50.f, 5.f),
 			glm::vec3(0.772f)
 		);
 
-		create_instance_with(
-			box,
-			base + glm::vec3(0.f, 0.f, -50.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(0.f, 0.f, -50.f),
 			glm::vec3(100.f, 50.f, 5.f),
 			glm::vec3(0.772f)
 		);
 
-		create_instance_with(
-			box,
-			base + glm::vec3(50.f, 0.f, 0.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(50.f, 0.f, 0.f),
 			glm::vec3(5.f, 50.f, 100.f),
 			glm::vec3(0.772f)
 		);
 
-		create_instance_with(
-			box,
-			base + glm::vec3(-50.f, 0.f, 0.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(-50.f, 0.f, 0.f),
 			glm::vec3(5.f, 50.f, 100.f),
 			glm::vec3(0.772f)
 		);
 		//bottom
-		create_instance_with(
-			box,
-			base + glm::vec3(0.f, 25.f, 0.f),
+		create_instance_in(
+			room, box,
+			glm::vec3(0.f, 25.f, 0.f),
 			glm::vec3(102.f, 5.f, 102.f),
 			glm::vec3(0.772f)
 		);
@@ -301,6 +356,10 @@ private:
 			glm::vec3(1.0f, 0.5f, 0.25f)
 		);
 
+		self.graph->update();
+		for (auto& instance : self.instances) {
+			instance->set_static(instance.get() != self.animate_heart);
+		}
 
 		// lights
 
@@ -362,6 +421,90 @@ private:
 		));
 	}
 
+	void setup_unshadowed_lights() {
+		const int grid = 12;
+		const float spacing = 40.f;
+		const float half = (grid - 1) * spacing * 0.5f;
+		const float intensity = 8.f;
+
+		for (int x = 0; x < grid; x++) {
+			for (int z = 0; z < grid; z++) {
+				float hue = (float) (x * grid + z) / (grid * grid);
+				glm::vec3 col = intensity * glm::clamp(
+					glm::abs(glm::mod(hue * 6.f + glm::vec3(0.f, 4.f, 2.f), 6.f) - 3.f) - 1.f,
+					0.f, 1.f
+				);
+				glm::vec3 pos = glm::vec3(x * spacing - half, 4.f, z * spacing - half);
+
+				if ((x + z) % 3 == 0) {
+					self.light_manager->add_unshadowed_light(Light::New(
+						LightType::Spot, glm::vec3(0.f, -1.f, 0.f),
+						pos + glm::vec3(0.f, 16.f, 0.f), col, 40.f, 20.f, 30.f
+					));
+				} else {
+					self.light_manager->add_unshadowed_light(Light::New(
+						LightType::Positional, glm::vec3(0.f), pos, col, 25.f
+					));
+				}
+			}
+		}
+	}
+
+	// Lights that never move are baked into the static instances.
+	void setup_baked_lights() {
+		glm::vec4 lamp_pos = self.cornell_box->get_model() * glm::vec4(-0.25f, 4.6f, -3.f, 1.f);
+		self.cornell_lamp = self.light_manager->add_baked_light(Light::New(
+			LightType::Positional, glm::vec3(0.f), glm::vec3(lamp_pos),
+			glm::vec3(12.f, 10.f, 7.5f), 60.f
+		));
+	}
+
+	std::vector<LightBaker::Receiver> static_receivers() const {
+		std::vector<LightBaker::Receiver> receivers;
+		for (size_t i = 0; i < self.instances.size(); i++) {
+			const Instance* inst = self.instances[i].get();
+			if (!inst->is_static()) { continue; }
+			receivers.push_back(LightBaker::Receiver {
+				i, inst->get_object(), inst->get_model(), glm::vec3(inst->get_color())
+			});
+		}
+		return receivers;
+	}
+
+	void load_baked_lighting() {
+		auto receivers = static_receivers();
+		uint64_t scene_hash = LightBaker::SceneHash(
+			self.instances.size(), receivers, self.light_manager->get_baked_lights()
+		);
+		auto baked_opt = BakedLighting::Load(BAKED_LIGHTING_FILE, scene_hash);
+		if (!baked_opt.has_value()) { return; }
+		auto& baked = baked_opt.value();
+
+		// every receiver's bake must cover exactly its own mesh's vertices,
+		// which the forward and visibility passes index from its offset
+		for (const auto& receiver : receivers) {
+			GLint offset = baked.offsets[receiver.index];
+			size_t num_vertices = receiver.mesh->get_vertices().size();
+			if (offset < 0 || (size_t) offset + num_vertices > baked.lighting.size()) {
+				std::cerr << "Baked lighting in " << BAKED_LIGHTING_FILE
+					<< " does not match the meshes, run with --bake.\n";
+				return;
+			}
+		}
+
+		glCreateBuffers(1, &self.baked_buffer);
+		glNamedBufferStorage(
+			self.baked_buffer,
+			std::max(baked.lighting.size(), (size_t) 1) * sizeof(glm::vec4),
+			baked.lighting.empty() ? nullptr : baked.lighting.data(), 0
+		);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, BAKED_LIGHTING_BINDING, self.baked_buffer);
+
+		for (size_t i = 0; i < self.instances.size(); i++) {
+			self.instances[i]->set_baked_offset(baked.offsets[i]);
+		}
+	}
+
 	Light* get_light_from_index(int i) const {
 		switch (i) {
 			case 0: return self.spot_1;
@@ -392,6 +535,10 @@ private:
 	}
 	
 public:
+	~GameMap() {
+		if (self.baked_buffer) { glDeleteBuffers(1, &self.baked_buffer); }
+	}
+
 	static std::unique_ptr<GameMap> New(
 		Camera* camera, LightManager* light_manager, Movement* movement
 	) {
@@ -403,7 +550,15 @@ public:
 		self.movement = movement;
 
 		map->create_meshes();
+		self.graph = SceneGraph::New();
+		auto culling_opt = InstanceCulling::New(map->get_meshes(), self.arena.get());
+		if (culling_opt.has_value()) {
+			self.culling = std::move(culling_opt.value());
+		}
 		map->setup_map();
+		map->setup_unshadowed_lights();
+		map->setup_baked_lights();
+		map->load_baked_lighting();
 
 		return map;
 	}
@@ -413,6 +568,10 @@ public:
 		auto& camera = self.camera;
 		auto& movement = self.movement;
 
+		for (auto& [name, mesh] : self.meshes) {
+			mesh->begin_frame();
+		}
+
 		self.orbit_angle = self.orbit_angle + self.rotspeed * (float) dt;
 		if (self.orbit_angle >= glm::two_pi<float>()) {
 			self.orbit_angle -= glm::two_pi<float>();
@@ -442,15 +601,23 @@ public:
 		self.time += dt;
 
 		float size = glm::cos(self.time * 6.0f) * 0.125f + 2.5f;
-		self.animate_heart->set_size(glm::vec3(size));
-
 		float offset = glm::sin(self.time * 2.0f - glm::radians(30.f)) * 20.0f;
 
 		glm::mat4 model = glm::mat4(1.f);
 		model = glm::translate(model, glm::vec3(-70.f, 10.f, -80.f) + glm::vec3(offset, 0.f, 0.f));
 		model = glm::rotate(model, glm::radians(90.f), glm::vec3(-1.f, 0.f, 0.f));
 
-		self.animate_heart->set_frame(model);
+		self.animate_heart->set_transform(model, glm::vec3(size));
+
+		self.graph->update();
+		for (auto& [name, mesh] : self.meshes) {
+			mesh->compose_instances();
+		}
+		self.bvh->refit();
+		self.occlusion_ready = false;
+		if (gpu_culling()) {
+			self.culling->gather();
+		}
 		
 		/*
 		if (self.movement->get_update_light()) {
@@ -467,9 +634,111 @@ public:
 
 	}
 
-	void draw() {
+	// Offline step behind --bake: path traces the baked lights into the
+	// static instances and writes BAKED_LIGHTING_FILE for later runs.
+	bool bake_lighting() const {
+		auto receivers = static_receivers();
+		auto lights = self.light_manager->get_baked_lights();
+		uint64_t scene_hash = LightBaker::SceneHash(self.instances.size(), receivers, lights);
+
+		size_t num_receivers = receivers.size();
+		auto baker = LightBaker::New(std::move(receivers), std::move(lights));
+		std::cout << "Baking " << num_receivers << " static instances ("
+			<< baker->get_num_triangles() << " triangles)...\n";
+
+		BakedLighting baked = baker->bake(self.instances.size(), scene_hash);
+		if (!baked.save(BAKED_LIGHTING_FILE)) { return false; }
+
+		std::cout << "Wrote " << baked.lighting.size() << " baked vertices to "
+			<< BAKED_LIGHTING_FILE << "\n";
+		return true;
+	}
+
+	GeometryArena* get_arena() const {
+		return self.arena.get();
+	}
+
+	std::vector<InstantiableMesh*> get_meshes() const {
+		std::vector<InstantiableMesh*> meshes;
+		meshes.reserve(self.meshes.size());
 		for (const auto& [k, v] : self.meshes) {
-			v->draw();
+			meshes.push_back(v.get());
+		}
+		return meshes;
+	}
+
+	bool gpu_culling() const {
+		return self.culling && !self.cpu_culling;
+	}
+
+	bool get_cpu_culling() const {
+		return self.cpu_culling;
+	}
+
+	// Switches to culling on the CPU, or back to the GPU if the culling
+	// program is there, from the next update on.
+	void set_cpu_culling(bool cpu_culling) {
+		self.cpu_culling = cpu_culling;
+	}
+
+	// Rasterizes the occluders of view_projection for the draws from that
+	// view to cull against: into the culling depth pyramid on the GPU, or
+	// into the software occlusion buffer on the CPU. The occluders are the
+	// visible instances large on screen, and on the CPU only those of
+	// meshes coarse enough to be cheap to rasterize.
+	void build_occlusion(const glm::mat4& view_projection, glm::ivec2 res) {
+		if (gpu_culling()) {
+			self.culling->build_occlusion(view_projection, res);
+			return;
+		}
+
+		auto& occlusion = self.occlusion;
+		auto& visible = self.visible;
+		self.bvh->cull(Frustum::FromMatrix(view_projection), visible);
+		occlusion->begin(view_projection);
+		for (uint64_t key : visible) {
+			const InstantiableMesh* mesh = self.bvh_meshes[InstanceBvh::key_mesh(key)];
+			int64_t handle = InstanceBvh::key_handle(key);
+			GLsizei num_triangles = mesh->get_num_triangles();
+			if (num_triangles == 0 || num_triangles > SoftwareOcclusion::MAX_OCCLUDER_TRIANGLES) { continue; }
+			if (mesh->get_projected_size(handle, view_projection) < InstanceCulling::OCCLUDER_SIZE) { continue; }
+
+			const InstanceData* data = mesh->get_instance_data(handle);
+			if (!data) { continue; }
+			occlusion->add_occluder(data->get_model(), mesh->get_vertices(), mesh->get_indices());
+		}
+		occlusion->rasterize();
+		self.occlusion_ready = true;
+	}
+
+	// Culls on the GPU when the compute path is there and in use, otherwise
+	// walks the instance BVH and draws the visible instances of each mesh.
+	// lod_bias picks that many levels of detail coarser than the view needs;
+	// occlusion culls against what build_occlusion rasterized as well.
+	void draw(const glm::mat4& view_projection, int lod_bias = 0, bool occlusion = false) {
+		if (gpu_culling()) {
+			self.culling->draw(view_projection, lod_bias, occlusion);
+			return;
+		}
+
+		auto& visible = self.visible;
+		auto& handles = self.visible_handles;
+		self.bvh->cull(Frustum::FromMatrix(view_projection), visible);
+		if (occlusion && self.occlusion_ready) {
+			visible.erase(std::remove_if(visible.begin(), visible.end(), [this](uint64_t key) {
+				glm::vec3 lo, hi;
+				return self.bvh->get_box(key, lo, hi) && !self.occlusion->is_visible(lo, hi);
+			}), visible.end());
+		}
+		std::sort(visible.begin(), visible.end());
+		size_t i = 0;
+		while (i < visible.size()) {
+			uint32_t mesh = InstanceBvh::key_mesh(visible[i]);
+			handles.clear();
+			for (; i < visible.size() && InstanceBvh::key_mesh(visible[i]) == mesh; i++) {
+				handles.push_back(InstanceBvh::key_handle(visible[i]));
+			}
+			self.bvh_meshes[mesh]->draw_handles(handles, view_projection, lod_bias);
 		}
 	}
 };
\ No newline at end of file
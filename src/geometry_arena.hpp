@@ -0,0 +1,290 @@
+#pragma once
+
+// One vertex and one index buffer shared by every mesh. Each mesh takes a
+// range of both when it is created, and commit() uploads whatever was added
+// since the last commit. Any set of meshes can then be drawn through one VAO
+// and one multi-draw, told apart by first index and base vertex.
+//
+// On the GPU vertices are packed to 20 bytes, normals as 10 bits signed
+// per component and texture coordinates as half floats. Indices are 16 bit
+// until a mesh comes with too many vertices for them, and from then on
+// 32 bit, whole buffer at once.
+class GeometryArena {
+public:
+	struct Range {
+		GLuint first_index = 0;
+		GLint base_vertex = 0;
+	};
+
+	struct PackedVertex {
+		glm::vec3 pos;
+		GLuint nor; // GL_INT_2_10_10_10_REV
+		GLuint tex; // two half floats
+	};
+
+	// indices are relative to a mesh's base vertex
+	static constexpr size_t MAX_SHORT_INDEXED_VERTICES = 65536;
+
+private:
+	struct Self {
+		GLuint vbo = 0;
+		GLuint ebo = 0;
+		size_t vertices_capacity = 0;
+		size_t indices_capacity = 0;
+
+		size_t num_vertices = 0;
+		size_t num_indices = 0;
+		// added since the last commit, placed after num_vertices/num_indices
+		Vertices pending_vertices;
+		Indices pending_indices;
+
+		GLenum index_type = GL_UNSIGNED_SHORT;
+		bool needs_wide_indices = false;
+	} self;
+
+	GeometryArena() = default;
+
+	static inline void setup_attribute(
+		GLuint index, GLint size, GLsizei stride, const void* offset
+	) {
+		glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, stride, offset);
+		glEnableVertexAttribArray(index);
+	}
+
+	static inline void setup_packed_attribute(
+		GLuint index, GLint size, GLenum type, GLboolean normalized,
+		GLsizei stride, const void* offset
+	) {
+		glVertexAttribPointer(index, size, type, normalized, stride, offset);
+		glEnableVertexAttribArray(index);
+	}
+
+	static inline void setup_divattr(
+		GLuint index, GLint size, GLsizei stride, const void* offset
+	) {
+		setup_attribute(index, size, stride, offset);
+		glVertexAttribDivisor(index, 1);
+	}
+
+	// Unit normal as signed 10 bit x, y, z, the top two bits left 0.
+	static GLuint pack_normal(glm::vec3 nor) {
+		float length = glm::length(nor);
+		if (length > 0.f) { nor /= length; }
+		auto component = [](float v) {
+			return (GLuint) ((GLint) std::round(glm::clamp(v, -1.f, 1.f) * 511.f) & 0x3ff);
+		};
+		return component(nor.x) | component(nor.y) << 10 | component(nor.z) << 20;
+	}
+
+	static std::vector<PackedVertex> pack(const Vertices& vertices) {
+		std::vector<PackedVertex> packed(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++) {
+			packed[i] = PackedVertex {
+				vertices[i].pos, pack_normal(vertices[i].nor), glm::packHalf2x16(vertices[i].tex)
+			};
+		}
+		return packed;
+	}
+
+	size_t index_size() const {
+		return self.index_type == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+	}
+
+	// Rewrites the indices uploaded so far as 32 bit, in the same buffer.
+	void widen_indices() {
+		std::vector<GLushort> narrow(self.num_indices);
+		if (!narrow.empty()) {
+			glGetNamedBufferSubData(self.ebo, 0, narrow.size() * sizeof(GLushort), narrow.data());
+		}
+		std::vector<GLuint> wide(narrow.begin(), narrow.end());
+
+		self.index_type = GL_UNSIGNED_INT;
+		self.indices_capacity = std::max(self.indices_capacity + self.indices_capacity % 2, (size_t) 2);
+		glNamedBufferData(self.ebo, self.indices_capacity * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+		if (!wide.empty()) {
+			glNamedBufferSubData(self.ebo, 0, wide.size() * sizeof(GLuint), wide.data());
+		}
+	}
+
+	// Grows buffer in place, so every VAO referring to it stays valid.
+	static void grow(GLuint buffer, size_t used_bytes, size_t capacity_bytes) {
+		GLuint scratch = 0;
+		if (used_bytes > 0) {
+			glCreateBuffers(1, &scratch);
+			glNamedBufferData(scratch, used_bytes, nullptr, GL_STREAM_COPY);
+			glCopyNamedBufferSubData(buffer, scratch, 0, 0, used_bytes);
+		}
+		glNamedBufferData(buffer, capacity_bytes, nullptr, GL_STATIC_DRAW);
+		if (scratch) {
+			glCopyNamedBufferSubData(scratch, buffer, 0, 0, used_bytes);
+			glDeleteBuffers(1, &scratch);
+		}
+	}
+
+public:
+	GeometryArena(const GeometryArena&) = delete;
+	GeometryArena& operator=(const GeometryArena&) = delete;
+	GeometryArena(GeometryArena&& other) = delete;
+	GeometryArena& operator=(GeometryArena&& other) = delete;
+
+	~GeometryArena() {
+		GLuint buffers[] = { self.vbo, self.ebo };
+		glDeleteBuffers(2, buffers);
+	}
+
+	static std::unique_ptr<GeometryArena> New() {
+		auto arena = std::unique_ptr<GeometryArena>(new GeometryArena());
+		auto& self = arena->self;
+
+		glCreateBuffers(1, &self.vbo);
+		glCreateBuffers(1, &self.ebo);
+
+		return arena;
+	}
+
+	Range allocate(const Vertices& vertices, const Indices& indices) {
+		Range range {
+			(GLuint) (self.num_indices + self.pending_indices.size()),
+			(GLint) (self.num_vertices + self.pending_vertices.size())
+		};
+		self.pending_vertices.insert(self.pending_vertices.end(), vertices.begin(), vertices.end());
+		self.pending_indices.insert(self.pending_indices.end(), indices.begin(), indices.end());
+		if (vertices.size() > MAX_SHORT_INDEXED_VERTICES) {
+			self.needs_wide_indices = true;
+		}
+		return range;
+	}
+
+	// More indices into the vertices of an earlier allocation at
+	// base_vertex, like a coarser level of detail.
+	Range allocate_indices(const Indices& indices, GLint base_vertex) {
+		Range range {
+			(GLuint) (self.num_indices + self.pending_indices.size()),
+			base_vertex
+		};
+		self.pending_indices.insert(self.pending_indices.end(), indices.begin(), indices.end());
+		return range;
+	}
+
+	void commit() {
+		size_t num_vertices = self.num_vertices + self.pending_vertices.size();
+		size_t num_indices = self.num_indices + self.pending_indices.size();
+
+		if (self.needs_wide_indices && self.index_type == GL_UNSIGNED_SHORT) {
+			widen_indices();
+		}
+
+		if (num_vertices > self.vertices_capacity) {
+			size_t capacity = std::max(num_vertices, self.vertices_capacity * 2);
+			grow(
+				self.vbo, self.num_vertices * sizeof(PackedVertex),
+				capacity * sizeof(PackedVertex)
+			);
+			self.vertices_capacity = capacity;
+		}
+		if (num_indices > self.indices_capacity) {
+			// Shaders read 16 bit indices in pairs from uint words, so the
+			// last word must lie wholly within the buffer.
+			size_t capacity = std::max(num_indices, self.indices_capacity * 2);
+			capacity += capacity % 2;
+			grow(self.ebo, self.num_indices * index_size(), capacity * index_size());
+			self.indices_capacity = capacity;
+		}
+
+		if (!self.pending_vertices.empty()) {
+			auto packed = pack(self.pending_vertices);
+			glNamedBufferSubData(
+				self.vbo, self.num_vertices * sizeof(PackedVertex),
+				packed.size() * sizeof(PackedVertex), packed.data()
+			);
+		}
+		if (!self.pending_indices.empty()) {
+			if (self.index_type == GL_UNSIGNED_SHORT) {
+				std::vector<GLushort> narrow(self.pending_indices.begin(), self.pending_indices.end());
+				glNamedBufferSubData(
+					self.ebo, self.num_indices * sizeof(GLushort),
+					narrow.size() * sizeof(GLushort), narrow.data()
+				);
+			} else {
+				glNamedBufferSubData(
+					self.ebo, self.num_indices * sizeof(GLuint),
+					self.pending_indices.size() * sizeof(GLuint), self.pending_indices.data()
+				);
+			}
+		}
+
+		self.num_vertices = num_vertices;
+		self.num_indices = num_indices;
+		self.pending_vertices = Vertices();
+		self.pending_indices = Indices();
+	}
+
+	GLuint get_vertex_buffer() const {
+		return self.vbo;
+	}
+
+	GLuint get_index_buffer() const {
+		return self.ebo;
+	}
+
+	// GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, as of the last commit().
+	GLenum get_index_type() const {
+		return self.index_type;
+	}
+
+	// Byte offset of index first_index in the index buffer.
+	const void* index_offset(GLuint first_index) const {
+		return (const void*) (first_index * index_size());
+	}
+
+	// Attributes 0-2 from the shared vertices, indices from the shared
+	// index buffer.
+	void setup_vertex_attributes(GLuint vao) const {
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, self.vbo);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, self.ebo);
+
+		GLsizei stride = sizeof(PackedVertex);
+
+		setup_attribute(0, 3, stride, (void*) offsetof(PackedVertex, pos));
+		setup_packed_attribute(
+			1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*) offsetof(PackedVertex, nor)
+		);
+		setup_packed_attribute(
+			2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*) offsetof(PackedVertex, tex)
+		);
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	}
+
+	// Attributes 3-10 per instance from buffer, set again whenever the
+	// buffer is replaced: model rows, colour, normal matrix columns and
+	// bake offset, as declared in shaders/instance.glsl.
+	static void setup_instance_attributes(GLuint vao, GLuint buffer) {
+		glBindVertexArray(vao);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+		GLsizei inst_s = sizeof(InstanceData);
+		GLsizei vec4_s = sizeof(glm::vec4);
+
+		setup_divattr(3, 4, inst_s, (void*) (offsetof(InstanceData, model) + 0 * vec4_s));
+		setup_divattr(4, 4, inst_s, (void*) (offsetof(InstanceData, model) + 1 * vec4_s));
+		setup_divattr(5, 4, inst_s, (void*) (offsetof(InstanceData, model) + 2 * vec4_s));
+		glVertexAttribPointer(
+			6, 4, GL_UNSIGNED_BYTE, GL_TRUE, inst_s, (void*) offsetof(InstanceData, color)
+		);
+		glEnableVertexAttribArray(6);
+		glVertexAttribDivisor(6, 1);
+		setup_divattr(7, 3, inst_s, (void*) offsetof(InstanceData, normal_0));
+		setup_divattr(8, 3, inst_s, (void*) offsetof(InstanceData, normal_1));
+		setup_divattr(9, 3, inst_s, (void*) offsetof(InstanceData, normal_2));
+		glVertexAttribIPointer(10, 1, GL_INT, inst_s, (void*) offsetof(InstanceData, baked_offset));
+		glEnableVertexAttribArray(10);
+		glVertexAttribDivisor(10, 1);
+
+		glBindVertexArray(0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+};
@@ -0,0 +1,452 @@
+#pragma once
+
+#include "frustum.hpp"
+
+// Spatial index over the instances of every mesh, keyed by mesh id and
+// instance handle. Nodes have up to four children whose boxes are stored
+// component by component, so one SSE compare tests a frustum plane against
+// all four.
+//
+// Moving an instance refits its ancestors; a subtree that has grown past
+// REBUILD_GROWTH times its area at build time is rebuilt on its own. New
+// instances wait in a flat list, tested one by one, until enough of them
+// (or of removed ones) pile up for a full rebuild.
+class InstanceBvh {
+public:
+	static constexpr int WIDTH = 4;
+	static constexpr float REBUILD_GROWTH = 2.f;
+	static constexpr size_t REBUILD_PERCENT = 25;
+	static constexpr size_t MIN_REBUILD = 16;
+
+	static uint64_t key(uint32_t mesh, int64_t handle) {
+		return ((uint64_t) mesh << 32) | (uint32_t) handle;
+	}
+
+	static uint32_t key_mesh(uint64_t key) {
+		return (uint32_t) (key >> 32);
+	}
+
+	static int64_t key_handle(uint64_t key) {
+		return (int64_t) (key & 0xffffffffull);
+	}
+
+private:
+	static constexpr int32_t EMPTY = std::numeric_limits<int32_t>::min();
+	static constexpr float MAX_EXTENT = std::numeric_limits<float>::max();
+
+	struct alignas(16) Node {
+		float lo_x[WIDTH];
+		float lo_y[WIDTH];
+		float lo_z[WIDTH];
+		float hi_x[WIDTH];
+		float hi_y[WIDTH];
+		float hi_z[WIDTH];
+		// a node index, ~item for an instance, EMPTY for an unused slot
+		int32_t child[WIDTH];
+		int32_t parent;
+		int32_t parent_slot;
+		float built_area;
+	};
+
+	struct Item {
+		uint64_t key;
+		glm::vec3 lo;
+		glm::vec3 hi;
+		// node and slot holding it, or node -1 and its index in pending
+		int32_t node;
+		int32_t slot;
+	};
+
+	struct Self {
+		std::vector<Node> nodes;
+		std::vector<int32_t> free_nodes;
+		int32_t root = -1;
+
+		std::vector<Item> items;
+		std::vector<int32_t> free_items;
+		std::unordered_map<uint64_t, int32_t> lookup;
+		std::vector<int32_t> pending;
+		size_t num_removed = 0;
+
+		std::vector<int32_t> dirty;
+		std::vector<int32_t> loose;
+		std::vector<int32_t> stack;
+		std::vector<int32_t> order;
+	} self;
+
+	InstanceBvh() = default;
+
+	static float area(glm::vec3 lo, glm::vec3 hi) {
+		glm::vec3 d = glm::max(hi - lo, 0.f);
+		return 2.f * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+
+	void set_slot(int32_t index, int slot, int32_t child, glm::vec3 lo, glm::vec3 hi) {
+		Node& node = self.nodes[index];
+		node.child[slot] = child;
+		node.lo_x[slot] = lo.x;
+		node.lo_y[slot] = lo.y;
+		node.lo_z[slot] = lo.z;
+		node.hi_x[slot] = hi.x;
+		node.hi_y[slot] = hi.y;
+		node.hi_z[slot] = hi.z;
+	}
+
+	void node_box(int32_t index, glm::vec3& lo, glm::vec3& hi) const {
+		const Node& node = self.nodes[index];
+		lo = glm::vec3(MAX_EXTENT);
+		hi = glm::vec3(-MAX_EXTENT);
+		for (int s = 0; s < WIDTH; s++) {
+			lo = glm::min(lo, glm::vec3(node.lo_x[s], node.lo_y[s], node.lo_z[s]));
+			hi = glm::max(hi, glm::vec3(node.hi_x[s], node.hi_y[s], node.hi_z[s]));
+		}
+	}
+
+	int32_t allocate_node(int32_t parent, int32_t parent_slot) {
+		int32_t index;
+		if (!self.free_nodes.empty()) {
+			index = self.free_nodes.back();
+			self.free_nodes.pop_back();
+		} else {
+			index = (int32_t) self.nodes.size();
+			self.nodes.push_back(Node {});
+		}
+		for (int s = 0; s < WIDTH; s++) {
+			set_slot(index, s, EMPTY, glm::vec3(MAX_EXTENT), glm::vec3(-MAX_EXTENT));
+		}
+		self.nodes[index].parent = parent;
+		self.nodes[index].parent_slot = parent_slot;
+		return index;
+	}
+
+	glm::vec3 centroid(int32_t item) const {
+		return (self.items[item].lo + self.items[item].hi) * 0.5f;
+	}
+
+	// Median split along the widest spread of centroids.
+	size_t split(int32_t* first, size_t count) const {
+		glm::vec3 lo = glm::vec3(MAX_EXTENT);
+		glm::vec3 hi = glm::vec3(-MAX_EXTENT);
+		for (size_t i = 0; i < count; i++) {
+			lo = glm::min(lo, centroid(first[i]));
+			hi = glm::max(hi, centroid(first[i]));
+		}
+		glm::vec3 extent = hi - lo;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+
+		size_t half = count / 2;
+		std::nth_element(first, first + half, first + count,
+			[this, axis](int32_t a, int32_t b) { return centroid(a)[axis] < centroid(b)[axis]; }
+		);
+		return half;
+	}
+
+	// Fills node index with the items [first, first + count), two median
+	// splits per level giving its four children.
+	void build(int32_t index, int32_t* first, size_t count) {
+		if (count <= (size_t) WIDTH) {
+			for (size_t i = 0; i < count; i++) {
+				Item& item = self.items[first[i]];
+				item.node = index;
+				item.slot = (int32_t) i;
+				set_slot(index, (int) i, ~first[i], item.lo, item.hi);
+			}
+		} else {
+			size_t half = split(first, count);
+			size_t left = split(first, half);
+			size_t right = split(first + half, count - half);
+			size_t bounds[WIDTH + 1] = { 0, left, half, half + right, count };
+
+			for (int s = 0; s < WIDTH; s++) {
+				int32_t* group = first + bounds[s];
+				size_t size = bounds[s + 1] - bounds[s];
+				if (size == 1) {
+					Item& item = self.items[group[0]];
+					item.node = index;
+					item.slot = s;
+					set_slot(index, s, ~group[0], item.lo, item.hi);
+					continue;
+				}
+
+				int32_t child = allocate_node(index, s);
+				build(child, group, size);
+				glm::vec3 lo, hi;
+				node_box(child, lo, hi);
+				set_slot(index, s, child, lo, hi);
+			}
+		}
+
+		glm::vec3 lo, hi;
+		node_box(index, lo, hi);
+		self.nodes[index].built_area = area(lo, hi);
+	}
+
+	void collect(int32_t index, std::vector<int32_t>& items, bool free_nodes) {
+		for (int s = 0; s < WIDTH; s++) {
+			int32_t child = self.nodes[index].child[s];
+			if (child == EMPTY) { continue; }
+			if (child < 0) {
+				items.push_back(~child);
+			} else {
+				collect(child, items, free_nodes);
+				if (free_nodes) { self.free_nodes.push_back(child); }
+			}
+		}
+	}
+
+	void rebuild() {
+		self.order.clear();
+		for (const auto& [key, item] : self.lookup) {
+			self.order.push_back(item);
+		}
+		self.nodes.clear();
+		self.free_nodes.clear();
+		self.pending.clear();
+		self.num_removed = 0;
+		self.dirty.clear();
+
+		self.root = -1;
+		if (self.order.empty()) { return; }
+		self.root = allocate_node(-1, 0);
+		build(self.root, self.order.data(), self.order.size());
+	}
+
+	void rebuild_subtree(int32_t index) {
+		self.order.clear();
+		collect(index, self.order, true);
+
+		for (int s = 0; s < WIDTH; s++) {
+			set_slot(index, s, EMPTY, glm::vec3(MAX_EXTENT), glm::vec3(-MAX_EXTENT));
+		}
+		if (!self.order.empty()) {
+			build(index, self.order.data(), self.order.size());
+		}
+	}
+
+	bool has_ancestor_in(int32_t index, const std::vector<int32_t>& sorted) const {
+		for (int32_t n = self.nodes[index].parent; n >= 0; n = self.nodes[n].parent) {
+			if (std::binary_search(sorted.begin(), sorted.end(), n)) { return true; }
+		}
+		return false;
+	}
+
+	// Bit s of outside is set when child s is outside the frustum, bit s of
+	// inside when it is entirely inside it.
+	static void classify(const Node& node, const Frustum& frustum, int& outside, int& inside) {
+#ifdef RENDERER_SSE
+		__m128 zero = _mm_setzero_ps();
+		__m128 out = zero;
+		__m128 partial = zero;
+		for (const auto& plane : frustum.planes) {
+			// the corner furthest along the normal decides outside, the
+			// nearest one inside
+			bool px = plane.x >= 0.f;
+			bool py = plane.y >= 0.f;
+			bool pz = plane.z >= 0.f;
+			__m128 nx = _mm_set1_ps(plane.x);
+			__m128 ny = _mm_set1_ps(plane.y);
+			__m128 nz = _mm_set1_ps(plane.z);
+			__m128 w = _mm_set1_ps(plane.w);
+
+			__m128 far_d = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(nx, _mm_load_ps(px ? node.hi_x : node.lo_x)),
+				_mm_mul_ps(ny, _mm_load_ps(py ? node.hi_y : node.lo_y))),
+				_mm_add_ps(_mm_mul_ps(nz, _mm_load_ps(pz ? node.hi_z : node.lo_z)), w)
+			);
+			__m128 near_d = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(nx, _mm_load_ps(px ? node.lo_x : node.hi_x)),
+				_mm_mul_ps(ny, _mm_load_ps(py ? node.lo_y : node.hi_y))),
+				_mm_add_ps(_mm_mul_ps(nz, _mm_load_ps(pz ? node.lo_z : node.hi_z)), w)
+			);
+			out = _mm_or_ps(out, _mm_cmplt_ps(far_d, zero));
+			partial = _mm_or_ps(partial, _mm_cmplt_ps(near_d, zero));
+		}
+		outside = _mm_movemask_ps(out);
+		inside = ~_mm_movemask_ps(partial) & 0xf;
+#else
+		outside = 0;
+		inside = 0;
+		for (int s = 0; s < WIDTH; s++) {
+			glm::vec3 lo = glm::vec3(node.lo_x[s], node.lo_y[s], node.lo_z[s]);
+			glm::vec3 hi = glm::vec3(node.hi_x[s], node.hi_y[s], node.hi_z[s]);
+			bool is_outside = false;
+			bool is_inside = true;
+			for (const auto& plane : frustum.planes) {
+				glm::vec3 n = glm::vec3(plane);
+				glm::vec3 far_corner = glm::vec3(
+					n.x >= 0.f ? hi.x : lo.x, n.y >= 0.f ? hi.y : lo.y, n.z >= 0.f ? hi.z : lo.z
+				);
+				glm::vec3 near_corner = glm::vec3(
+					n.x >= 0.f ? lo.x : hi.x, n.y >= 0.f ? lo.y : hi.y, n.z >= 0.f ? lo.z : hi.z
+				);
+				is_outside = is_outside || glm::dot(n, far_corner) + plane.w < 0.f;
+				is_inside = is_inside && glm::dot(n, near_corner) + plane.w >= 0.f;
+			}
+			outside |= (int) is_outside << s;
+			inside |= (int) is_inside << s;
+		}
+#endif
+	}
+
+	void emit_subtree(int32_t index, std::vector<uint64_t>& visible) const {
+		for (int s = 0; s < WIDTH; s++) {
+			int32_t child = self.nodes[index].child[s];
+			if (child == EMPTY) { continue; }
+			if (child < 0) {
+				visible.push_back(self.items[~child].key);
+			} else {
+				emit_subtree(child, visible);
+			}
+		}
+	}
+
+public:
+	InstanceBvh(const InstanceBvh&) = delete;
+	InstanceBvh& operator=(const InstanceBvh&) = delete;
+	InstanceBvh(InstanceBvh&& other) = delete;
+	InstanceBvh& operator=(InstanceBvh&& other) = delete;
+
+	static std::unique_ptr<InstanceBvh> New() {
+		return std::unique_ptr<InstanceBvh>(new InstanceBvh());
+	}
+
+	void set(uint64_t key, glm::vec3 lo, glm::vec3 hi) {
+		auto it = self.lookup.find(key);
+		if (it == self.lookup.end()) {
+			int32_t index;
+			if (!self.free_items.empty()) {
+				index = self.free_items.back();
+				self.free_items.pop_back();
+			} else {
+				index = (int32_t) self.items.size();
+				self.items.push_back(Item {});
+			}
+			self.items[index] = Item { key, lo, hi, -1, (int32_t) self.pending.size() };
+			self.pending.push_back(index);
+			self.lookup.emplace(key, index);
+			return;
+		}
+
+		Item& item = self.items[it->second];
+		item.lo = lo;
+		item.hi = hi;
+		if (item.node >= 0) {
+			set_slot(item.node, item.slot, ~it->second, lo, hi);
+			self.dirty.push_back(item.node);
+		}
+	}
+
+	// World box of the instance behind key, if it is in the index.
+	bool get_box(uint64_t key, glm::vec3& lo, glm::vec3& hi) const {
+		auto it = self.lookup.find(key);
+		if (it == self.lookup.end()) { return false; }
+
+		const Item& item = self.items[it->second];
+		lo = item.lo;
+		hi = item.hi;
+		return true;
+	}
+
+	void remove(uint64_t key) {
+		auto it = self.lookup.find(key);
+		if (it == self.lookup.end()) { return; }
+
+		int32_t index = it->second;
+		Item& item = self.items[index];
+		if (item.node >= 0) {
+			set_slot(item.node, item.slot, EMPTY, glm::vec3(MAX_EXTENT), glm::vec3(-MAX_EXTENT));
+			self.dirty.push_back(item.node);
+			self.num_removed += 1;
+		} else {
+			int32_t last = self.pending.back();
+			self.pending[item.slot] = last;
+			self.items[last].slot = item.slot;
+			self.pending.pop_back();
+		}
+		self.lookup.erase(it);
+		self.free_items.push_back(index);
+	}
+
+	// Brings the node boxes up to date with this frame's changes, once all
+	// of them are in.
+	void refit() {
+		size_t churn = self.pending.size() + self.num_removed;
+		if (churn >= MIN_REBUILD && churn * 100 >= self.lookup.size() * REBUILD_PERCENT) {
+			rebuild();
+			return;
+		}
+		if (self.dirty.empty()) { return; }
+
+		std::sort(self.dirty.begin(), self.dirty.end());
+		self.dirty.erase(std::unique(self.dirty.begin(), self.dirty.end()), self.dirty.end());
+
+		self.loose.clear();
+		for (int32_t index : self.dirty) {
+			int32_t loosest = -1;
+			for (int32_t n = index; n >= 0; n = self.nodes[n].parent) {
+				glm::vec3 lo, hi;
+				node_box(n, lo, hi);
+				if (area(lo, hi) > self.nodes[n].built_area * REBUILD_GROWTH) {
+					loosest = n;
+				}
+				const Node& node = self.nodes[n];
+				if (node.parent >= 0) {
+					set_slot(node.parent, node.parent_slot, n, lo, hi);
+				}
+			}
+			if (loosest >= 0) { self.loose.push_back(loosest); }
+		}
+		self.dirty.clear();
+
+		if (self.loose.empty()) { return; }
+		if (std::find(self.loose.begin(), self.loose.end(), self.root) != self.loose.end()) {
+			rebuild();
+			return;
+		}
+		std::sort(self.loose.begin(), self.loose.end());
+		self.loose.erase(std::unique(self.loose.begin(), self.loose.end()), self.loose.end());
+		std::vector<int32_t> outermost;
+		for (int32_t index : self.loose) {
+			if (!has_ancestor_in(index, self.loose)) { outermost.push_back(index); }
+		}
+		for (int32_t index : outermost) {
+			rebuild_subtree(index);
+		}
+	}
+
+	// Keys of the instances whose boxes touch the frustum, appended to
+	// visible after clearing it.
+	void cull(const Frustum& frustum, std::vector<uint64_t>& visible) {
+		visible.clear();
+
+		for (int32_t index : self.pending) {
+			const Item& item = self.items[index];
+			if (frustum.intersects_box(item.lo, item.hi)) {
+				visible.push_back(item.key);
+			}
+		}
+
+		if (self.root < 0) { return; }
+		auto& stack = self.stack;
+		stack.clear();
+		stack.push_back(self.root);
+		while (!stack.empty()) {
+			const Node& node = self.nodes[stack.back()];
+			stack.pop_back();
+
+			int outside, inside;
+			classify(node, frustum, outside, inside);
+			for (int s = 0; s < WIDTH; s++) {
+				int32_t child = node.child[s];
+				if (child == EMPTY || (outside >> s) & 1) { continue; }
+				if (child < 0) {
+					visible.push_back(self.items[~child].key);
+				} else if ((inside >> s) & 1) {
+					emit_subtree(child, visible);
+				} else {
+					stack.push_back(child);
+				}
+			}
+		}
+	}
+};
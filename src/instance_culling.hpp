@@ -0,0 +1,468 @@
+#pragma once
+
+#include "object.hpp"
+#include "frustum.hpp"
+#include "depth_pyramid.hpp"
+
+// Frustum culls every instance of every mesh on the GPU. Once per frame the
+// instances are gathered into one storage buffer; each pass then packs the
+// ones inside its frustum into a second buffer, grouped by mesh and level of
+// detail, and counts them straight into that level's indirect draw command.
+// Nothing is read back, and the whole pass is one multi-draw over the
+// geometry arena.
+//
+// Instances of clustered meshes in full detail are also listed for a second
+// compute pass, one work group per instance and cluster, which culls each
+// cluster against the frustum and its normal cone and copies the indices of
+// the survivors into the instance's own range of a second index buffer. A
+// second multi-draw, one command per such instance, draws from there.
+//
+// For occlusion culling, the instances large on screen in a view are drawn
+// first into a DepthPyramid, and passes that ask for it then also cull what
+// lies behind them.
+class InstanceCulling {
+public:
+	static constexpr GLuint INSTANCES_BINDING = 8;
+	static constexpr GLuint MESHES_BINDING = 9;
+	static constexpr GLuint VISIBLE_BINDING = 10;
+	static constexpr GLuint COMMANDS_BINDING = 11;
+	static constexpr GLuint CLUSTERS_BINDING = 12;
+	static constexpr GLuint ARENA_INDICES_BINDING = 13;
+	static constexpr GLuint CLUSTER_WORK_BINDING = 14;
+	static constexpr GLuint CLUSTER_COMMANDS_BINDING = 15;
+	static constexpr GLuint CLUSTER_INDICES_BINDING = 16;
+	static constexpr GLuint WORKGROUP_SIZE = 64;
+	// projected radius over half the screen height, the same measure as
+	// InstantiableMesh::LOD_BASE_SIZE; no smaller, so occluders draw in
+	// full detail
+	static constexpr float OCCLUDER_SIZE = 0.25f;
+	static_assert(OCCLUDER_SIZE >= InstantiableMesh::LOD_BASE_SIZE);
+
+	// layout of glDrawElementsIndirect
+	struct DrawCommand {
+		GLuint count;
+		GLuint instance_count;
+		GLuint first_index;
+		GLint base_vertex;
+		GLuint base_instance;
+	};
+
+	struct CullMesh {
+		glm::vec4 sphere;
+		GLuint first_instance;
+		GLuint num_instances;
+		// one command per level of detail, and room for all instances at
+		// each level in the visible buffer
+		GLuint first_command;
+		GLuint num_lods;
+		GLuint first_visible;
+		// clusters of the full level, if any, and the first of the cluster
+		// commands, one per instance; the level's own command then only
+		// counts instances and draws nothing
+		GLuint first_cluster;
+		GLuint num_clusters;
+		GLuint first_cluster_command;
+	};
+
+	// glDispatchComputeIndirect arguments, then the instances for the
+	// cluster pass as mesh and slot in the visible buffer's full level
+	struct ClusterWorkHeader {
+		GLuint num_groups_x;
+		GLuint num_groups_y;
+		GLuint num_groups_z;
+		GLuint pad;
+	};
+
+private:
+	struct Self {
+		std::unique_ptr<ShaderProgram> program;
+		GLint l_planes = -1;
+		GLint l_view_projection = -1;
+		GLint l_lod_scale = -1;
+		GLint l_lod_bias = -1;
+		GLint l_occluders_only = -1;
+		GLint l_occlusion = -1;
+		GLint l_depth_pyramid = -1;
+		GLint l_depth_size = -1;
+		std::unique_ptr<ShaderProgram> cluster_program;
+		GLint l_cluster_planes = -1;
+		GLint l_cluster_eye = -1;
+		GLint l_cluster_short_indices = -1;
+
+		std::vector<InstantiableMesh*> meshes;
+		std::vector<CullMesh> cull_meshes;
+		// instance counts zeroed, copied over the live commands every pass
+		std::vector<DrawCommand> commands;
+		GLuint max_instances = 0;
+		// counts and zeroed counts the same way
+		std::vector<DrawCommand> cluster_commands;
+		GLuint max_clusters = 0;
+
+		// null when its programs are unavailable
+		std::unique_ptr<DepthPyramid> depth_pyramid;
+		// built from the instances gathered last
+		bool occlusion_ready = false;
+
+		// arena geometry, instances from ssbo_visible; cluster_vao takes
+		// its indices from cluster_indices
+		GeometryArena* arena = nullptr;
+		GLuint vao = 0;
+		GLuint cluster_vao = 0;
+
+		GLuint ssbo_instances = 0;
+		GLuint ssbo_visible = 0;
+		GLuint ssbo_meshes = 0;
+		GLuint commands_template = 0;
+		GLuint indirect = 0;
+		size_t instances_capacity = 0;
+		size_t visible_capacity = 0;
+
+		GLuint ssbo_clusters = 0;
+		GLuint cluster_work = 0;
+		GLuint cluster_work_template = 0;
+		GLuint cluster_commands_template = 0;
+		GLuint cluster_indirect = 0;
+		GLuint cluster_indices = 0;
+		size_t cluster_slots_capacity = 0;
+		size_t cluster_indices_capacity = 0;
+	} self;
+
+	InstanceCulling() = default;
+
+	// Contents are lost.
+	static void grow(GLuint buffer, size_t& capacity, size_t needed, size_t bytes, size_t header, GLenum usage) {
+		if (needed <= capacity) { return; }
+
+		capacity = std::max(needed, capacity * 2);
+		glNamedBufferData(buffer, header + capacity * bytes, nullptr, usage);
+	}
+
+	// occluders_only keeps just the instances large enough to occlude;
+	// occlusion also culls against the depth pyramid.
+	void cull_and_draw(
+		const glm::mat4& view_projection, int lod_bias, bool occluders_only, bool occlusion
+	) {
+		if (self.max_instances == 0) { return; }
+
+		glCopyNamedBufferSubData(
+			self.commands_template, self.indirect, 0, 0,
+			self.commands.size() * sizeof(DrawCommand)
+		);
+		bool clusters = !self.cluster_commands.empty();
+		if (clusters) {
+			glCopyNamedBufferSubData(
+				self.cluster_commands_template, self.cluster_indirect, 0, 0,
+				self.cluster_commands.size() * sizeof(DrawCommand)
+			);
+			glCopyNamedBufferSubData(
+				self.cluster_work_template, self.cluster_work, 0, 0, sizeof(ClusterWorkHeader)
+			);
+		}
+
+		GLint pass_program = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &pass_program);
+
+		Frustum frustum = Frustum::FromMatrix(view_projection);
+		self.program->use();
+		self.program->uniform(self.l_planes, frustum.planes);
+		self.program->uniform(self.l_view_projection, view_projection);
+		self.program->uniform(self.l_lod_scale, InstantiableMesh::LodScale(view_projection));
+		self.program->uniform(self.l_lod_bias, (GLint) lod_bias);
+		self.program->uniform(self.l_occluders_only, (GLint) occluders_only);
+		self.program->uniform(self.l_occlusion, (GLint) occlusion);
+		if (occlusion) {
+			self.depth_pyramid->bind();
+			self.program->uniform(self.l_depth_pyramid, DepthPyramid::TEXTURE_UNIT);
+			self.program->uniform(self.l_depth_size, glm::vec2(self.depth_pyramid->get_resolution()));
+		}
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCES_BINDING, self.ssbo_instances);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MESHES_BINDING, self.ssbo_meshes);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VISIBLE_BINDING, self.ssbo_visible);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, COMMANDS_BINDING, self.indirect);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_WORK_BINDING, self.cluster_work);
+		GLuint groups = (self.max_instances + WORKGROUP_SIZE - 1) / WORKGROUP_SIZE;
+		glDispatchCompute(groups, (GLuint) self.meshes.size(), 1);
+		glMemoryBarrier(
+			GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT
+		);
+
+		if (clusters) {
+			self.cluster_program->use();
+			self.cluster_program->uniform(self.l_cluster_planes, frustum.planes);
+			self.cluster_program->uniform(self.l_cluster_eye, frustum.eye);
+			self.cluster_program->uniform(
+				self.l_cluster_short_indices, (GLint) (self.arena->get_index_type() == GL_UNSIGNED_SHORT)
+			);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTERS_BINDING, self.ssbo_clusters);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, ARENA_INDICES_BINDING, self.arena->get_index_buffer());
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_COMMANDS_BINDING, self.cluster_indirect);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_BINDING, self.cluster_indices);
+			glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, self.cluster_work);
+			glDispatchComputeIndirect(0);
+			glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+			glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT);
+		}
+
+		glUseProgram(pass_program);
+		glBindVertexArray(self.vao);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, self.indirect);
+		glMultiDrawElementsIndirect(
+			GL_TRIANGLES, self.arena->get_index_type(), (void*) 0, (GLsizei) self.commands.size(), 0
+		);
+		if (clusters) {
+			glBindVertexArray(self.cluster_vao);
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, self.cluster_indirect);
+			glMultiDrawElementsIndirect(
+				GL_TRIANGLES, GL_UNSIGNED_INT, (void*) 0, (GLsizei) self.cluster_commands.size(), 0
+			);
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		glBindVertexArray(0);
+	}
+
+public:
+	InstanceCulling(const InstanceCulling&) = delete;
+	InstanceCulling& operator=(const InstanceCulling&) = delete;
+	InstanceCulling(InstanceCulling&& other) = delete;
+	InstanceCulling& operator=(InstanceCulling&& other) = delete;
+
+	~InstanceCulling() {
+		GLuint buffers[] = {
+			self.ssbo_instances, self.ssbo_visible, self.ssbo_meshes,
+			self.commands_template, self.indirect
+		};
+		glDeleteBuffers(5, buffers);
+		GLuint cluster_buffers[] = {
+			self.ssbo_clusters, self.cluster_work, self.cluster_work_template,
+			self.cluster_commands_template, self.cluster_indirect, self.cluster_indices
+		};
+		glDeleteBuffers(6, cluster_buffers);
+		glDeleteVertexArrays(1, &self.vao);
+		glDeleteVertexArrays(1, &self.cluster_vao);
+	}
+
+	static std::optional<std::unique_ptr<InstanceCulling>>
+	New(const std::vector<InstantiableMesh*>& meshes, GeometryArena* arena) {
+		auto program_opt = ShaderProgram::NewCompute(
+			"shaders/cull_instances.comp",
+			{
+				{ "WORKGROUP_SIZE", std::to_string(WORKGROUP_SIZE) },
+				{ "LOD_BASE_SIZE", std::to_string(InstantiableMesh::LOD_BASE_SIZE) },
+				{ "OCCLUDER_SIZE", std::to_string(OCCLUDER_SIZE) },
+			}
+		);
+		if (!program_opt.has_value()) {
+			std::cerr << "Could not load instance culling shader program.\n";
+			return std::nullopt;
+		}
+		auto cluster_program_opt = ShaderProgram::NewCompute(
+			"shaders/cull_clusters.comp",
+			{ { "CLUSTER_TRIANGLES", std::to_string(MeshClusters::MAX_TRIANGLES) } }
+		);
+		if (!cluster_program_opt.has_value()) {
+			std::cerr << "Could not load cluster culling shader program.\n";
+			return std::nullopt;
+		}
+
+		auto culling = std::unique_ptr<InstanceCulling>(new InstanceCulling());
+		auto& self = culling->self;
+
+		self.program = std::move(program_opt.value());
+		self.l_planes = self.program->location("planes");
+		self.l_view_projection = self.program->location("view_projection");
+		self.l_lod_scale = self.program->location("lod_scale");
+		self.l_lod_bias = self.program->location("lod_bias");
+		self.l_occluders_only = self.program->location("occluders_only");
+		self.l_occlusion = self.program->location("occlusion");
+		self.l_depth_pyramid = self.program->location("depth_pyramid");
+		self.l_depth_size = self.program->location("depth_size");
+		self.cluster_program = std::move(cluster_program_opt.value());
+		self.l_cluster_planes = self.cluster_program->location("planes");
+		self.l_cluster_eye = self.cluster_program->location("eye");
+		self.l_cluster_short_indices = self.cluster_program->location("short_indices");
+
+		for (auto mesh : meshes) {
+			if (mesh->get_num_triangles() == 0) { continue; }
+			self.meshes.push_back(mesh);
+		}
+		self.cull_meshes.resize(self.meshes.size());
+		size_t num_commands = 0;
+		for (auto mesh : self.meshes) {
+			num_commands += mesh->get_lods().size();
+		}
+		self.commands.resize(num_commands);
+
+		size_t count = std::max(num_commands, (size_t) 1);
+		glCreateBuffers(1, &self.ssbo_instances);
+		glCreateBuffers(1, &self.ssbo_visible);
+		glCreateBuffers(1, &self.ssbo_meshes);
+		glCreateBuffers(1, &self.commands_template);
+		glCreateBuffers(1, &self.indirect);
+		glNamedBufferStorage(
+			self.ssbo_meshes, std::max(self.meshes.size(), (size_t) 1) * sizeof(CullMesh), nullptr,
+			GL_DYNAMIC_STORAGE_BIT
+		);
+		glNamedBufferStorage(
+			self.commands_template, count * sizeof(DrawCommand), nullptr, GL_DYNAMIC_STORAGE_BIT
+		);
+		glNamedBufferStorage(self.indirect, count * sizeof(DrawCommand), nullptr, 0);
+
+		// cluster first indices become absolute in the arena
+		std::vector<MeshClusters::Cluster> clusters;
+		for (auto mesh : self.meshes) {
+			GLuint first_index = mesh->get_lods()[0].first_index;
+			for (auto cluster : mesh->get_clusters()) {
+				cluster.first_index += first_index;
+				clusters.push_back(cluster);
+			}
+			self.max_clusters = std::max(self.max_clusters, (GLuint) mesh->get_clusters().size());
+		}
+		glCreateBuffers(1, &self.ssbo_clusters);
+		glCreateBuffers(1, &self.cluster_work);
+		glCreateBuffers(1, &self.cluster_work_template);
+		glCreateBuffers(1, &self.cluster_commands_template);
+		glCreateBuffers(1, &self.cluster_indirect);
+		glCreateBuffers(1, &self.cluster_indices);
+		glNamedBufferStorage(
+			self.ssbo_clusters, std::max(clusters.size(), (size_t) 1) * sizeof(MeshClusters::Cluster),
+			clusters.empty() ? nullptr : clusters.data(), 0
+		);
+		ClusterWorkHeader header { 0, self.max_clusters, 1, 0 };
+		glNamedBufferStorage(self.cluster_work_template, sizeof(header), &header, 0);
+
+		self.arena = arena;
+		glGenVertexArrays(1, &self.vao);
+		arena->setup_vertex_attributes(self.vao);
+		GeometryArena::setup_instance_attributes(self.vao, self.ssbo_visible);
+		glGenVertexArrays(1, &self.cluster_vao);
+		arena->setup_vertex_attributes(self.cluster_vao);
+		GeometryArena::setup_instance_attributes(self.cluster_vao, self.ssbo_visible);
+		glVertexArrayElementBuffer(self.cluster_vao, self.cluster_indices);
+
+		auto depth_pyramid_opt = DepthPyramid::New();
+		if (depth_pyramid_opt.has_value()) {
+			self.depth_pyramid = std::move(depth_pyramid_opt.value());
+		}
+
+		return culling;
+	}
+
+	// Gathers this frame's instances, once all of them have been updated.
+	void gather() {
+		self.occlusion_ready = false;
+		size_t total_instances = 0;
+		size_t total_visible = 0;
+		size_t total_cluster_slots = 0;
+		size_t total_cluster_indices = 0;
+		for (auto mesh : self.meshes) {
+			size_t num_instances = mesh->get_num_instances();
+			total_instances += num_instances;
+			total_visible += num_instances * mesh->get_lods().size();
+			if (!mesh->get_clusters().empty()) {
+				total_cluster_slots += num_instances;
+				total_cluster_indices += num_instances * mesh->get_lods()[0].count;
+			}
+		}
+		grow(self.ssbo_instances, self.instances_capacity, total_instances, sizeof(InstanceData), 0, GL_DYNAMIC_DRAW);
+		grow(self.ssbo_visible, self.visible_capacity, total_visible, sizeof(InstanceData), 0, GL_DYNAMIC_COPY);
+		size_t slots_capacity = self.cluster_slots_capacity;
+		grow(
+			self.cluster_work, self.cluster_slots_capacity, total_cluster_slots, sizeof(glm::uvec2),
+			sizeof(ClusterWorkHeader), GL_DYNAMIC_COPY
+		);
+		if (self.cluster_slots_capacity != slots_capacity) {
+			slots_capacity = self.cluster_slots_capacity;
+			glNamedBufferData(
+				self.cluster_commands_template, slots_capacity * sizeof(DrawCommand), nullptr, GL_DYNAMIC_DRAW
+			);
+			glNamedBufferData(self.cluster_indirect, slots_capacity * sizeof(DrawCommand), nullptr, GL_DYNAMIC_COPY);
+		}
+		grow(
+			self.cluster_indices, self.cluster_indices_capacity, total_cluster_indices, sizeof(GLuint), 0,
+			GL_DYNAMIC_COPY
+		);
+
+		GLuint first_instance = 0;
+		GLuint first_command = 0;
+		GLuint first_visible = 0;
+		GLuint first_cluster = 0;
+		GLuint first_cluster_index = 0;
+		self.cluster_commands.clear();
+		self.max_instances = 0;
+		for (size_t m = 0; m < self.meshes.size(); m++) {
+			auto mesh = self.meshes[m];
+			GLuint num_instances = (GLuint) mesh->get_num_instances();
+			mesh->copy_instances_to(
+				self.ssbo_instances, first_instance * sizeof(InstanceData)
+			);
+
+			const auto& lods = mesh->get_lods();
+			GLuint num_clusters = (GLuint) mesh->get_clusters().size();
+			self.cull_meshes[m] = CullMesh {
+				mesh->get_bounds(), first_instance, num_instances,
+				first_command, (GLuint) lods.size(), first_visible,
+				first_cluster, num_clusters, (GLuint) self.cluster_commands.size()
+			};
+			GLint base_vertex = mesh->get_range().base_vertex;
+			if (num_clusters > 0) {
+				GLuint count = (GLuint) lods[0].count;
+				for (GLuint slot = 0; slot < num_instances; slot++) {
+					self.cluster_commands.push_back(DrawCommand {
+						0, 1, first_cluster_index, base_vertex, first_visible + slot
+					});
+					first_cluster_index += count;
+				}
+			}
+			for (const auto& lod : lods) {
+				bool counts_only = num_clusters > 0 && &lod == &lods[0];
+				self.commands[first_command++] = DrawCommand {
+					counts_only ? 0 : (GLuint) lod.count, 0, lod.first_index, base_vertex, first_visible
+				};
+				first_visible += num_instances;
+			}
+			first_instance += num_instances;
+			first_cluster += num_clusters;
+			self.max_instances = std::max(self.max_instances, num_instances);
+		}
+
+		if (self.meshes.empty()) { return; }
+		glNamedBufferSubData(
+			self.ssbo_meshes, 0, self.cull_meshes.size() * sizeof(CullMesh),
+			self.cull_meshes.data()
+		);
+		glNamedBufferSubData(
+			self.commands_template, 0, self.commands.size() * sizeof(DrawCommand),
+			self.commands.data()
+		);
+		if (!self.cluster_commands.empty()) {
+			glNamedBufferSubData(
+				self.cluster_commands_template, 0, self.cluster_commands.size() * sizeof(DrawCommand),
+				self.cluster_commands.data()
+			);
+		}
+	}
+
+	// Draws the occluders of view_projection into the depth pyramid, for
+	// passes from the same view to cull against until the next gather().
+	void build_occlusion(const glm::mat4& view_projection, glm::ivec2 res) {
+		if (!self.depth_pyramid || self.max_instances == 0) { return; }
+
+		GLint pass_program = 0;
+		glGetIntegerv(GL_CURRENT_PROGRAM, &pass_program);
+		self.depth_pyramid->render(view_projection, res, [this](const glm::mat4& occluder_view_projection) {
+			cull_and_draw(occluder_view_projection, 0, true, false);
+		});
+		glUseProgram(pass_program);
+		self.occlusion_ready = true;
+	}
+
+	// Culls against the frustum of view_projection and draws the survivors
+	// at the level of detail their size calls for, lod_bias levels coarser,
+	// leaving the pass's program current. With occlusion, and a depth
+	// pyramid built from the same view this frame, instances hidden behind
+	// its occluders are culled as well. Passes must cull back faces for the
+	// cluster pass's normal cones to hold.
+	void draw(const glm::mat4& view_projection, int lod_bias = 0, bool occlusion = false) {
+		cull_and_draw(view_projection, lod_bias, false, occlusion && self.occlusion_ready);
+	}
+};
@@ -27,6 +27,7 @@ private:
 		float spinn;
 		float spout;
 		glm::mat4 projlmat;
+		bool baked = false;
 	} self;
 
 	Light() = default;
@@ -216,6 +217,11 @@ public:
 		self.projlmat = calc_projlmat(self);
 	};
 
+	// Baked lights never move; their light on static geometry comes from
+	// the offline bake instead of being shaded every frame.
+	bool is_baked() const { return self.baked; }
+	void set_baked(bool baked) { self.baked = baked; }
+
 	glm::mat4 get_projlmat() const { return self.projlmat; };
 	glm::mat4 get_new_projlmat() {
 		self.projlmat = calc_projlmat(self);
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "object.hpp"
+#include "light.hpp"
+
+// Per-vertex lighting of every static instance, rgb in the shader's diffuse
+// units and w = 1 where baked. offsets has one entry per map instance.
+struct BakedLighting {
+	static constexpr uint32_t MAGIC = 0x4b414231;
+
+	uint64_t scene_hash = 0;
+	std::vector<GLint> offsets;
+	std::vector<glm::vec4> lighting;
+
+	bool save(const std::string& path) const {
+		std::ofstream file(path, std::ios::binary);
+		if (!file) {
+			std::cerr << "Could not write baked lighting to " << path << "\n";
+			return false;
+		}
+
+		uint64_t num_offsets = offsets.size();
+		uint64_t num_lighting = lighting.size();
+		file.write((const char*) &MAGIC, sizeof(MAGIC));
+		file.write((const char*) &scene_hash, sizeof(scene_hash));
+		file.write((const char*) &num_offsets, sizeof(num_offsets));
+		file.write((const char*) &num_lighting, sizeof(num_lighting));
+		file.write((const char*) offsets.data(), num_offsets * sizeof(GLint));
+		file.write((const char*) lighting.data(), num_lighting * sizeof(glm::vec4));
+		return (bool) file;
+	}
+
+	// Fails quietly when there is no bake, loudly when it is stale.
+	static std::optional<BakedLighting> Load(const std::string& path, uint64_t scene_hash) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file) { return std::nullopt; }
+
+		BakedLighting baked;
+		uint32_t magic = 0;
+		uint64_t num_offsets = 0;
+		uint64_t num_lighting = 0;
+		file.read((char*) &magic, sizeof(magic));
+		file.read((char*) &baked.scene_hash, sizeof(baked.scene_hash));
+		file.read((char*) &num_offsets, sizeof(num_offsets));
+		file.read((char*) &num_lighting, sizeof(num_lighting));
+		if (!file || magic != MAGIC || baked.scene_hash != scene_hash) {
+			std::cerr << "Baked lighting in " << path << " is stale, run with --bake.\n";
+			return std::nullopt;
+		}
+
+		baked.offsets.resize(num_offsets);
+		baked.lighting.resize(num_lighting);
+		file.read((char*) baked.offsets.data(), num_offsets * sizeof(GLint));
+		file.read((char*) baked.lighting.data(), num_lighting * sizeof(glm::vec4));
+		if (!file) {
+			std::cerr << "Baked lighting in " << path << " is truncated.\n";
+			return std::nullopt;
+		}
+		return baked;
+	}
+};
+
+// Offline path tracer for the light of baked lights on static geometry. The
+// static triangles go into one BVH; each vertex gathers the direct light
+// plus SAMPLES cosine-weighted paths of up to BOUNCES diffuse bounces, split
+// over all cores.
+class LightBaker {
+public:
+	static constexpr int SAMPLES = 256;
+	static constexpr int BOUNCES = 3;
+	static constexpr int LEAF_SIZE = 4;
+	static constexpr float RAY_OFFSET = 1e-2f;
+
+	// A static instance; index is its position in the map's instance list.
+	struct Receiver {
+		size_t index;
+		const InstantiableMesh* mesh;
+		glm::mat4 model;
+		glm::vec3 albedo;
+	};
+
+private:
+	struct Triangle {
+		glm::vec3 v0;
+		glm::vec3 e1;
+		glm::vec3 e2;
+		int receiver;
+	};
+
+	// Interior nodes keep their left child right after them, count == 0 and
+	// first pointing at the right child.
+	struct Node {
+		glm::vec3 lo;
+		int first;
+		glm::vec3 hi;
+		int count;
+	};
+
+	struct Hit {
+		float t;
+		int triangle;
+	};
+
+	struct Rng {
+		uint64_t state;
+
+		float next() {
+			state ^= state >> 12;
+			state ^= state << 25;
+			state ^= state >> 27;
+			return (float) ((state * 2685821657736338717ull) >> 40) / (float) (1ull << 24);
+		}
+	};
+
+	struct Self {
+		std::vector<Receiver> receivers;
+		std::vector<const Light*> lights;
+
+		std::vector<Triangle> triangles;
+		std::vector<Node> nodes;
+	} self;
+
+	LightBaker() = default;
+
+	int build(int first, int count, std::vector<glm::vec3>& centroids) {
+		int index = (int) self.nodes.size();
+		self.nodes.push_back(Node {});
+
+		glm::vec3 lo = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::max());
+		glm::vec3 c_lo = lo;
+		glm::vec3 c_hi = hi;
+		for (int i = first; i < first + count; i++) {
+			const Triangle& tri = self.triangles[i];
+			for (glm::vec3 v : { tri.v0, tri.v0 + tri.e1, tri.v0 + tri.e2 }) {
+				lo = glm::min(lo, v);
+				hi = glm::max(hi, v);
+			}
+			c_lo = glm::min(c_lo, centroids[i]);
+			c_hi = glm::max(c_hi, centroids[i]);
+		}
+		self.nodes[index].lo = lo;
+		self.nodes[index].hi = hi;
+
+		if (count <= LEAF_SIZE) {
+			self.nodes[index].first = first;
+			self.nodes[index].count = count;
+			return index;
+		}
+
+		// median split along the widest spread of centroids
+		glm::vec3 extent = c_hi - c_lo;
+		int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+		int half = count / 2;
+		std::vector<int> order(count);
+		for (int i = 0; i < count; i++) {
+			order[i] = first + i;
+		}
+		std::nth_element(order.begin(), order.begin() + half, order.end(),
+			[&centroids, axis](int a, int b) { return centroids[a][axis] < centroids[b][axis]; }
+		);
+		std::vector<Triangle> triangles(count);
+		std::vector<glm::vec3> sorted_centroids(count);
+		for (int i = 0; i < count; i++) {
+			triangles[i] = self.triangles[order[i]];
+			sorted_centroids[i] = centroids[order[i]];
+		}
+		std::copy(triangles.begin(), triangles.end(), self.triangles.begin() + first);
+		std::copy(sorted_centroids.begin(), sorted_centroids.end(), centroids.begin() + first);
+
+		build(first, half, centroids);
+		int right = build(first + half, count - half, centroids);
+		self.nodes[index].first = right;
+		self.nodes[index].count = 0;
+		return index;
+	}
+
+	static bool hits_box(const Node& node, glm::vec3 origin, glm::vec3 inv_dir, float t_max) {
+		glm::vec3 t0 = (node.lo - origin) * inv_dir;
+		glm::vec3 t1 = (node.hi - origin) * inv_dir;
+		glm::vec3 t_near = glm::min(t0, t1);
+		glm::vec3 t_far = glm::max(t0, t1);
+		float enter = std::max(std::max(t_near.x, t_near.y), std::max(t_near.z, 0.f));
+		float exit = std::min(std::min(t_far.x, t_far.y), std::min(t_far.z, t_max));
+		return enter <= exit;
+	}
+
+	static float hit_triangle(const Triangle& tri, glm::vec3 origin, glm::vec3 dir) {
+		glm::vec3 p = glm::cross(dir, tri.e2);
+		float det = glm::dot(tri.e1, p);
+		if (std::abs(det) < 1e-12f) { return -1.f; }
+
+		float inv_det = 1.f / det;
+		glm::vec3 s = origin - tri.v0;
+		float u = glm::dot(s, p) * inv_det;
+		if (u < 0.f || u > 1.f) { return -1.f; }
+		glm::vec3 q = glm::cross(s, tri.e1);
+		float v = glm::dot(dir, q) * inv_det;
+		if (v < 0.f || u + v > 1.f) { return -1.f; }
+		return glm::dot(tri.e2, q) * inv_det;
+	}
+
+	// Closest hit before t_max, or any hit when any_hit is set.
+	bool trace(glm::vec3 origin, glm::vec3 dir, float t_max, bool any_hit, Hit& hit) const {
+		glm::vec3 inv_dir = 1.f / dir;
+		std::array<int, 64> stack;
+		int top = 0;
+		stack[top++] = 0;
+		hit.t = t_max;
+		hit.triangle = -1;
+
+		while (top > 0) {
+			const Node& node = self.nodes[stack[--top]];
+			if (!hits_box(node, origin, inv_dir, hit.t)) { continue; }
+
+			if (node.count == 0) {
+				stack[top++] = node.first;
+				stack[top++] = (int) (&node - self.nodes.data()) + 1;
+				continue;
+			}
+			for (int i = node.first; i < node.first + node.count; i++) {
+				float t = hit_triangle(self.triangles[i], origin, dir);
+				if (t > 0.f && t < hit.t) {
+					hit.t = t;
+					hit.triangle = i;
+					if (any_hit) { return true; }
+				}
+			}
+		}
+		return hit.triangle != -1;
+	}
+
+	// Same terms as calculate_cluster_contribution without specular, which
+	// a bake cannot capture.
+	glm::vec3 direct(glm::vec3 pos, glm::vec3 nor) const {
+		glm::vec3 sum = glm::vec3(0.f);
+		glm::vec3 origin = pos + nor * RAY_OFFSET;
+
+		for (const Light* light : self.lights) {
+			glm::vec3 to_light = light->get_pos() - pos;
+			float d = glm::length(to_light);
+			if (d > light->get_range() || d < 1e-4f) { continue; }
+			glm::vec3 dir = to_light / d;
+
+			float diff = glm::dot(nor, dir);
+			if (diff <= 0.f) { continue; }
+
+			float intensity = 1.f;
+			if (light->get_type() == LightType::Spot) {
+				float theta = glm::dot(dir, -glm::normalize(light->get_dir()));
+				float cos_inner = std::cos(light->get_spinn());
+				float cos_outer = std::cos(light->get_spout());
+				float x = glm::clamp((theta - cos_outer) / (cos_inner - cos_outer), 0.f, 1.f);
+				intensity = x * x * (3.f - 2.f * x);
+				if (intensity <= 0.f) { continue; }
+			}
+
+			glm::vec3 to_origin = light->get_pos() - origin;
+			float shadow_d = glm::length(to_origin);
+			Hit hit;
+			if (trace(origin, to_origin / shadow_d, shadow_d, true, hit)) { continue; }
+
+			float att = 1.f / (1.f + light->get_attl() * d + light->get_attq() * d * d);
+			sum += diff * att * intensity * light->get_col();
+		}
+		return sum;
+	}
+
+	static glm::vec3 cosine_sample(glm::vec3 nor, Rng& rng) {
+		float u1 = rng.next();
+		float u2 = rng.next();
+		float r = std::sqrt(u1);
+		float phi = glm::two_pi<float>() * u2;
+
+		glm::vec3 helper = std::abs(nor.x) > 0.9f ? glm::vec3(0.f, 1.f, 0.f) : glm::vec3(1.f, 0.f, 0.f);
+		glm::vec3 tangent = glm::normalize(glm::cross(helper, nor));
+		glm::vec3 bitangent = glm::cross(nor, tangent);
+		return r * std::cos(phi) * tangent + r * std::sin(phi) * bitangent
+			+ std::sqrt(std::max(1.f - u1, 0.f)) * nor;
+	}
+
+	// With cosine-weighted directions the irradiance estimate, in the
+	// shader's units, is the plain mean of the radiance along the paths.
+	glm::vec3 gather(glm::vec3 pos, glm::vec3 nor, Rng& rng) const {
+		glm::vec3 indirect = glm::vec3(0.f);
+		for (int s = 0; s < SAMPLES; s++) {
+			glm::vec3 origin = pos;
+			glm::vec3 normal = nor;
+			glm::vec3 throughput = glm::vec3(1.f);
+
+			for (int bounce = 0; bounce < BOUNCES; bounce++) {
+				glm::vec3 dir = cosine_sample(normal, rng);
+				Hit hit;
+				if (!trace(origin + normal * RAY_OFFSET, dir, std::numeric_limits<float>::max(), false, hit)) {
+					break;
+				}
+
+				const Triangle& tri = self.triangles[hit.triangle];
+				glm::vec3 hit_nor = glm::normalize(glm::cross(tri.e1, tri.e2));
+				if (glm::dot(hit_nor, dir) > 0.f) {
+					hit_nor = -hit_nor;
+				}
+				origin = origin + normal * RAY_OFFSET + dir * hit.t;
+				normal = hit_nor;
+				throughput *= self.receivers[tri.receiver].albedo;
+				indirect += throughput * direct(origin, normal);
+			}
+		}
+		return direct(pos, nor) + indirect / (float) SAMPLES;
+	}
+
+public:
+	LightBaker(const LightBaker&) = delete;
+	LightBaker& operator=(const LightBaker&) = delete;
+	LightBaker(LightBaker&& other) = delete;
+	LightBaker& operator=(LightBaker&& other) = delete;
+
+	static std::unique_ptr<LightBaker> New(
+		std::vector<Receiver> receivers, std::vector<const Light*> lights
+	) {
+		auto baker = std::unique_ptr<LightBaker>(new LightBaker());
+		auto& self = baker->self;
+
+		self.receivers = std::move(receivers);
+		self.lights = std::move(lights);
+
+		std::vector<glm::vec3> centroids;
+		for (size_t r = 0; r < self.receivers.size(); r++) {
+			const Receiver& receiver = self.receivers[r];
+			if (receiver.mesh->get_num_triangles() == 0) { continue; }
+
+			const Vertices& vertices = receiver.mesh->get_vertices();
+			const Indices& indices = receiver.mesh->get_indices();
+			for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+				glm::vec3 p0 = glm::vec3(receiver.model * glm::vec4(vertices[indices[i]].pos, 1.f));
+				glm::vec3 p1 = glm::vec3(receiver.model * glm::vec4(vertices[indices[i + 1]].pos, 1.f));
+				glm::vec3 p2 = glm::vec3(receiver.model * glm::vec4(vertices[indices[i + 2]].pos, 1.f));
+				self.triangles.push_back(Triangle { p0, p1 - p0, p2 - p0, (int) r });
+				centroids.push_back((p0 + p1 + p2) / 3.f);
+			}
+		}
+
+		if (!self.triangles.empty()) {
+			baker->build(0, (int) self.triangles.size(), centroids);
+		}
+		return baker;
+	}
+
+	// Changes to anything the bake depends on change the hash, which marks
+	// an older bake as stale.
+	static uint64_t SceneHash(
+		size_t num_instances, const std::vector<Receiver>& receivers,
+		const std::vector<const Light*>& lights
+	) {
+		uint64_t hash = 14695981039346656037ull;
+		auto mix = [&hash](const void* data, size_t size) {
+			const unsigned char* bytes = (const unsigned char*) data;
+			for (size_t i = 0; i < size; i++) {
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+			}
+		};
+
+		int params[] = { SAMPLES, BOUNCES };
+		mix(params, sizeof(params));
+		mix(&num_instances, sizeof(num_instances));
+		for (const Receiver& receiver : receivers) {
+			const Vertices& vertices = receiver.mesh->get_vertices();
+			size_t num_vertices = vertices.size();
+			mix(&receiver.index, sizeof(receiver.index));
+			mix(&num_vertices, sizeof(num_vertices));
+			// bakes are stored in vertex order
+			for (const Vertex& vertex : vertices) {
+				mix(&vertex.pos, sizeof(vertex.pos));
+			}
+			mix(&receiver.model, sizeof(receiver.model));
+			mix(&receiver.albedo, sizeof(receiver.albedo));
+		}
+		for (const Light* light : lights) {
+			float params[] = {
+				(float) light->get_type(), light->get_range(),
+				light->get_spinn(), light->get_spout()
+			};
+			glm::vec3 vectors[] = { light->get_pos(), light->get_dir(), light->get_col() };
+			mix(params, sizeof(params));
+			mix(vectors, sizeof(vectors));
+		}
+		return hash;
+	}
+
+	BakedLighting bake(size_t num_instances, uint64_t scene_hash) const {
+		BakedLighting baked;
+		baked.scene_hash = scene_hash;
+		baked.offsets.assign(num_instances, -1);
+
+		std::vector<size_t> firsts;
+		size_t num_vertices = 0;
+		for (const Receiver& receiver : self.receivers) {
+			baked.offsets[receiver.index] = (GLint) num_vertices;
+			firsts.push_back(num_vertices);
+			num_vertices += receiver.mesh->get_vertices().size();
+		}
+		baked.lighting.assign(num_vertices, glm::vec4(0.f));
+		if (num_vertices == 0 || self.triangles.empty()) { return baked; }
+
+		const size_t CHUNK = 64;
+		std::atomic<size_t> next_chunk = 0;
+		auto worker = [&]() {
+			while (true) {
+				size_t begin = next_chunk.fetch_add(CHUNK);
+				if (begin >= num_vertices) { return; }
+				size_t end = std::min(begin + CHUNK, num_vertices);
+
+				for (size_t v = begin; v < end; v++) {
+					size_t r = std::upper_bound(firsts.begin(), firsts.end(), v) - firsts.begin() - 1;
+					const Receiver& receiver = self.receivers[r];
+					const Vertex& vertex = receiver.mesh->get_vertices()[v - firsts[r]];
+
+					glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(receiver.model)));
+					glm::vec3 pos = glm::vec3(receiver.model * glm::vec4(vertex.pos, 1.f));
+					glm::vec3 nor = glm::normalize(normal_matrix * vertex.nor);
+
+					// seeded by vertex so the result does not depend on threads
+					Rng rng { (v + 1) * 0x9e3779b97f4a7c15ull };
+					baked.lighting[v] = glm::vec4(gather(pos, nor, rng), 1.f);
+				}
+			}
+		};
+
+		unsigned num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+		std::vector<std::thread> threads;
+		for (unsigned i = 0; i < num_threads; i++) {
+			threads.emplace_back(worker);
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		return baked;
+	}
+
+	size_t get_num_triangles() const {
+		return self.triangles.size();
+	}
+};
@@ -0,0 +1,347 @@
+#pragma once
+
+#include "light.hpp"
+
+// Bins unshadowed point and spot lights into a view-space froxel grid so the
+// fragment shader only iterates the lights that can reach its cluster.
+class LightClusters {
+public:
+	static constexpr GLuint GRID_X = 16;
+	static constexpr GLuint GRID_Y = 9;
+	static constexpr GLuint GRID_Z = 24;
+	static constexpr GLuint NUM_CLUSTERS = GRID_X * GRID_Y * GRID_Z;
+	static constexpr int MAX_CLUSTER_LIGHTS = 4096;
+	static constexpr float SLICE_NEAR = 1.f;
+
+	static constexpr GLuint LIGHTS_BINDING = 0;
+	static constexpr GLuint GRID_BINDING = 1;
+	static constexpr GLuint INDICES_BINDING = 2;
+
+	struct GPULight {
+		glm::vec4 pos_range;
+		glm::vec4 dir_type;
+		glm::vec4 col_attq;
+		glm::vec4 cone;
+	};
+
+private:
+	// Cluster bounds are stored as separate arrays so the sphere test over a
+	// row of clusters is a straight loop the compiler can vectorize.
+	struct ClusterBounds {
+		std::vector<float> min_x, min_y, min_z;
+		std::vector<float> max_x, max_y, max_z;
+	};
+
+	struct Self {
+		GLuint ssbo_lights = 0;
+		GLuint ssbo_grid = 0;
+		GLuint ssbo_indices = 0;
+		size_t lights_capacity = 0;
+		size_t indices_capacity = 0;
+
+		ClusterBounds bounds;
+		glm::mat4 bounds_projection = glm::mat4(0.f);
+		glm::ivec2 bounds_resolution = glm::ivec2(0);
+		float near_plane = 0.f;
+		float far_plane = 0.f;
+		float slice_scale = 0.f;
+		float slice_bias = 0.f;
+
+		std::vector<GPULight> gpu_lights;
+		std::vector<glm::uvec2> grid;
+		std::vector<GLuint> indices;
+		std::vector<glm::uvec2> pairs;
+		std::vector<float> distances;
+
+		int num_lights = 0;
+	} self;
+
+	LightClusters() = default;
+
+private:
+	float slice_depth(GLuint slice) const {
+		if (slice == 0) { return 0.f; }
+		float ratio = self.far_plane / SLICE_NEAR;
+		return SLICE_NEAR * std::pow(ratio, (float) (slice - 1) / (float) (GRID_Z - 1));
+	}
+
+	GLuint depth_to_slice(float depth) const {
+		if (depth < SLICE_NEAR) { return 0; }
+		float slice = std::log(depth) * self.slice_scale + self.slice_bias;
+		return (GLuint) glm::clamp(slice, 1.f, (float) (GRID_Z - 1));
+	}
+
+	void rebuild_bounds(const glm::mat4& projection, glm::ivec2 res, float near_plane, float far_plane) {
+		self.bounds_projection = projection;
+		self.bounds_resolution = res;
+		self.near_plane = near_plane;
+		self.far_plane = far_plane;
+
+		// slice 0 covers [0, SLICE_NEAR), the remaining slices split
+		// [SLICE_NEAR, far] logarithmically.
+		float log_ratio = std::log(far_plane / SLICE_NEAR);
+		self.slice_scale = (float) (GRID_Z - 1) / log_ratio;
+		self.slice_bias = 1.f - std::log(SLICE_NEAR) * self.slice_scale;
+
+		auto& b = self.bounds;
+		for (auto* v : { &b.min_x, &b.min_y, &b.min_z, &b.max_x, &b.max_y, &b.max_z }) {
+			v->assign(NUM_CLUSTERS, 0.f);
+		}
+
+		glm::mat4 inv_projection = glm::inverse(projection);
+		auto view_ray = [&](float ndc_x, float ndc_y) {
+			glm::vec4 p = inv_projection * glm::vec4(ndc_x, ndc_y, -1.f, 1.f);
+			glm::vec3 v = glm::vec3(p) / p.w;
+			return v / -v.z;
+		};
+
+		for (GLuint y = 0; y < GRID_Y; y++) {
+			float ndc_y0 = (float) y / GRID_Y * 2.f - 1.f;
+			float ndc_y1 = (float) (y + 1) / GRID_Y * 2.f - 1.f;
+			for (GLuint x = 0; x < GRID_X; x++) {
+				float ndc_x0 = (float) x / GRID_X * 2.f - 1.f;
+				float ndc_x1 = (float) (x + 1) / GRID_X * 2.f - 1.f;
+
+				std::array<glm::vec3, 4> rays = {
+					view_ray(ndc_x0, ndc_y0), view_ray(ndc_x1, ndc_y0),
+					view_ray(ndc_x0, ndc_y1), view_ray(ndc_x1, ndc_y1)
+				};
+
+				for (GLuint z = 0; z < GRID_Z; z++) {
+					float d0 = slice_depth(z);
+					float d1 = (z + 1 < GRID_Z) ? slice_depth(z + 1) : far_plane;
+
+					glm::vec3 lo = glm::vec3(std::numeric_limits<float>::max());
+					glm::vec3 hi = glm::vec3(-std::numeric_limits<float>::max());
+					for (const auto& ray : rays) {
+						lo = glm::min(lo, glm::min(ray * d0, ray * d1));
+						hi = glm::max(hi, glm::max(ray * d0, ray * d1));
+					}
+
+					GLuint c = cluster_index(x, y, z);
+					b.min_x[c] = lo.x; b.min_y[c] = lo.y; b.min_z[c] = lo.z;
+					b.max_x[c] = hi.x; b.max_y[c] = hi.y; b.max_z[c] = hi.z;
+				}
+			}
+		}
+	}
+
+	static GLuint cluster_index(GLuint x, GLuint y, GLuint z) {
+		return (z * GRID_Y + y) * GRID_X + x;
+	}
+
+	// Bounding sphere of the light's area of influence, for spot lights the
+	// smallest sphere around the cone.
+	static glm::vec4 influence_sphere(const Light* light) {
+		glm::vec3 pos = light->get_pos();
+		float range = light->get_range();
+		if (light->get_type() != LightType::Spot) {
+			return glm::vec4(pos, range);
+		}
+
+		float angle = light->get_spout();
+		float cos_a = std::cos(angle);
+		if (angle > glm::radians(45.f)) {
+			return glm::vec4(pos + light->get_dir() * (range * cos_a), range * std::sin(angle));
+		}
+		float radius = range / (2.f * cos_a);
+		return glm::vec4(pos + light->get_dir() * radius, radius);
+	}
+
+	// Tile range covered by the view-space sphere, or the whole screen when
+	// the sphere crosses the camera plane.
+	glm::ivec4 tile_range(glm::vec3 center, float radius) const {
+		const glm::mat4& proj = self.bounds_projection;
+		if (-center.z - radius <= self.near_plane) {
+			return glm::ivec4(0, 0, GRID_X - 1, GRID_Y - 1);
+		}
+
+		glm::vec2 lo = glm::vec2(1.f);
+		glm::vec2 hi = glm::vec2(-1.f);
+		for (int i = 0; i < 8; i++) {
+			glm::vec3 corner = center + glm::vec3(
+				(i & 1) ? radius : -radius,
+				(i & 2) ? radius : -radius,
+				(i & 4) ? radius : -radius
+			);
+			glm::vec4 clip = proj * glm::vec4(corner, 1.f);
+			glm::vec2 ndc = glm::vec2(clip) / clip.w;
+			lo = glm::min(lo, ndc);
+			hi = glm::max(hi, ndc);
+		}
+		lo = glm::clamp(lo, -1.f, 1.f);
+		hi = glm::clamp(hi, -1.f, 1.f);
+
+		return glm::ivec4(
+			glm::clamp((int) ((lo.x * 0.5f + 0.5f) * GRID_X), 0, (int) GRID_X - 1),
+			glm::clamp((int) ((lo.y * 0.5f + 0.5f) * GRID_Y), 0, (int) GRID_Y - 1),
+			glm::clamp((int) ((hi.x * 0.5f + 0.5f) * GRID_X), 0, (int) GRID_X - 1),
+			glm::clamp((int) ((hi.y * 0.5f + 0.5f) * GRID_Y), 0, (int) GRID_Y - 1)
+		);
+	}
+
+	void bin_light(GLuint light_index, glm::vec3 center, float radius) {
+		float depth = -center.z;
+		if (depth + radius < 0.f || depth - radius > self.far_plane) { return; }
+
+		GLuint z0 = depth_to_slice(std::max(depth - radius, 0.f));
+		GLuint z1 = depth_to_slice(depth + radius);
+		glm::ivec4 tiles = tile_range(center, radius);
+
+		const auto& b = self.bounds;
+		const float r2 = radius * radius;
+		const GLuint row = (GLuint) (tiles.z - tiles.x + 1);
+		auto& dist = self.distances;
+		dist.resize(row);
+
+		for (GLuint z = z0; z <= z1; z++) {
+			for (int y = tiles.y; y <= tiles.w; y++) {
+				const GLuint first = cluster_index(tiles.x, y, z);
+				const float* min_x = b.min_x.data() + first;
+				const float* min_y = b.min_y.data() + first;
+				const float* min_z = b.min_z.data() + first;
+				const float* max_x = b.max_x.data() + first;
+				const float* max_y = b.max_y.data() + first;
+				const float* max_z = b.max_z.data() + first;
+				float* d = dist.data();
+
+				for (GLuint i = 0; i < row; i++) {
+					float dx = std::max(std::max(min_x[i] - center.x, center.x - max_x[i]), 0.f);
+					float dy = std::max(std::max(min_y[i] - center.y, center.y - max_y[i]), 0.f);
+					float dz = std::max(std::max(min_z[i] - center.z, center.z - max_z[i]), 0.f);
+					d[i] = dx * dx + dy * dy + dz * dz;
+				}
+
+				for (GLuint i = 0; i < row; i++) {
+					if (d[i] <= r2) {
+						self.pairs.push_back(glm::uvec2(first + i, light_index));
+					}
+				}
+			}
+		}
+	}
+
+	template<typename T>
+	static void upload(GLuint buffer, size_t& capacity, const std::vector<T>& data) {
+		size_t count = std::max(data.size(), (size_t) 1);
+		if (count > capacity) {
+			capacity = std::max(count, capacity * 2);
+			glNamedBufferData(buffer, capacity * sizeof(T), nullptr, GL_DYNAMIC_DRAW);
+		}
+		if (!data.empty()) {
+			glNamedBufferSubData(buffer, 0, data.size() * sizeof(T), data.data());
+		}
+	}
+
+public:
+	LightClusters(const LightClusters&) = delete;
+	LightClusters& operator=(const LightClusters&) = delete;
+	LightClusters(LightClusters&& other) = delete;
+	LightClusters& operator=(LightClusters&& other) = delete;
+
+	~LightClusters() {
+		GLuint buffers[] = { self.ssbo_lights, self.ssbo_grid, self.ssbo_indices };
+		glDeleteBuffers(3, buffers);
+	}
+
+	static std::unique_ptr<LightClusters> New() {
+		auto clusters = std::unique_ptr<LightClusters>(new LightClusters());
+		auto& self = clusters->self;
+
+		glCreateBuffers(1, &self.ssbo_lights);
+		glCreateBuffers(1, &self.ssbo_grid);
+		glCreateBuffers(1, &self.ssbo_indices);
+
+		self.grid.assign(NUM_CLUSTERS, glm::uvec2(0));
+		glNamedBufferData(
+			self.ssbo_grid, NUM_CLUSTERS * sizeof(glm::uvec2),
+			self.grid.data(), GL_DYNAMIC_DRAW
+		);
+		upload(self.ssbo_lights, self.lights_capacity, self.gpu_lights);
+		upload(self.ssbo_indices, self.indices_capacity, self.indices);
+
+		return clusters;
+	}
+
+	void update(
+		const std::vector<std::unique_ptr<Light>>& lights,
+		const glm::mat4& view, const glm::mat4& projection,
+		float near_plane, float far_plane, glm::ivec2 res
+	) {
+		if (
+			projection != self.bounds_projection || res != self.bounds_resolution
+			|| near_plane != self.near_plane || far_plane != self.far_plane
+		) {
+			rebuild_bounds(projection, res, near_plane, far_plane);
+		}
+
+		self.gpu_lights.clear();
+		self.pairs.clear();
+
+		for (const auto& light : lights) {
+			if (self.gpu_lights.size() >= MAX_CLUSTER_LIGHTS) { break; }
+			if (light->get_type() == LightType::Directional) { continue; }
+
+			glm::vec4 sphere = influence_sphere(light.get());
+			glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(sphere), 1.f));
+			GLuint index = (GLuint) self.gpu_lights.size();
+
+			size_t pairs_before = self.pairs.size();
+			bin_light(index, center, sphere.w);
+			if (self.pairs.size() == pairs_before) { continue; }
+
+			self.gpu_lights.push_back(GPULight {
+				glm::vec4(light->get_pos(), light->get_range()),
+				glm::vec4(light->get_dir(), (float) light->get_type()),
+				glm::vec4(light->get_col(), light->get_attq()),
+				glm::vec4(
+					std::cos(light->get_spinn()), std::cos(light->get_spout()),
+					light->get_attl(), light->is_baked() ? 1.f : 0.f
+				)
+			});
+		}
+		self.num_lights = (int) self.gpu_lights.size();
+
+		// counting sort of (cluster, light) pairs into per-cluster ranges
+		std::fill(self.grid.begin(), self.grid.end(), glm::uvec2(0));
+		for (const auto& pair : self.pairs) {
+			self.grid[pair.x].y += 1;
+		}
+		GLuint offset = 0;
+		for (auto& cell : self.grid) {
+			cell.x = offset;
+			offset += cell.y;
+			cell.y = 0;
+		}
+		self.indices.resize(self.pairs.size());
+		for (const auto& pair : self.pairs) {
+			auto& cell = self.grid[pair.x];
+			self.indices[cell.x + cell.y] = pair.y;
+			cell.y += 1;
+		}
+
+		upload(self.ssbo_lights, self.lights_capacity, self.gpu_lights);
+		upload(self.ssbo_indices, self.indices_capacity, self.indices);
+		glNamedBufferSubData(
+			self.ssbo_grid, 0, NUM_CLUSTERS * sizeof(glm::uvec2), self.grid.data()
+		);
+	}
+
+	void bind() const {
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHTS_BINDING, self.ssbo_lights);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GRID_BINDING, self.ssbo_grid);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INDICES_BINDING, self.ssbo_indices);
+	}
+
+	int get_num_lights() const { return self.num_lights; }
+
+	glm::uvec3 get_grid() const { return glm::uvec3(GRID_X, GRID_Y, GRID_Z); }
+
+	glm::vec2 get_slice_params() const {
+		return glm::vec2(self.slice_scale, self.slice_bias);
+	}
+
+	glm::vec2 get_tile_size() const {
+		return glm::vec2(self.bounds_resolution) / glm::vec2(GRID_X, GRID_Y);
+	}
+};
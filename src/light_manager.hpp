@@ -1,13 +1,16 @@
 #pragma once
 
 #include "light.hpp"
+#include "light_clusters.hpp"
+#include "frustum.hpp"
 
 class LightManager {
 public:
 	static constexpr int MAX_SHADER_LIGHTS = 10;
 	static constexpr int SHADOW_MAP_RES = 4096;
 
-	using RenderFunction = std::function<void()>;
+	// draws the scene for a pass seen through view_projection
+	using RenderFunction = std::function<void(const glm::mat4& view_projection)>;
 	template<typename T, size_t Size>
 	using Array = std::array<T, Size>;
 	template<typename T>
@@ -16,34 +19,94 @@ public:
 	using GLuArray = LArray<GLuint>;
 
 private:
+	// Uniform locations of the lighting block, queried once per program
+	// that includes lighting.glsl.
+	struct LightLocations {
+		GLint num_lights = -1;
+		GLint num_cluster_lights = -1;
+		GLint cluster_grid = -1;
+		GLint cluster_tile_size = -1;
+		GLint cluster_slice = -1;
+		GLint num_shadow_2d_lights = -1;
+
+		GLiArray type = GLiArray();
+		GLiArray dir = GLiArray();
+		GLiArray pos = GLiArray();
+		GLiArray col = GLiArray();
+		GLiArray range = GLiArray();
+		GLiArray attl = GLiArray();
+		GLiArray attq = GLiArray();
+		GLiArray spinn = GLiArray();
+		GLiArray spout = GLiArray();
+		GLiArray projlmat = GLiArray();
+		GLiArray shadow_map = GLiArray();
+		GLiArray shadow_2d_lights = GLiArray();
+	};
+
+	// Light counts and shadow switches a phong variant is specialized for.
+	struct LightMix {
+		int directional = 0;
+		int spot = 0;
+		int point = 0;
+		bool dir_shadows = true;
+		bool spot_shadows = true;
+		bool point_shadows = true;
+		bool light_space_varyings = false;
+
+		uint32_t key() const {
+			return directional | (spot << 4) | (point << 8)
+				| (dir_shadows << 12) | (spot_shadows << 13) | (point_shadows << 14)
+				| (light_space_varyings << 15);
+		}
+
+		ShaderProgram::Defines defines() const {
+			int total = directional + spot + point;
+			int shadow_maps_2d = (dir_shadows ? directional : 0) + (spot_shadows ? spot : 0);
+			ShaderProgram::Defines defines = {
+				{ "LIGHT_VARIANT", "1" },
+				{ "MAX_LIGHTS", std::to_string(std::max(total, 1)) },
+				{ "MAX_SHADOW_MAPS_2D", std::to_string(std::max(shadow_maps_2d, 1)) },
+				{ "NUM_DIR_LIGHTS", std::to_string(directional) },
+				{ "NUM_SPOT_LIGHTS", std::to_string(spot) },
+				{ "NUM_POINT_LIGHTS", std::to_string(point) },
+				{ "DIR_SHADOWS", (dir_shadows && directional > 0) ? "1" : "0" },
+				{ "SPOT_SHADOWS", (spot_shadows && spot > 0) ? "1" : "0" },
+				{ "POINT_SHADOWS", (point_shadows && point > 0) ? "1" : "0" },
+			};
+			if (light_space_varyings) {
+				defines.push_back({ "LIGHT_SPACE_VARYINGS", "1" });
+			}
+			return defines;
+		}
+	};
+
 	struct Self {
+		ShaderProgram* base_program = nullptr;
 		ShaderProgram* program = nullptr;
 		ShaderProgram* shadow_program = nullptr;
 		std::unique_ptr<ShaderProgram> depth_cubemap_program;
 
 		int num_lights = 0;
 		LArray<std::unique_ptr<Light>> lights;
-		GLint l_num_lights = -1;
+		// lights [0, num_active) survived culling and the budget this frame
+		int num_active = 0;
+		int light_budget = MAX_SHADER_LIGHTS;
+
+		std::vector<std::unique_ptr<Light>> unshadowed_lights;
+		std::unique_ptr<LightClusters> clusters;
+
+		std::unordered_map<const ShaderProgram*, LightLocations> locations;
+
+		std::unordered_map<uint32_t, std::unique_ptr<ShaderProgram>> variants;
+		uint32_t mix_key = UINT32_MAX;
+		Array<bool, 3> shadows_enabled = { true, true, true };
+		bool light_space_varyings = false;
 
 		GLint l_dcm_light_space_matrix = -1;
 		GLint l_light_pos_world = -1;
 		GLint l_light_far_plane = -1;
-
-		GLiArray ls_type = GLiArray();
-		GLiArray ls_dir = GLiArray();
-		GLiArray ls_pos = GLiArray();
-		GLiArray ls_col = GLiArray();
-		GLiArray ls_range = GLiArray();
-		GLiArray ls_attl = GLiArray();
-		GLiArray ls_attq = GLiArray();
-		GLiArray ls_spinn = GLiArray();
-		GLiArray ls_spout = GLiArray();
-		GLiArray ls_projlmat = GLiArray();
 		GLint projlmat_shadow = -1;
 
-		GLiArray ls_shadow_maps_2d = GLiArray();
-		GLiArray ls_shadow_maps_cube = GLiArray();
-
 		GLuArray ls_shadow_fbos = GLuArray();
 		GLuArray ls_shadow_textures_2d = GLuArray();
 		GLuArray ls_shadow_textures_cube = GLuArray();
@@ -52,38 +115,170 @@ private:
 	LightManager() = default;
 
 	void setup_uniforms() {
-		auto& program = self.program;
 		auto& shadow_program = self.shadow_program;
 		auto& depth_cubemap_program = self.depth_cubemap_program;
 
+		shadow_program->use();
+		self.projlmat_shadow = shadow_program->location("projlmat");
+
+		depth_cubemap_program->use();
+		self.l_dcm_light_space_matrix = depth_cubemap_program->location("light_space_matrix");
+		self.l_light_pos_world = depth_cubemap_program->location("light_pos_world");
+		self.l_light_far_plane = depth_cubemap_program->location("light_far_plane");
+	}
+
+	const LightLocations& locations_for(ShaderProgram* program) {
+		auto it = self.locations.find(program);
+		if (it != self.locations.end()) {
+			return it->second;
+		}
+
+		LightLocations l;
 		program->use();
-		self.l_num_lights = program->location("num_lights");
+		l.num_lights = program->location("num_lights");
+		l.num_cluster_lights = program->location("num_cluster_lights");
+		l.cluster_grid = program->location("cluster_grid");
+		l.cluster_tile_size = program->location("cluster_tile_size");
+		l.cluster_slice = program->location("cluster_slice");
+		l.num_shadow_2d_lights = program->location("num_shadow_2d_lights");
 
 		for (size_t i = 0; i < MAX_SHADER_LIGHTS; i++) {
 			std::string is = std::to_string(i);
 			std::string base_name = "lights[" + is + "].";
 
-			self.ls_type[i] = program->location(base_name + "type");
-			self.ls_dir[i] = program->location(base_name + "dir");
-			self.ls_pos[i] = program->location(base_name + "pos");
-			self.ls_col[i] = program->location(base_name + "col");
-			self.ls_range[i] = program->location(base_name + "range");
-			self.ls_attl[i] = program->location(base_name + "attl");
-			self.ls_attq[i] = program->location(base_name + "attq");
-			self.ls_spinn[i] = program->location(base_name + "spinn");
-			self.ls_spout[i] = program->location(base_name + "spout");
-			self.ls_projlmat[i] = program->location(base_name + "projlmat");
-			self.ls_shadow_maps_2d[i] = program->location("shadow_maps_2d[" + is + "]");
-			self.ls_shadow_maps_cube[i] = program->location("shadow_maps_cube[" + is + "]");
+			l.type[i] = program->location(base_name + "type");
+			l.dir[i] = program->location(base_name + "dir");
+			l.pos[i] = program->location(base_name + "pos");
+			l.col[i] = program->location(base_name + "col");
+			l.range[i] = program->location(base_name + "range");
+			l.attl[i] = program->location(base_name + "attl");
+			l.attq[i] = program->location(base_name + "attq");
+			l.spinn[i] = program->location(base_name + "spinn");
+			l.spout[i] = program->location(base_name + "spout");
+			l.projlmat[i] = program->location(base_name + "projlmat");
+			l.shadow_map[i] = program->location(base_name + "shadow_map");
+			l.shadow_2d_lights[i] = program->location("shadow_2d_lights[" + is + "]");
+
+			// Sampler units never change, so they are assigned only once.
+			GLint shadow_map_2d = program->location("shadow_maps_2d[" + is + "]");
+			GLint shadow_map_cube = program->location("shadow_maps_cube[" + is + "]");
+			if (shadow_map_2d != -1) {
+				program->uniform(shadow_map_2d, static_cast<GLint>(i));
+			}
+			if (shadow_map_cube != -1) {
+				program->uniform(
+					shadow_map_cube, static_cast<GLint>(MAX_SHADER_LIGHTS + i)
+				);
+			}
 		}
 
-		shadow_program->use();
-		self.projlmat_shadow = shadow_program->location("projlmat");
+		return self.locations.emplace(program, l).first->second;
+	}
 
-		depth_cubemap_program->use();
-		self.l_dcm_light_space_matrix = depth_cubemap_program->location("light_space_matrix");
-		self.l_light_pos_world = depth_cubemap_program->location("light_pos_world");
-		self.l_light_far_plane = depth_cubemap_program->location("light_far_plane");
+	// Variants expect lights grouped directional, spot, point.
+	static int variant_order(LightType type) {
+		switch (type) {
+			case LightType::Directional: return 0;
+			case LightType::Spot: return 1;
+			default: return 2;
+		}
+	}
+
+	// Rough share of the screen a light can brighten: the solid angle of
+	// its influence volume scaled by its brightness.
+	static float screen_contribution(const Light* light, glm::vec3 cam_pos) {
+		if (light->get_type() == LightType::Directional) {
+			return std::numeric_limits<float>::max();
+		}
+
+		float range = light->get_range();
+		glm::vec3 to_light = light->get_pos() - cam_pos;
+		float distance2 = glm::dot(to_light, to_light);
+		float coverage = distance2 <= range * range ? 1.f : range * range / distance2;
+		if (light->get_type() == LightType::Spot) {
+			coverage *= 0.5f * (1.f - std::cos(light->get_spout()));
+		}
+
+		glm::vec3 col = light->get_col();
+		return coverage * std::max(col.x, std::max(col.y, col.z));
+	}
+
+	// Lights are attenuated to under 1/256 at their range, so nothing past
+	// it is worth a shadow map.
+	static bool in_frustum(const Light* light, const Frustum& frustum) {
+		switch (light->get_type()) {
+			case LightType::Directional:
+				return true;
+			case LightType::Spot:
+				return frustum.intersects_cone(
+					light->get_pos(), glm::normalize(light->get_dir()),
+					light->get_range(), light->get_spout()
+				);
+			default:
+				return frustum.intersects_sphere(light->get_pos(), light->get_range());
+		}
+	}
+
+	// Moves the visible lights, up to the budget and brightest first, to
+	// the front grouped as the variants expect; the rest follow unused.
+	LightMix arrange_lights(const glm::mat4& view_projection, glm::vec3 cam_pos) {
+		Frustum frustum = Frustum::FromMatrix(view_projection);
+		int n = self.num_lights;
+
+		LArray<float> score;
+		LArray<int> order;
+		int num_visible = 0;
+		for (int i = 0; i < n; i++) {
+			const Light* light = self.lights[i].get();
+			score[i] = screen_contribution(light, cam_pos);
+			if (in_frustum(light, frustum)) {
+				order[num_visible++] = i;
+			}
+		}
+		int num_active = std::min(num_visible, self.light_budget);
+		std::partial_sort(
+			order.begin(), order.begin() + num_active, order.begin() + num_visible,
+			[&score](int a, int b) { return score[a] > score[b]; }
+		);
+
+		LArray<bool> active = {};
+		for (int k = 0; k < num_active; k++) {
+			active[order[k]] = true;
+		}
+		auto rank = [this, &active](int i) {
+			return active[i] ? variant_order(self.lights[i]->get_type()) : 3;
+		};
+		for (int i = 0; i < n; i++) {
+			order[i] = i;
+		}
+		std::stable_sort(order.begin(), order.begin() + n,
+			[&rank](int a, int b) { return rank(a) < rank(b); }
+		);
+
+		LArray<std::unique_ptr<Light>> arranged;
+		for (int k = 0; k < n; k++) {
+			arranged[k] = std::move(self.lights[order[k]]);
+		}
+		std::move(arranged.begin(), arranged.begin() + n, self.lights.begin());
+		self.num_active = num_active;
+
+		LightMix mix;
+		for (int i = 0; i < num_active; i++) {
+			switch (self.lights[i]->get_type()) {
+				case LightType::Directional: mix.directional += 1; break;
+				case LightType::Spot: mix.spot += 1; break;
+				case LightType::Positional: mix.point += 1; break;
+			}
+		}
+		mix.dir_shadows = casts_shadows(LightType::Directional);
+		mix.spot_shadows = casts_shadows(LightType::Spot);
+		mix.point_shadows = casts_shadows(LightType::Positional);
+		mix.light_space_varyings = self.light_space_varyings;
+		return mix;
+	}
+
+	bool casts_shadows(LightType type) const {
+		return self.shadows_enabled[(int) type];
 	}
 
 	void setup_params(int target) {
@@ -98,7 +293,6 @@ private:
 	}
 
 	void setup_shadow_maps() {
-		auto& program = self.program;
 		GLuint* shadow_fbos = self.ls_shadow_fbos.data();
 		GLuint* shadow_textures_2d = self.ls_shadow_textures_2d.data();
 		GLuint* shadow_textures_cube = self.ls_shadow_textures_cube.data();
@@ -150,22 +344,6 @@ private:
 		glBindTexture(GL_TEXTURE_2D, 0);
 		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-
-		program->use();
-		for (size_t i = 0; i < MAX_SHADER_LIGHTS; i++) {
-			if (self.ls_shadow_maps_2d[i] != -1) {
-				program->uniform(
-					self.ls_shadow_maps_2d[i], 
-					static_cast<GLint>(i)
-				);
-			}
-			if (self.ls_shadow_maps_cube[i] != -1) {
-				program->uniform(
-					self.ls_shadow_maps_cube[i], 
-					static_cast<GLint>(MAX_SHADER_LIGHTS + i)
-				);
-			}
-		}
 	}
 
 public:
@@ -193,12 +371,15 @@ public:
 		}
 		auto& depth_cubemap_program = depth_cubemap_program_opt.value();
 
+		self.base_program = program;
 		self.program = program;
 		self.shadow_program = shadow_program;
 		self.depth_cubemap_program = std::move(depth_cubemap_program);
+		self.clusters = LightClusters::New();
 
 		light_manager->setup_uniforms();
 		light_manager->setup_shadow_maps();
+		light_manager->locations_for(program);
 
 		return light_manager;
 	}
@@ -217,6 +398,39 @@ public:
 		return u_light;
 	}
 
+	// Unshadowed point and spot lights go through the clustered path, so
+	// they are not bound by MAX_SHADER_LIGHTS.
+	Light* add_unshadowed_light(std::unique_ptr<Light> light) {
+		if (light->get_type() == LightType::Directional) {
+			std::cerr << "Directional lights cannot be clustered.\n";
+			return nullptr;
+		}
+		if ((int) self.unshadowed_lights.size() >= LightClusters::MAX_CLUSTER_LIGHTS) {
+			std::cerr << "Maximum unshadowed lights exceeded.\n";
+			return nullptr;
+		}
+
+		self.unshadowed_lights.push_back(std::move(light));
+		return self.unshadowed_lights.back().get();
+	}
+
+	// Static lights baked into static geometry by LightBaker. Dynamic
+	// objects still get them unshadowed through the clusters.
+	Light* add_baked_light(std::unique_ptr<Light> light) {
+		light->set_baked(true);
+		return add_unshadowed_light(std::move(light));
+	}
+
+	std::vector<const Light*> get_baked_lights() const {
+		std::vector<const Light*> baked;
+		for (const auto& light : self.unshadowed_lights) {
+			if (light->is_baked()) {
+				baked.push_back(light.get());
+			}
+		}
+		return baked;
+	}
+
 	bool remove_light(const Light* light) {
 		if (!light) {
 			std::cerr << "Cannot remove null light pointer\n";
@@ -232,7 +446,17 @@ public:
 				}
 				
 				self.lights[self.num_lights].reset();
+				self.num_active = std::min(self.num_active, self.num_lights);
+
+				return true;
+			}
+		}
 
+		auto& unshadowed = self.unshadowed_lights;
+		for (size_t i = 0; i < unshadowed.size(); i++) {
+			if (unshadowed[i].get() == light) {
+				unshadowed[i] = std::move(unshadowed.back());
+				unshadowed.pop_back();
 				return true;
 			}
 		}
@@ -252,9 +476,12 @@ public:
 		
 		glEnable(GL_DEPTH_TEST);
 
-		for (int i = 0; i < self.num_lights; i++) {
+		for (int i = 0; i < self.num_active; i++) {
 			Light* light = self.lights[i].get();
 			LightType type = light->get_type();
+			// disabled maps are still cleared, so any program sampling them
+			// sees the light as unoccluded
+			bool shadows = casts_shadows(type);
 
 			glBindFramebuffer(GL_FRAMEBUFFER, self.ls_shadow_fbos[i]);
 
@@ -277,7 +504,7 @@ public:
 					glClear(GL_DEPTH_BUFFER_BIT);
 					//self.shadow_program->uniform(self.projlmat_shadow, light_space_matrices[face]);
 					self.depth_cubemap_program->uniform(self.l_dcm_light_space_matrix, light_space_matrices[face]);
-					render();
+					if (shadows) { render(light_space_matrices[face]); }
 				}
 			} else {
 				self.shadow_program->use();
@@ -289,29 +516,127 @@ public:
 				self.shadow_program->uniform(
 					self.projlmat_shadow, light->get_projlmat()
 				);
-				render();
+				if (shadows) { render(light->get_projlmat()); }
 			}
 		}
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
+	// Culls the lights against the camera, then switches to the phong
+	// program specialized for the remaining mix, compiling it on first use.
+	void update(const glm::mat4& view_projection, glm::vec3 cam_pos) {
+		LightMix mix = arrange_lights(view_projection, cam_pos);
+		uint32_t key = mix.key();
+		if (key == self.mix_key) { return; }
+		self.mix_key = key;
+
+		auto it = self.variants.find(key);
+		if (it == self.variants.end()) {
+			auto program_opt = ShaderProgram::New(
+				"shaders/phong.vert", "shaders/phong.frag", mix.defines()
+			);
+			if (!program_opt.has_value()) {
+				std::cerr << "Could not build lighting variant, using the generic program.\n";
+			}
+			auto program = program_opt.has_value()
+				? std::move(program_opt.value()) : nullptr;
+			it = self.variants.emplace(key, std::move(program)).first;
+		}
+
+		self.program = it->second ? it->second.get() : self.base_program;
+	}
+
+	ShaderProgram* get_program() const {
+		return self.program;
+	}
+
+	void set_shadows_enabled(LightType type, bool enabled) {
+		self.shadows_enabled[(int) type] = enabled;
+	}
+
+	// Interpolates the light-space positions of the 2D shadowed lights from
+	// the vertex shader instead of computing them per fragment. Costs one
+	// varying per shadow map, so only the specialized variants support it.
+	void set_light_space_varyings(bool enabled) {
+		self.light_space_varyings = enabled;
+	}
+
+	bool get_light_space_varyings() const {
+		return self.light_space_varyings;
+	}
+
+	// At most budget shadowed lights are rendered per frame, picked by
+	// screen contribution; directional lights always win.
+	void set_light_budget(int budget) {
+		self.light_budget = glm::clamp(budget, 0, MAX_SHADER_LIGHTS);
+	}
+
+	int get_light_budget() const {
+		return self.light_budget;
+	}
+
+	int get_num_active_lights() const {
+		return self.num_active;
+	}
+
+	void update_clusters(
+		const glm::mat4& view, const glm::mat4& projection,
+		float near_plane, float far_plane, glm::ivec2 res
+	) {
+		self.clusters->update(
+			self.unshadowed_lights, view, projection, near_plane, far_plane, res
+		);
+	}
+
+	// Lays down the camera depth with the depth-only shadow program, so the
+	// lighting pass that follows shades each pixel at most once.
+	void render_depth_prepass(
+		RenderFunction render, const glm::mat4& view_projection,
+		int screen_w, int screen_h
+	) {
+		glViewport(0, 0, (GLsizei) screen_w, (GLsizei) screen_h);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+
+		self.shadow_program->use();
+		self.shadow_program->uniform(self.projlmat_shadow, view_projection);
+		render(view_projection);
+
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+	}
+
 	void render_with_shadows(
-		RenderFunction render, int screen_w, int screen_h, const GLfloat* bgd
+		RenderFunction render, const glm::mat4& view_projection,
+		int screen_w, int screen_h, const GLfloat* bgd, bool depth_prepass = false
 	) {
 		glViewport(0, 0, (GLsizei) screen_w, (GLsizei) screen_h);
 		
 		glClearBufferfv(GL_COLOR, 0, bgd);
-		glClear(GL_DEPTH_BUFFER_BIT);
+		if (depth_prepass) {
+			glDepthMask(GL_FALSE);
+			glDepthFunc(GL_LEQUAL);
+		} else {
+			glClear(GL_DEPTH_BUFFER_BIT);
+		}
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
-		self.program->use();
-		update_uniforms();
+		bind_lighting(self.program);
+		render(view_projection);
 
-		for (int i = 0; i < self.num_lights; i++) {
+		glDepthMask(GL_TRUE);
+		glDepthFunc(GL_LESS);
+	}
+
+	// Makes program current with the lighting uniforms, shadow maps and
+	// cluster buffers bound, for any program that includes lighting.glsl.
+	void bind_lighting(ShaderProgram* program) {
+		update_uniforms(program);
+
+		for (int i = 0; i < self.num_active; i++) {
 			Light* light = self.lights[i].get();
-			LightType type = light->get_type();
 
-			if (light->get_type() == LightType::Positional) { 
+			if (light->get_type() == LightType::Positional) {
 				glActiveTexture(GL_TEXTURE0 + MAX_SHADER_LIGHTS + i);
 				glBindTexture(GL_TEXTURE_CUBE_MAP, self.ls_shadow_textures_cube[i]);
 			} else {
@@ -320,33 +645,51 @@ public:
 			}
 		}
 		glActiveTexture(GL_TEXTURE0);
-
-		render();
+		self.clusters->bind();
 	}
 
-	void update_uniforms() {
-		auto program = self.program;
-		self.program->use();
-		program->uniform(self.l_num_lights, self.num_lights);
-		for (int i = 0; i < self.num_lights; i++) {
+	void update_uniforms(ShaderProgram* program) {
+		const LightLocations& l = locations_for(program);
+		program->use();
+		program->uniform(l.num_lights, self.num_active);
+		int num_shadow_2d = 0;
+		for (int i = 0; i < self.num_active; i++) {
 			Light* light = self.lights[i].get();
-			program->uniform(self.ls_type[i], (int) light->get_type());
-			program->uniform(self.ls_dir[i], light->get_dir());
-			program->uniform(self.ls_pos[i], light->get_pos());
-			program->uniform(self.ls_col[i], light->get_col());
-			program->uniform(self.ls_range[i], light->get_range());
-			program->uniform(self.ls_attl[i], light->get_attl());
-			program->uniform(self.ls_attq[i], light->get_attq());
-			program->uniform(self.ls_spinn[i], light->get_spinn());
-			program->uniform(self.ls_spout[i], light->get_spout());
-			program->uniform(self.ls_projlmat[i], light->get_projlmat());
+			LightType type = light->get_type();
+			int shadow_map = -1;
+			if (type != LightType::Positional && casts_shadows(type)) {
+				shadow_map = num_shadow_2d++;
+				program->uniform(l.shadow_2d_lights[shadow_map], i);
+			}
+			program->uniform(l.shadow_map[i], shadow_map);
+			program->uniform(l.type[i], (int) type);
+			program->uniform(l.dir[i], light->get_dir());
+			program->uniform(l.pos[i], light->get_pos());
+			program->uniform(l.col[i], light->get_col());
+			program->uniform(l.range[i], light->get_range());
+			program->uniform(l.attl[i], light->get_attl());
+			program->uniform(l.attq[i], light->get_attq());
+			program->uniform(l.spinn[i], light->get_spinn());
+			program->uniform(l.spout[i], light->get_spout());
+			program->uniform(l.projlmat[i], light->get_projlmat());
 		}
+		program->uniform(l.num_shadow_2d_lights, num_shadow_2d);
+
+		auto& clusters = self.clusters;
+		program->uniform(l.num_cluster_lights, clusters->get_num_lights());
+		program->uniform(l.cluster_grid, clusters->get_grid());
+		program->uniform(l.cluster_tile_size, clusters->get_tile_size());
+		program->uniform(l.cluster_slice, clusters->get_slice_params());
 	}
 
 	int get_num_lights() const {
 		return self.num_lights;
 	}
 
+	int get_num_unshadowed_lights() const {
+		return (int) self.unshadowed_lights.size();
+	}
+
 	Light* get_light(int index) {
 		if (index >= 0 && index < self.num_lights) {
 			return self.lights[index].get();
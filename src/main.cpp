@@ -3,6 +3,11 @@
 #include <linux/limits.h>
 #endif
 
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define RENDERER_SSE
+#include <xmmintrin.h>
+#endif
+
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -11,17 +16,24 @@
 
 #include <array>
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <sstream>
 #include <stdint.h>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <unordered_map>
 #include <unordered_set>
@@ -69,6 +81,10 @@ int main(int argc, char** argv) {
 	}
 	auto& scene = scene_opt.value();
 
+	if (argc > 1 && std::string(argv[1]) == "--bake") {
+		return scene->bake_lighting() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	double last_frame_time = glfwGetTime();
 	double dt = 0.0f;
 
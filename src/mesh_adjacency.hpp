@@ -0,0 +1,31 @@
+#pragma once
+
+// The triangles around each vertex of a triangle list, as the mesh
+// optimizer, simplifier and clusterer walk them: the triangles of vertex v
+// are triangles[offsets[v]..offsets[v + 1]).
+struct MeshAdjacency {
+	std::vector<uint32_t> offsets;
+	std::vector<uint32_t> triangles;
+
+	// Rebuilds for indices, keeping the storage of the last build.
+	void build(const Indices& indices, size_t num_vertices) {
+		offsets.assign(num_vertices + 1, 0);
+		for (GLint v : indices) {
+			offsets[v + 1]++;
+		}
+		for (size_t v = 0; v < num_vertices; v++) {
+			offsets[v + 1] += offsets[v];
+		}
+
+		triangles.resize(indices.size());
+		std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+		for (size_t i = 0; i < indices.size(); i++) {
+			triangles[fill[indices[i]]++] = (uint32_t) (i / 3);
+		}
+	}
+
+	// Number of triangles around v.
+	uint32_t count(size_t v) const {
+		return offsets[v + 1] - offsets[v];
+	}
+};
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "mesh_adjacency.hpp"
+
+// Splits a triangle mesh into clusters of neighbouring triangles, each a
+// contiguous run of the index buffer with its own bounding sphere and
+// normal cone, so instances of large meshes can skip the clusters outside
+// the frustum or facing away from the viewer. Clusters grow from a seed
+// triangle in the mesh's current order, taking the adjacent triangle that
+// adds the fewest vertices and bends the cluster the least next.
+class MeshClusters {
+public:
+	static constexpr size_t MAX_VERTICES = 64;
+	static constexpr size_t MAX_TRIANGLES = 128;
+	// Clusters whose normals spread further from their average than this
+	// cosine get no cone, they would hardly ever face away.
+	static constexpr float MIN_CONE_DOT = 0.1f;
+
+	// 48 bytes, laid out the same as in std430 storage buffers.
+	struct Cluster {
+		// object space bounding sphere, center and radius
+		glm::vec4 sphere;
+		// average normal, and the sine of the angle from it to the normal
+		// furthest from it; 1 when the normals spread too far to tell
+		glm::vec4 cone;
+		GLuint first_index;
+		GLuint count;
+		GLuint pad[2];
+	};
+
+private:
+	static Cluster bounds(
+		const Vertices& vertices, const Indices& indices, const std::vector<glm::vec3>& normals,
+		size_t first_triangle, size_t num_triangles
+	) {
+		glm::vec3 lo = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 hi = glm::vec3(std::numeric_limits<float>::lowest());
+		glm::vec3 axis = glm::vec3(0.f);
+		for (size_t t = first_triangle; t < first_triangle + num_triangles; t++) {
+			for (int k = 0; k < 3; k++) {
+				const glm::vec3& p = vertices[indices[t * 3 + k]].pos;
+				lo = glm::min(lo, p);
+				hi = glm::max(hi, p);
+			}
+			axis += normals[t];
+		}
+		glm::vec3 center = (lo + hi) * 0.5f;
+		float radius = 0.f;
+		for (size_t i = first_triangle * 3; i < (first_triangle + num_triangles) * 3; i++) {
+			radius = std::max(radius, glm::length(vertices[indices[i]].pos - center));
+		}
+
+		float length = glm::length(axis);
+		axis = length > 0.f ? axis / length : glm::vec3(0.f, 0.f, 1.f);
+		float min_dot = length > 0.f ? 1.f : -1.f;
+		for (size_t t = first_triangle; t < first_triangle + num_triangles; t++) {
+			if (normals[t] == glm::vec3(0.f)) { continue; }
+			min_dot = std::min(min_dot, glm::dot(axis, normals[t]));
+		}
+		float cutoff = min_dot < MIN_CONE_DOT ? 1.f : std::sqrt(1.f - min_dot * min_dot);
+
+		return Cluster {
+			glm::vec4(center, radius), glm::vec4(axis, cutoff),
+			(GLuint) (first_triangle * 3), (GLuint) (num_triangles * 3), { 0, 0 }
+		};
+	}
+
+public:
+	// Reorders the triangles of indices, a triangle list, cluster by
+	// cluster and returns the clusters in order.
+	static std::vector<Cluster> Build(const Vertices& vertices, Indices& indices) {
+		size_t num_triangles = indices.size() / 3;
+		size_t num_vertices = vertices.size();
+		if (num_triangles == 0 || indices.size() % 3 != 0) { return {}; }
+
+		std::vector<glm::vec3> normals(num_triangles);
+		for (size_t t = 0; t < num_triangles; t++) {
+			glm::vec3 p0 = vertices[indices[t * 3]].pos;
+			glm::vec3 p1 = vertices[indices[t * 3 + 1]].pos;
+			glm::vec3 p2 = vertices[indices[t * 3 + 2]].pos;
+			glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+			float length = glm::length(n);
+			normals[t] = length > 0.f ? n / length : glm::vec3(0.f);
+		}
+
+		MeshAdjacency adjacency;
+		adjacency.build(indices, num_vertices);
+		const auto& offsets = adjacency.offsets;
+		const auto& triangles = adjacency.triangles;
+
+		std::vector<uint8_t> emitted(num_triangles, 0);
+		// cluster each vertex was last added to, plus one
+		std::vector<uint32_t> owner(num_vertices, 0);
+		std::vector<uint32_t> order;
+		order.reserve(num_triangles);
+		// first triangle in order and number of triangles of each cluster
+		std::vector<std::pair<size_t, size_t>> spans;
+		std::vector<GLint> cluster_vertices;
+		// unemitted triangles around each vertex
+		std::vector<uint32_t> live(num_vertices);
+		for (size_t v = 0; v < num_vertices; v++) {
+			live[v] = adjacency.count(v);
+		}
+		size_t cursor = 0;
+
+		// Next to the last cluster, the triangle with the fewest unemitted
+		// neighbours, so clusters fill the surface without leaving gaps;
+		// else the first one left.
+		auto next_seed = [&]() -> uint32_t {
+			int64_t seed = -1;
+			uint32_t seed_live = std::numeric_limits<uint32_t>::max();
+			for (GLint v : cluster_vertices) {
+				for (uint32_t a = offsets[v]; a < offsets[v + 1]; a++) {
+					uint32_t t = triangles[a];
+					if (emitted[t]) { continue; }
+					uint32_t around = live[indices[t * 3]] + live[indices[t * 3 + 1]] + live[indices[t * 3 + 2]];
+					if (around < seed_live) {
+						seed_live = around;
+						seed = t;
+					}
+				}
+			}
+			if (seed >= 0) { return (uint32_t) seed; }
+			while (emitted[cursor]) { cursor++; }
+			return (uint32_t) cursor;
+		};
+
+		while (order.size() < num_triangles) {
+			uint32_t seed = next_seed();
+			uint32_t id = (uint32_t) spans.size() + 1;
+			size_t first = order.size();
+			cluster_vertices.clear();
+			glm::vec3 normal = glm::vec3(0.f);
+
+			auto add = [&](uint32_t t) {
+				emitted[t] = 1;
+				order.push_back(t);
+				normal += normals[t];
+				for (int k = 0; k < 3; k++) {
+					GLint v = indices[t * 3 + k];
+					live[v]--;
+					if (owner[v] != id) {
+						owner[v] = id;
+						cluster_vertices.push_back(v);
+					}
+				}
+			};
+			add(seed);
+
+			while (order.size() - first < MAX_TRIANGLES) {
+				glm::vec3 axis = glm::length(normal) > 0.f ? glm::normalize(normal) : glm::vec3(0.f);
+				int64_t best = -1;
+				float best_score = std::numeric_limits<float>::max();
+				for (GLint v : cluster_vertices) {
+					for (uint32_t a = offsets[v]; a < offsets[v + 1]; a++) {
+						uint32_t t = triangles[a];
+						if (emitted[t]) { continue; }
+
+						int extra = 0;
+						for (int k = 0; k < 3; k++) {
+							extra += owner[indices[t * 3 + k]] != id;
+						}
+						if (cluster_vertices.size() + extra > MAX_VERTICES) { continue; }
+
+						float score = (float) extra + (1.f - glm::dot(axis, normals[t]));
+						if (score < best_score) {
+							best_score = score;
+							best = t;
+						}
+					}
+				}
+				if (best < 0) { break; }
+				add((uint32_t) best);
+			}
+
+			spans.push_back({ first, order.size() - first });
+		}
+
+		Indices clustered;
+		clustered.reserve(indices.size());
+		for (uint32_t t : order) {
+			clustered.push_back(indices[t * 3 + 0]);
+			clustered.push_back(indices[t * 3 + 1]);
+			clustered.push_back(indices[t * 3 + 2]);
+		}
+		std::vector<glm::vec3> clustered_normals(num_triangles);
+		for (size_t t = 0; t < num_triangles; t++) {
+			clustered_normals[t] = normals[order[t]];
+		}
+		indices = std::move(clustered);
+
+		std::vector<Cluster> clusters;
+		clusters.reserve(spans.size());
+		for (const auto& [first, count] : spans) {
+			clusters.push_back(bounds(vertices, indices, clustered_normals, first, count));
+		}
+		return clusters;
+	}
+};
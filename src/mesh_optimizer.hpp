@@ -0,0 +1,234 @@
+#pragma once
+
+#include "mesh_adjacency.hpp"
+
+// Reorders a triangle mesh for the GPU without changing what it looks like:
+// triangles for the post-transform vertex cache with Tipsify (Sander, Nehab
+// and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw", 2007), then whole clusters of them so outward facing parts
+// draw first, then vertices in the order the triangles first use them.
+class MeshOptimizer {
+public:
+	static constexpr int CACHE_SIZE = 16;
+
+private:
+	// Triangles in cache friendly order; a new cluster starts at every
+	// triangle in cluster_starts, where fanning had to jump.
+	static std::vector<uint32_t> tipsify(
+		const Indices& indices, size_t num_vertices, std::vector<size_t>& cluster_starts
+	) {
+		MeshAdjacency adjacency;
+		adjacency.build(indices, num_vertices);
+		// triangles around each vertex not yet emitted
+		std::vector<uint32_t> live(num_vertices);
+		for (size_t v = 0; v < num_vertices; v++) {
+			live[v] = adjacency.count(v);
+		}
+
+		size_t num_triangles = indices.size() / 3;
+		std::vector<uint32_t> order;
+		order.reserve(num_triangles);
+		std::vector<uint8_t> emitted(num_triangles, 0);
+		// time each vertex last entered the cache
+		std::vector<int64_t> cache_time(num_vertices, 0);
+		int64_t time = CACHE_SIZE + 1;
+
+		std::vector<uint32_t> dead_ends;
+		std::vector<uint32_t> candidates;
+		size_t cursor = 0;
+
+		auto skip_dead_end = [&]() -> int64_t {
+			while (!dead_ends.empty()) {
+				uint32_t v = dead_ends.back();
+				dead_ends.pop_back();
+				if (live[v] > 0) { return v; }
+			}
+			while (cursor < num_vertices) {
+				if (live[cursor] > 0) { return (int64_t) cursor; }
+				cursor++;
+			}
+			return -1;
+		};
+
+		int64_t fanning = skip_dead_end();
+		while (fanning >= 0) {
+			candidates.clear();
+			for (uint32_t a = adjacency.offsets[fanning]; a < adjacency.offsets[fanning + 1]; a++) {
+				uint32_t t = adjacency.triangles[a];
+				if (emitted[t]) { continue; }
+				emitted[t] = 1;
+				order.push_back(t);
+				for (int k = 0; k < 3; k++) {
+					uint32_t v = (uint32_t) indices[t * 3 + k];
+					dead_ends.push_back(v);
+					candidates.push_back(v);
+					live[v]--;
+					if (time - cache_time[v] > CACHE_SIZE) {
+						cache_time[v] = time++;
+					}
+				}
+			}
+
+			// the candidate longest in the cache that will still be there
+			// once its remaining triangles are emitted
+			int64_t next = -1;
+			int64_t best = -1;
+			for (uint32_t v : candidates) {
+				if (live[v] == 0) { continue; }
+				int64_t priority = 0;
+				if (time - cache_time[v] + 2 * (int64_t) live[v] <= CACHE_SIZE) {
+					priority = time - cache_time[v];
+				}
+				if (priority > best) {
+					best = priority;
+					next = v;
+				}
+			}
+			if (next < 0) {
+				next = skip_dead_end();
+				cluster_starts.push_back(order.size());
+			}
+			fanning = next;
+		}
+		return order;
+	}
+
+	// Clusters facing away from the mesh's center go first, so they hide
+	// what is behind them in the mesh's own depth test.
+	static std::vector<uint32_t> sort_clusters(
+		const Vertices& vertices, const Indices& indices,
+		const std::vector<uint32_t>& order, const std::vector<size_t>& cluster_starts
+	) {
+		glm::vec3 mesh_center = glm::vec3(0.f);
+		float mesh_area = 0.f;
+
+		struct Cluster {
+			size_t first;
+			size_t count;
+			float key;
+		};
+		std::vector<Cluster> clusters;
+		std::vector<glm::vec3> centers;
+		std::vector<glm::vec3> normals;
+
+		size_t first = 0;
+		for (size_t c = 0; c <= cluster_starts.size(); c++) {
+			size_t end = c < cluster_starts.size() ? cluster_starts[c] : order.size();
+			if (end <= first) { continue; }
+
+			glm::vec3 center = glm::vec3(0.f);
+			glm::vec3 normal = glm::vec3(0.f);
+			float area = 0.f;
+			for (size_t i = first; i < end; i++) {
+				const uint32_t t = order[i];
+				glm::vec3 p0 = vertices[indices[t * 3 + 0]].pos;
+				glm::vec3 p1 = vertices[indices[t * 3 + 1]].pos;
+				glm::vec3 p2 = vertices[indices[t * 3 + 2]].pos;
+				glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+				float a = glm::length(n);
+				center += (p0 + p1 + p2) * (a / 3.f);
+				normal += n;
+				area += a;
+			}
+			mesh_center += center;
+			mesh_area += area;
+			centers.push_back(area > 0.f ? center / area : center);
+			normals.push_back(normal);
+			clusters.push_back(Cluster { first, end - first, 0.f });
+			first = end;
+		}
+		if (mesh_area > 0.f) { mesh_center /= mesh_area; }
+
+		for (size_t c = 0; c < clusters.size(); c++) {
+			float length = glm::length(normals[c]);
+			glm::vec3 normal = length > 0.f ? normals[c] / length : glm::vec3(0.f);
+			clusters[c].key = glm::dot(centers[c] - mesh_center, normal);
+		}
+		std::stable_sort(clusters.begin(), clusters.end(), [](const Cluster& a, const Cluster& b) {
+			return a.key > b.key;
+		});
+
+		std::vector<uint32_t> sorted;
+		sorted.reserve(order.size());
+		for (const auto& cluster : clusters) {
+			sorted.insert(
+				sorted.end(), order.begin() + cluster.first, order.begin() + cluster.first + cluster.count
+			);
+		}
+		return sorted;
+	}
+
+public:
+	// Reorders triangles only, for index lists sharing vertices with others,
+	// like levels of detail. Indices must be a triangle list.
+	static void OptimizeTriangles(const Vertices& vertices, Indices& indices) {
+		if (indices.size() < 3 || indices.size() % 3 != 0 || vertices.empty()) { return; }
+
+		std::vector<size_t> cluster_starts;
+		auto order = tipsify(indices, vertices.size(), cluster_starts);
+		order = sort_clusters(vertices, indices, order, cluster_starts);
+
+		Indices reordered;
+		reordered.reserve(order.size() * 3);
+		for (uint32_t t : order) {
+			reordered.push_back(indices[t * 3 + 0]);
+			reordered.push_back(indices[t * 3 + 1]);
+			reordered.push_back(indices[t * 3 + 2]);
+		}
+		indices = std::move(reordered);
+	}
+
+	// Reorders the triangles of indices[first, first + count) only, for runs
+	// others refer to, like clusters. The run's vertices are numbered
+	// locally first, so this costs nothing for the rest of the mesh.
+	static void OptimizeTriangles(const Vertices& vertices, Indices& indices, size_t first, size_t count) {
+		if (count < 3 || count % 3 != 0 || first + count > indices.size()) { return; }
+
+		std::unordered_map<GLint, GLint> local;
+		Vertices span_vertices;
+		Indices span_indices;
+		std::vector<GLint> global;
+		span_indices.reserve(count);
+		for (size_t i = first; i < first + count; i++) {
+			auto [it, inserted] = local.try_emplace(indices[i], (GLint) span_vertices.size());
+			if (inserted) {
+				span_vertices.push_back(vertices[indices[i]]);
+				global.push_back(indices[i]);
+			}
+			span_indices.push_back(it->second);
+		}
+
+		OptimizeTriangles(span_vertices, span_indices);
+		for (size_t i = 0; i < count; i++) {
+			indices[first + i] = global[span_indices[i]];
+		}
+	}
+
+	// Renumbers vertices in the order the triangles first use them, unused
+	// ones after them. Indices must be a triangle list.
+	static void OptimizeVertices(Vertices& vertices, Indices& indices) {
+		if (indices.size() < 3 || indices.size() % 3 != 0 || vertices.empty()) { return; }
+
+		std::vector<GLint> remap(vertices.size(), -1);
+		Vertices fetch_ordered;
+		fetch_ordered.reserve(vertices.size());
+		for (GLint& index : indices) {
+			if (remap[index] < 0) {
+				remap[index] = (GLint) fetch_ordered.size();
+				fetch_ordered.push_back(vertices[index]);
+			}
+			index = remap[index];
+		}
+		for (size_t v = 0; v < vertices.size(); v++) {
+			if (remap[v] < 0) { fetch_ordered.push_back(vertices[v]); }
+		}
+
+		vertices = std::move(fetch_ordered);
+	}
+
+	// Indices must be a triangle list.
+	static void Optimize(Vertices& vertices, Indices& indices) {
+		OptimizeTriangles(vertices, indices);
+		OptimizeVertices(vertices, indices);
+	}
+};
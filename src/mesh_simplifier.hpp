@@ -0,0 +1,231 @@
+#pragma once
+
+#include "mesh_adjacency.hpp"
+
+// Quadric error edge collapse (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics", 1997), restricted to
+// collapsing a vertex into one of its neighbours. The simplified triangles
+// index the same vertices as the original ones, so every level of detail
+// of a mesh shares one vertex range, and its bake.
+//
+// Vertices on a border or on a seam, where several vertices share a
+// position, never move, so levels keep their outline and do not crack.
+class MeshSimplifier {
+private:
+	// symmetric 4x4 matrix, upper triangle row by row
+	struct Quadric {
+		std::array<double, 10> q = {};
+
+		void add(const Quadric& other) {
+			for (size_t i = 0; i < q.size(); i++) {
+				q[i] += other.q[i];
+			}
+		}
+
+		// weighted squared distance of p to the accumulated planes
+		double error(glm::vec3 p) const {
+			double x = p.x;
+			double y = p.y;
+			double z = p.z;
+			return q[0] * x * x + q[4] * y * y + q[7] * z * z
+				+ 2. * (q[1] * x * y + q[2] * x * z + q[5] * y * z)
+				+ 2. * (q[3] * x + q[6] * y + q[8] * z)
+				+ q[9];
+		}
+
+		static Quadric Plane(glm::dvec3 n, double d, double weight) {
+			Quadric quadric;
+			quadric.q = {
+				n.x * n.x, n.x * n.y, n.x * n.z, n.x * d,
+				n.y * n.y, n.y * n.z, n.y * d,
+				n.z * n.z, n.z * d,
+				d * d
+			};
+			for (double& value : quadric.q) {
+				value *= weight;
+			}
+			return quadric;
+		}
+	};
+
+	struct Collapse {
+		uint32_t from;
+		uint32_t to;
+		double cost;
+	};
+
+	static std::vector<uint8_t> find_locked(const Vertices& vertices, const Indices& indices) {
+		std::vector<uint8_t> locked(vertices.size(), 0);
+
+		// one id per distinct position
+		std::map<std::tuple<float, float, float>, uint32_t> ids;
+		std::vector<uint32_t> position_id(vertices.size());
+		std::vector<uint32_t> group_size;
+		for (size_t v = 0; v < vertices.size(); v++) {
+			const glm::vec3& p = vertices[v].pos;
+			auto [it, added] = ids.insert({ { p.x, p.y, p.z }, (uint32_t) group_size.size() });
+			if (added) { group_size.push_back(0); }
+			position_id[v] = it->second;
+			group_size[it->second]++;
+		}
+
+		// edges used by other than exactly two triangles
+		std::map<std::pair<uint32_t, uint32_t>, int> edges;
+		for (size_t i = 0; i < indices.size(); i += 3) {
+			for (int k = 0; k < 3; k++) {
+				uint32_t a = position_id[indices[i + k]];
+				uint32_t b = position_id[indices[i + (k + 1) % 3]];
+				edges[{ std::min(a, b), std::max(a, b) }]++;
+			}
+		}
+		std::vector<uint8_t> border(group_size.size(), 0);
+		for (const auto& [edge, count] : edges) {
+			if (count != 2) {
+				border[edge.first] = 1;
+				border[edge.second] = 1;
+			}
+		}
+
+		for (size_t v = 0; v < vertices.size(); v++) {
+			uint32_t id = position_id[v];
+			locked[v] = group_size[id] > 1 || border[id];
+		}
+		return locked;
+	}
+
+	// Whether moving from to to turns any triangle around from over, or
+	// nearly so.
+	static bool flips(
+		const Vertices& vertices, const Indices& indices,
+		const std::vector<uint32_t>& offsets, const std::vector<uint32_t>& triangles,
+		uint32_t from, uint32_t to
+	) {
+		for (uint32_t a = offsets[from]; a < offsets[from + 1]; a++) {
+			uint32_t t = triangles[a];
+			GLint v[3] = { indices[t * 3], indices[t * 3 + 1], indices[t * 3 + 2] };
+			if (v[0] == (GLint) to || v[1] == (GLint) to || v[2] == (GLint) to) { continue; }
+
+			glm::vec3 p[3];
+			glm::vec3 q[3];
+			for (int k = 0; k < 3; k++) {
+				p[k] = vertices[v[k]].pos;
+				q[k] = v[k] == (GLint) from ? vertices[to].pos : p[k];
+			}
+			glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+			glm::vec3 after = glm::cross(q[1] - q[0], q[2] - q[0]);
+			// turning by more than about 75 degrees folds the surface
+			if (glm::dot(before, after) <= 0.25f * glm::length(before) * glm::length(after)) { return true; }
+		}
+		return false;
+	}
+
+public:
+	// Simplifies the triangle list indices down to about target_indices
+	// indices, or as far as it gets.
+	static Indices Simplify(const Vertices& vertices, const Indices& indices, size_t target_indices) {
+		Indices result = indices;
+		size_t num_vertices = vertices.size();
+		if (result.size() <= target_indices || num_vertices == 0) { return result; }
+
+		std::vector<uint8_t> locked = find_locked(vertices, result);
+
+		std::vector<Quadric> quadrics(num_vertices);
+		for (size_t i = 0; i + 2 < result.size(); i += 3) {
+			glm::dvec3 p0 = glm::dvec3(vertices[result[i]].pos);
+			glm::dvec3 p1 = glm::dvec3(vertices[result[i + 1]].pos);
+			glm::dvec3 p2 = glm::dvec3(vertices[result[i + 2]].pos);
+			glm::dvec3 n = glm::cross(p1 - p0, p2 - p0);
+			double length = glm::length(n);
+			if (length <= 0.) { continue; }
+			n /= length;
+			Quadric plane = Quadric::Plane(n, -glm::dot(n, p0), length * 0.5);
+			for (int k = 0; k < 3; k++) {
+				quadrics[result[i + k]].add(plane);
+			}
+		}
+
+		MeshAdjacency adjacency;
+		const auto& offsets = adjacency.offsets;
+		const auto& triangles = adjacency.triangles;
+		std::vector<uint32_t> remap(num_vertices);
+		std::vector<uint8_t> touched(num_vertices);
+		std::vector<Collapse> best(num_vertices);
+		std::vector<Collapse> collapses;
+
+		while (result.size() > target_indices) {
+			adjacency.build(result, num_vertices);
+
+			// cheapest collapse of every vertex that may move
+			for (auto& collapse : best) {
+				collapse.cost = std::numeric_limits<double>::max();
+			}
+			for (size_t i = 0; i < result.size(); i += 3) {
+				for (int k = 0; k < 3; k++) {
+					uint32_t a = result[i + k];
+					uint32_t b = result[i + (k + 1) % 3];
+					for (int direction = 0; direction < 2; direction++) {
+						uint32_t from = direction ? b : a;
+						uint32_t to = direction ? a : b;
+						if (locked[from]) { continue; }
+
+						Quadric sum = quadrics[from];
+						sum.add(quadrics[to]);
+						double cost = sum.error(vertices[to].pos);
+						if (cost < best[from].cost) {
+							best[from] = Collapse { from, to, cost };
+						}
+					}
+				}
+			}
+			collapses.clear();
+			for (size_t v = 0; v < num_vertices; v++) {
+				if (best[v].cost < std::numeric_limits<double>::max()) {
+					collapses.push_back(best[v]);
+				}
+			}
+			std::sort(collapses.begin(), collapses.end(), [](const Collapse& a, const Collapse& b) {
+				return a.cost < b.cost;
+			});
+
+			// cheapest first, at most one per neighbourhood and pass
+			for (size_t v = 0; v < num_vertices; v++) {
+				remap[v] = (uint32_t) v;
+			}
+			std::fill(touched.begin(), touched.end(), 0);
+			size_t to_remove = (result.size() - target_indices) / 3 + 1;
+			size_t removed = 0;
+			for (const Collapse& collapse : collapses) {
+				if (removed >= to_remove) { break; }
+				if (touched[collapse.from] || touched[collapse.to]) { continue; }
+				if (flips(vertices, result, offsets, triangles, collapse.from, collapse.to)) { continue; }
+
+				remap[collapse.from] = collapse.to;
+				quadrics[collapse.to].add(quadrics[collapse.from]);
+				for (uint32_t a = offsets[collapse.from]; a < offsets[collapse.from + 1]; a++) {
+					uint32_t t = triangles[a];
+					bool shared = false;
+					for (int k = 0; k < 3; k++) {
+						uint32_t v = result[t * 3 + k];
+						touched[v] = 1;
+						shared = shared || v == collapse.to;
+					}
+					removed += shared;
+				}
+			}
+			if (removed == 0) { break; }
+
+			size_t kept = 0;
+			for (size_t i = 0; i < result.size(); i += 3) {
+				GLint a = remap[result[i]];
+				GLint b = remap[result[i + 1]];
+				GLint c = remap[result[i + 2]];
+				if (a == b || b == c || a == c) { continue; }
+				result[kept++] = a;
+				result[kept++] = b;
+				result[kept++] = c;
+			}
+			result.resize(kept);
+		}
+		return result;
+	}
+};
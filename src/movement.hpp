@@ -22,6 +22,9 @@ private:
 		bool left_mouse_button_down = false;
 		bool right_mouse_button_down = false;
 		bool change_locked = false;
+		bool change_render_mode = false;
+		bool change_depth_prepass = false;
+		bool change_culling = false;
 	} self;
 
 	Movement() = default;
@@ -99,6 +102,18 @@ private:
 		self.change_locked = (input_state == InputState::Begin);
 	}
 
+	void handle_render_mode(const std::string& action, InputState input_state, Key key) {
+		self.change_render_mode = (input_state == InputState::Begin);
+	}
+
+	void handle_depth_prepass(const std::string& action, InputState input_state, Key key) {
+		self.change_depth_prepass = (input_state == InputState::Begin);
+	}
+
+	void handle_culling(const std::string& action, InputState input_state, Key key) {
+		self.change_culling = (input_state == InputState::Begin);
+	}
+
 	void bind_actions() {
 		self.input->bind_action("movement",
 			[this](const std::string& action, InputState input_state, Key key) { 
@@ -142,6 +157,21 @@ private:
 				handle_locked(action, input_state, key); 
 			}, GLFW_KEY_ESCAPE
 		);
+		self.input->bind_action("handle render mode",
+			[this](const std::string& action, InputState input_state, Key key) {
+				handle_render_mode(action, input_state, key);
+			}, GLFW_KEY_V
+		);
+		self.input->bind_action("handle depth prepass",
+			[this](const std::string& action, InputState input_state, Key key) {
+				handle_depth_prepass(action, input_state, key);
+			}, GLFW_KEY_P
+		);
+		self.input->bind_action("handle culling",
+			[this](const std::string& action, InputState input_state, Key key) {
+				handle_culling(action, input_state, key);
+			}, GLFW_KEY_G
+		);
 
 		self.input->set_mouse_locked(true);
 	}
@@ -193,4 +223,28 @@ public:
 	void set_change_locked(bool x) {
 		self.change_locked = x;
 	}
+
+	bool get_change_render_mode() const {
+		return self.change_render_mode;
+	}
+
+	void set_change_render_mode(bool x) {
+		self.change_render_mode = x;
+	}
+
+	bool get_change_depth_prepass() const {
+		return self.change_depth_prepass;
+	}
+
+	void set_change_depth_prepass(bool x) {
+		self.change_depth_prepass = x;
+	}
+
+	bool get_change_culling() const {
+		return self.change_culling;
+	}
+
+	void set_change_culling(bool x) {
+		self.change_culling = x;
+	}
 };
\ No newline at end of file
@@ -17,44 +17,67 @@ using Indices = std::vector<GLint>;
 #include "shapes/wedge.hpp"
 #include "shapes/corner_wedge_outer.hpp"
 #include "shapes/corner_wedge_inner.hpp"
+#include "mesh_optimizer.hpp"
+#include "mesh_simplifier.hpp"
+#include "mesh_clusters.hpp"
 
 
 class InstantiableMesh;
 class Instance;
 
+// 96 bytes, laid out the same as in std430 storage buffers.
 struct InstanceData {
-	glm::mat4 model = glm::mat4(1.f);
-	glm::vec4 color = glm::vec4(1.f);
+	// rows of the affine model matrix, whose last row is 0, 0, 0, 1
+	glm::vec4 model[3] = {
+		glm::vec4(1.f, 0.f, 0.f, 0.f), glm::vec4(0.f, 1.f, 0.f, 0.f), glm::vec4(0.f, 0.f, 1.f, 0.f)
+	};
+	// columns of the inverse transpose of its upper 3x3, each followed by
+	// a scalar the way std430 packs a vec3 and a scalar
+	glm::vec3 normal_0 = glm::vec3(1.f, 0.f, 0.f);
+	GLuint color = 0xffffffff; // RGBA8
+	glm::vec3 normal_1 = glm::vec3(0.f, 1.f, 0.f);
+	// first vertex of this instance in the baked lighting buffer, -1 if
+	// it has no bake
+	GLint baked_offset = -1;
+	glm::vec3 normal_2 = glm::vec3(0.f, 0.f, 1.f);
+	GLuint padding = 0;
+
+	glm::mat4 get_model() const {
+		return glm::transpose(glm::mat4(model[0], model[1], model[2], glm::vec4(0.f, 0.f, 0.f, 1.f)));
+	}
 };
+static_assert(sizeof(InstanceData) == 96, "InstanceData must match its std430 layout");
+
+#include "geometry_arena.hpp"
+#include "instance_bvh.hpp"
 	
 class Instance {
 private:
 	struct Self {
 		InstantiableMesh* object = nullptr;
-		int64_t index = -1;
+		// stays valid while the mesh moves the instance's data around
+		int64_t handle = -1;
 
 		std::string name = "";
 
-		glm::mat4 frame = glm::mat4(1.f);
-		glm::vec3 size = glm::vec3(1.f);
+		// the frame and size live with the mesh, which composes them
 		glm::vec4 rgba = glm::vec4(1.f);
+		bool is_static = false;
 	} self;
 		
 	Instance() = default;
 
-	void initialize(InstantiableMesh* object, int64_t index) {
+	void initialize(InstantiableMesh* object, int64_t handle) {
 		self.object = object;
-		self.index = index;
-		update_object();
+		self.handle = handle;
 	}
 
 public:
-	void update_object();
 	~Instance();
 
-	static std::unique_ptr<Instance> New(InstantiableMesh* object, int64_t index) {
+	static std::unique_ptr<Instance> New(InstantiableMesh* object, int64_t handle) {
 		auto instance = std::unique_ptr<Instance>(new Instance());
-		instance->initialize(object, index);
+		instance->initialize(object, handle);
 		return instance;
 	}
 
@@ -74,47 +97,103 @@ public:
 		return self.name == comp_name;
 	}
 
-	glm::vec3 get_size() const {
-		return self.size;
+	glm::vec3 get_size() const;
+	void set_size(glm::vec3 size);
+	glm::mat4 get_frame() const;
+	void set_frame(glm::mat4 frame);
+	// Frame and size in one update, as an animation sets them.
+	void set_transform(glm::mat4 frame, glm::vec3 size);
+
+	glm::vec4 get_color() const {
+		return self.rgba;
 	}
 
-	void set_size(glm::vec3 size) {
-		self.size = glm::max(size, 0.f);
-		update_object();
+	void set_color(glm::vec4 rgba);
+
+	bool is_transparent() const {
+		return self.rgba.w < 1.f;
 	}
 
-	glm::mat4 get_frame() const {
-		return self.frame;
+	InstantiableMesh* get_object() const {
+		return self.object;
 	}
 
-	void set_frame(glm::mat4 frame) {
-		self.frame = frame;
-		update_object();
+	// Stays the instance's while it lives, see InstantiableMesh::set_frames.
+	int64_t get_handle() const {
+		return self.handle;
 	}
 
-	glm::vec4 get_color() const {
-		return self.rgba;
+	glm::mat4 get_model() const {
+		return get_frame() * glm::scale(glm::mat4(1.f), get_size());
 	}
 
-	void set_color(glm::vec4 rgba) {
-		self.rgba = glm::clamp(rgba, 0.f, 1.f);
-		update_object();
+	// Static instances are baked by LightBaker; moving one afterwards drops
+	// its bake.
+	bool is_static() const {
+		return self.is_static;
 	}
 
-	bool is_transparent() const {
-		return self.rgba.w < 1.f;
+	void set_static(bool is_static) {
+		self.is_static = is_static;
 	}
+
+	void set_baked_offset(GLint offset);
 };
 
 
+// Dynamic instance buffers are re-uploaded where instances changed before
+// each draw; persistent ones are mapped once and written in place, one ring
+// segment per frame in flight.
+enum class InstanceStorage {
+	Dynamic,
+	Persistent,
+};
+
 class InstantiableMesh {
 public:
 	using Shape_Creator = std::function<void(Vertices&, Indices&)>;
+
+	// Above this share of dirty instances one upload of the whole buffer
+	// beats uploading the ranges.
+	static constexpr size_t FULL_UPLOAD_PERCENT = 50;
+	// Clean instances between two dirty ones are uploaded along with them
+	// up to this many, trading a few bytes for one call less.
+	static constexpr size_t RANGE_MERGE_GAP = 8;
+	// Frames of persistently mapped instances the CPU may run ahead by.
+	static constexpr int RING_SEGMENTS = 3;
+	// Levels of detail, the full mesh included. Each one has about
+	// LOD_REDUCTION of the triangles of the one before, and there are no
+	// more once a level would have fewer than MIN_LOD_TRIANGLES or the
+	// simplifier stops making headway.
+	static constexpr int MAX_LODS = 4;
+	static constexpr float LOD_REDUCTION = 0.5f;
+	static constexpr size_t MIN_LOD_TRIANGLES = 32;
+	// An instance gets the full mesh while its bounding sphere's projected
+	// radius is at least this share of half the view's height, and one
+	// level coarser every time that halves.
+	static constexpr float LOD_BASE_SIZE = 0.25f;
+	// Meshes with at least this many triangles are split into clusters,
+	// culled one by one when drawn in full detail.
+	static constexpr size_t MIN_CLUSTERED_TRIANGLES = 1024;
+
+	struct Lod {
+		GLuint first_index;
+		GLsizei count;
+	};
 private:
+	// draw_handles() keys slots with their level of detail above LOD_SHIFT
+	static constexpr int LOD_SHIFT = 48;
+	static constexpr int64_t SLOT_MASK = (1ll << LOD_SHIFT) - 1;
+
+	// Vertices and indices live in the GeometryArena at range; the CPU copy
+	// stays for baking and bounds. Every level of detail indexes the same
+	// vertices from range.base_vertex on. Clusters, if any, split the full
+	// level, indices relative to its first.
 	struct Mesh {
 		GLuint vao = 0;
-		GLuint vbo = 0;
-		GLuint ebo = 0;
+		GeometryArena::Range range;
+		std::vector<Lod> lods;
+		std::vector<MeshClusters::Cluster> clusters;
 
 		Vertices vertices;
 		Indices indices;
@@ -125,22 +204,17 @@ private:
 	private:
 		void move(Mesh& other) {
 			vao = other.vao;
-			vbo = other.vbo;
-			ebo = other.ebo;
+			range = other.range;
+			lods = std::move(other.lods);
+			clusters = std::move(other.clusters);
 			vertices = std::move(other.vertices);
 			indices = std::move(other.indices);
 			other.vao = 0;
-			other.vbo = 0;
-			other.ebo = 0;
 		}
 
 		void cleanup() {
 			if (vao) glDeleteVertexArrays(1, &vao);
-			if (vbo) glDeleteBuffers(1, &vbo);
-			if (ebo) glDeleteBuffers(1, &ebo);
 			vao = 0;
-			vbo = 0;
-			ebo = 0;
 		}
 	public:
 		Mesh(Mesh&& other) noexcept { move(other); };
@@ -155,19 +229,113 @@ private:
 		~Mesh() { cleanup(); }
 	};
 
+	// Dirty instance indices as one bit each, count of them set.
+	struct DirtyBits {
+		std::vector<uint64_t> bits;
+		size_t count = 0;
+
+		void mark(int64_t index) {
+			size_t word = (size_t) index / 64;
+			if (word >= bits.size()) {
+				bits.resize(word + 1, 0);
+			}
+			uint64_t bit = 1ull << (index % 64);
+			if (!(bits[word] & bit)) {
+				bits[word] |= bit;
+				count += 1;
+			}
+		}
+
+		void clear() {
+			std::fill(bits.begin(), bits.end(), 0);
+			count = 0;
+		}
+
+		static size_t lowest_bit(uint64_t word) {
+			static constexpr uint8_t de_bruijn[64] = {
+				 0,  1,  2, 53,  3,  7, 54, 27,  4, 38, 41,  8, 34, 55, 48, 28,
+				62,  5, 39, 46, 44, 42, 22,  9, 24, 35, 59, 56, 49, 18, 29, 11,
+				63, 52,  6, 26, 37, 40, 33, 47, 61, 45, 43, 21, 23, 58, 17, 10,
+				51, 25, 36, 32, 60, 20, 57, 16, 50, 31, 19, 15, 30, 14, 13, 12,
+			};
+			return de_bruijn[((word & (~word + 1)) * 0x022fdd63cc95386dull) >> 58];
+		}
+
+		// Calls upload(first, count) for every run of dirty instances below
+		// limit, runs closer than RANGE_MERGE_GAP joined into one.
+		template<typename Upload>
+		void for_each_range(size_t limit, Upload upload) const {
+			size_t first = 0;
+			size_t last = 0;
+			bool open = false;
+			for (size_t w = 0; w < bits.size(); w++) {
+				uint64_t word = bits[w];
+				while (word) {
+					size_t i = w * 64 + lowest_bit(word);
+					word &= word - 1;
+					if (i >= limit) { break; }
+					if (open && i - last <= RANGE_MERGE_GAP + 1) {
+						last = i;
+						continue;
+					}
+					if (open) { upload(first, last - first + 1); }
+					first = last = i;
+					open = true;
+				}
+			}
+			if (open) { upload(first, last - first + 1); }
+		}
+	};
+
+	// What four consecutive slots are composed from, a lane each, so
+	// compose_batch() loads every component of all four at once.
+	struct alignas(16) TransformBatch {
+		// xyz of the frame's first three columns, column after column
+		float basis[9][4];
+		float translation[3][4];
+		float size[3][4];
+		// RGBA8
+		GLuint color[4];
+	};
+
 	struct Self {
 		Mesh mesh;
 
 		GLsizei indices = 0;
-		GLenum index_type = GL_UNSIGNED_INT;
+		// outlives the mesh; its index type may change with a commit
+		GeometryArena* arena = nullptr;
 		GLenum draw_mode = GL_TRIANGLES;
+		InstanceStorage storage = InstanceStorage::Dynamic;
+		// object space bounding sphere, center and radius, and box
+		glm::vec4 bounds = glm::vec4(0.f);
+		glm::vec3 box_lo = glm::vec3(0.f);
+		glm::vec3 box_hi = glm::vec3(0.f);
+
+		// world boxes of the live instances go to bvh, keyed with bvh_id
+		InstanceBvh* bvh = nullptr;
+		uint32_t bvh_id = 0;
 
 		std::vector<InstanceData> instances;
+		// what instances are composed from, slot / 4 in lane slot % 4, and
+		// the slots changed since the last compose_instances()
+		std::vector<TransformBatch> transforms;
+		DirtyBits pending;
 		GLuint vbo_instances = 0;
 		size_t vbo_capacity = 0;
 
-		std::set<int64_t> free_indices;
-		std::set<int64_t> dirty_instances;
+		// live instances are packed at the front of instances; a handle
+		// finds its slot through slots, and handles[slot] leads back
+		std::vector<int64_t> slots;
+		std::vector<int64_t> handles;
+		std::vector<int64_t> free_handles;
+		DirtyBits dirty;
+
+		// InstanceStorage::Persistent: RING_SEGMENTS segments of vbo_capacity
+		// instances, each with the changes it has not seen yet
+		InstanceData* mapped = nullptr;
+		int segment = 0;
+		std::array<GLsync, RING_SEGMENTS> fences = {};
+		std::array<DirtyBits, RING_SEGMENTS> segment_dirty;
 
 		Self() = default;
 		Self(const Self&) = delete;
@@ -176,16 +344,39 @@ private:
 		void move(Self& other) {
 			mesh = std::move(other.mesh);
 			indices = other.indices;
-			index_type = other.index_type;
+			arena = other.arena;
 			draw_mode = other.draw_mode;
+			storage = other.storage;
+			bounds = other.bounds;
+			box_lo = other.box_lo;
+			box_hi = other.box_hi;
+			bvh = other.bvh;
+			bvh_id = other.bvh_id;
 			vbo_instances = other.vbo_instances;
 			vbo_capacity = other.vbo_capacity;
 			instances = std::move(other.instances);
-			free_indices = std::move(other.free_indices);
-			dirty_instances = std::move(other.dirty_instances);
+			transforms = std::move(other.transforms);
+			pending = std::move(other.pending);
+			slots = std::move(other.slots);
+			handles = std::move(other.handles);
+			free_handles = std::move(other.free_handles);
+			dirty = std::move(other.dirty);
+			mapped = other.mapped;
+			segment = other.segment;
+			fences = other.fences;
+			segment_dirty = std::move(other.segment_dirty);
+			other.vbo_instances = 0;
+			other.mapped = nullptr;
+			other.fences = {};
 		}
 
 		void cleanup() {
+			for (GLsync& fence : fences) {
+				if (fence) { glDeleteSync(fence); }
+				fence = nullptr;
+			}
+			if (mapped) { glUnmapNamedBuffer(vbo_instances); }
+			mapped = nullptr;
 			if (vbo_instances) { glDeleteBuffers(1, &vbo_instances); }
 			vbo_instances = 0;
 		}
@@ -202,65 +393,137 @@ private:
 
 	InstantiableMesh() = default;
 
-	static inline void setup_attribute(
-		GLuint index, GLint size, GLsizei stride, const void* offset
-	) {
-		glVertexAttribPointer(index, size, GL_FLOAT, GL_FALSE, stride, offset);
-		glEnableVertexAttribArray(index);
-	}
+	void setup_buffers(GeometryArena* arena) {
+		auto& mesh = self.mesh;
+		mesh.range = arena->allocate(mesh.vertices, mesh.indices);
+		mesh.lods = { Lod { mesh.range.first_index, self.indices } };
+		if (self.draw_mode == GL_TRIANGLES) { allocate_lods(arena); }
 
-	static inline void setup_divattr(
-		GLuint index, GLint size, GLsizei stride, const void* offset
-	) {
-		setup_attribute(index, size, stride, offset);
-		glVertexAttribDivisor(index, 1);
+		glGenVertexArrays(1, &mesh.vao);
+		arena->setup_vertex_attributes(mesh.vao);
+
+		if (self.storage == InstanceStorage::Dynamic) {
+			glGenBuffers(1, &self.vbo_instances);
+			GeometryArena::setup_instance_attributes(mesh.vao, self.vbo_instances);
+		}
 	}
 
-	void setup_buffers() {
+	// Simplifies each level from the one before it.
+	void allocate_lods(GeometryArena* arena) {
 		auto& mesh = self.mesh;
-		glGenVertexArrays(1, &(mesh.vao));
-		glGenBuffers(1, &(mesh.vbo));
-		glGenBuffers(1, &(mesh.ebo));
-		glGenBuffers(1, &self.vbo_instances);
-			
-		glBindVertexArray(self.mesh.vao);
-			
-		auto& verts = self.mesh.vertices;
-		glBindBuffer(GL_ARRAY_BUFFER, self.mesh.vbo);
-		glBufferData(GL_ARRAY_BUFFER, verts.size() * sizeof(Vertex), verts.data(), GL_STATIC_DRAW);
-
-		auto& indis = self.mesh.indices;
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, self.mesh.ebo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER,indis.size() * sizeof(GLint), indis.data(), GL_STATIC_DRAW);
+		Indices previous = mesh.indices;
+		while ((int) mesh.lods.size() < MAX_LODS) {
+			size_t target = (size_t) (previous.size() / 3 * LOD_REDUCTION) * 3;
+			if (target / 3 < MIN_LOD_TRIANGLES) { break; }
+
+			Indices lod = MeshSimplifier::Simplify(mesh.vertices, previous, target);
+			// a level barely coarser than the last is not worth a draw
+			if (lod.size() / 3 < MIN_LOD_TRIANGLES || lod.size() > (previous.size() + target) / 2) { break; }
+
+			MeshOptimizer::OptimizeTriangles(mesh.vertices, lod);
+			auto range = arena->allocate_indices(lod, mesh.range.base_vertex);
+			mesh.lods.push_back(Lod { range.first_index, (GLsizei) lod.size() });
+			previous = std::move(lod);
+		}
+	}
 
-		GLsizei stride = sizeof(Vertex);
-		
-		setup_attribute(0, 3, stride, (void*) offsetof(Vertex, pos));
-		setup_attribute(1, 3, stride, (void*) offsetof(Vertex, nor));
-		setup_attribute(2, 2, stride, (void*) offsetof(Vertex, tex));
+	// Projected radius of slot's bounding sphere in normalized device
+	// coordinates, the way the culling shader measures it.
+	float projected_size(size_t slot, const glm::mat4& view_projection) const {
+		const auto& rows = self.instances[slot].model;
+		glm::vec4 sphere_center = glm::vec4(glm::vec3(self.bounds), 1.f);
+		glm::vec4 center = glm::vec4(
+			glm::dot(rows[0], sphere_center), glm::dot(rows[1], sphere_center),
+			glm::dot(rows[2], sphere_center), 1.f
+		);
+		glm::vec3 x = glm::vec3(rows[0].x, rows[1].x, rows[2].x);
+		glm::vec3 y = glm::vec3(rows[0].y, rows[1].y, rows[2].y);
+		glm::vec3 z = glm::vec3(rows[0].z, rows[1].z, rows[2].z);
+		float scale = std::sqrt(std::max({ glm::dot(x, x), glm::dot(y, y), glm::dot(z, z) }));
 
-		glBindBuffer(GL_ARRAY_BUFFER, self.vbo_instances);
-		glBufferData(
-			GL_ARRAY_BUFFER,
-			self.vbo_capacity * sizeof(InstanceData),
-			self.instances.data(),
-			GL_DYNAMIC_DRAW
+		glm::vec4 w_row = glm::vec4(
+			view_projection[0][3], view_projection[1][3], view_projection[2][3], view_projection[3][3]
 		);
-		GLsizei inst_s = sizeof(InstanceData);
-		GLsizei vec4_s = sizeof(glm::vec4);
+		float w = std::max(glm::dot(w_row, center), 1e-4f);
+		return self.bounds.w * scale * LodScale(view_projection) / w;
+	}
+
+	// Where the segment in use holds index, or null with dynamic storage
+	// or while the ring has yet to grow to it before the next draw.
+	InstanceData* mapped_slot(int64_t index) {
+		if (self.storage == InstanceStorage::Dynamic || (size_t) index >= self.vbo_capacity) {
+			return nullptr;
+		}
+		return self.mapped + self.segment * self.vbo_capacity + index;
+	}
 
-		setup_divattr(3, 4, inst_s, (void*) (offsetof(InstanceData, model) + 0 * vec4_s));
-		setup_divattr(4, 4, inst_s, (void*) (offsetof(InstanceData, model) + 1 * vec4_s));
-		setup_divattr(5, 4, inst_s, (void*) (offsetof(InstanceData, model) + 2 * vec4_s));
-		setup_divattr(6, 4, inst_s, (void*) (offsetof(InstanceData, model) + 3 * vec4_s));
-		setup_divattr(7, 4, inst_s, (void*) (offsetof(InstanceData, color)));
+	// A change already in mapped_slot(), if any: dynamic storage uploads it
+	// before the next draw, the ring's other segments get it on their next
+	// turn.
+	void mark_written(int64_t index) {
+		if (self.storage == InstanceStorage::Dynamic) {
+			self.dirty.mark(index);
+			return;
+		}
+		if ((size_t) index >= self.vbo_capacity) { return; }
 
-		glBindVertexArray(0);
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+		for (int s = 0; s < RING_SEGMENTS; s++) {
+			if (s != self.segment) { self.segment_dirty[s].mark(index); }
+		}
+	}
+
+	// Persistent storage writes a change straight into the segment in use.
+	void mark_dirty(int64_t index) {
+		if (InstanceData* mapped = mapped_slot(index)) {
+			*mapped = self.instances[index];
+		}
+		mark_written(index);
+	}
+
+	static void wait_fence(GLsync& fence) {
+		if (!fence) { return; }
+		while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
+
+	// Immutable storage cannot grow, so a bigger ring replaces it, filled
+	// with every instance in all segments.
+	void allocate_ring(size_t capacity) {
+		for (GLsync& fence : self.fences) {
+			if (fence) { glDeleteSync(fence); }
+			fence = nullptr;
+		}
+		if (self.mapped) { glUnmapNamedBuffer(self.vbo_instances); }
+		if (self.vbo_instances) { glDeleteBuffers(1, &self.vbo_instances); }
+
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		GLsizeiptr size = RING_SEGMENTS * capacity * sizeof(InstanceData);
+		glCreateBuffers(1, &self.vbo_instances);
+		glNamedBufferStorage(self.vbo_instances, size, nullptr, flags);
+		self.mapped = (InstanceData*) glMapNamedBufferRange(self.vbo_instances, 0, size, flags);
+		self.vbo_capacity = capacity;
+		self.segment = 0;
+
+		for (int s = 0; s < RING_SEGMENTS; s++) {
+			std::copy(
+				self.instances.begin(), self.instances.end(),
+				self.mapped + s * capacity
+			);
+			self.segment_dirty[s].clear();
+		}
+		GeometryArena::setup_instance_attributes(self.mesh.vao, self.vbo_instances);
 	}
 
 	void prepare_instance_vbo() {
+		compose_instances();
+		if (self.storage == InstanceStorage::Persistent) {
+			if (self.instances.size() > self.vbo_capacity) {
+				allocate_ring(std::max(self.instances.size(), self.vbo_capacity * 2));
+			}
+			return;
+		}
+
 		if (self.instances.empty()) {
 			if (self.vbo_capacity > 0) {
 				glBindBuffer(GL_ARRAY_BUFFER, self.vbo_instances);
@@ -268,52 +531,357 @@ private:
 				glBindBuffer(GL_ARRAY_BUFFER, 0);
 				self.vbo_capacity = 0;
 			}
-			self.dirty_instances.clear();
+			self.dirty.clear();
 			return;
 		}
 
-		if (self.dirty_instances.empty() && self.instances.size() == self.vbo_capacity) {
+		if (self.dirty.count == 0 && self.instances.size() <= self.vbo_capacity) {
 			return;
 		}
 
 		glBindBuffer(GL_ARRAY_BUFFER, self.vbo_instances);
 
-		if (
-			self.instances.size() > self.vbo_capacity
-			|| self.vbo_capacity == 0
-			|| self.instances.size() < self.vbo_capacity / 2
-		) {
+		size_t size = self.instances.size();
+		if (size > self.vbo_capacity || size < self.vbo_capacity / 4) {
+			// grows geometrically, so adding instances one by one does not
+			// reallocate every time
+			self.vbo_capacity = size > self.vbo_capacity
+				? std::max(size, self.vbo_capacity * 2) : size;
 			glBufferData(
-				GL_ARRAY_BUFFER,
-				self.instances.size() * sizeof(InstanceData),
-				self.instances.data(), 
-				GL_DYNAMIC_DRAW
+				GL_ARRAY_BUFFER, self.vbo_capacity * sizeof(InstanceData),
+				nullptr, GL_DYNAMIC_DRAW
+			);
+			glBufferSubData(
+				GL_ARRAY_BUFFER, 0, size * sizeof(InstanceData), self.instances.data()
+			);
+		} else if (self.dirty.count * 100 >= size * FULL_UPLOAD_PERCENT) {
+			glBufferSubData(
+				GL_ARRAY_BUFFER, 0, size * sizeof(InstanceData), self.instances.data()
 			);
-			self.vbo_capacity = self.instances.size();
-			self.dirty_instances.clear();
 		} else {
-			for (auto i : self.dirty_instances) {
+			self.dirty.for_each_range(size, [this](size_t first, size_t count) {
 				glBufferSubData(
-					GL_ARRAY_BUFFER, i * sizeof(InstanceData),
-					sizeof(InstanceData),
-					&self.instances[i]
+					GL_ARRAY_BUFFER, first * sizeof(InstanceData),
+					count * sizeof(InstanceData),
+					&self.instances[first]
 				);
-			}
-			self.dirty_instances.clear();
+			});
 		}
+		self.dirty.clear();
 		
 		glBindBuffer(GL_ARRAY_BUFFER, 0);
 	}
 
-	void initialize(GLenum draw_mode) {
+	// First instance of the segment the GPU reads this frame.
+	GLuint base_instance() const {
+		return self.storage == InstanceStorage::Persistent
+			? (GLuint) (self.segment * self.vbo_capacity) : 0;
+	}
+
+	// Inverse transpose of the upper 3x3 from its cofactors: three cross
+	// products and one division per instance, instead of a full inverse in
+	// the vertex shader for every vertex.
+	static glm::mat3 normal_matrix(const glm::mat4& model) {
+		glm::vec3 c0 = glm::vec3(model[0]);
+		glm::vec3 c1 = glm::vec3(model[1]);
+		glm::vec3 c2 = glm::vec3(model[2]);
+		glm::vec3 n0 = glm::cross(c1, c2);
+		glm::vec3 n1 = glm::cross(c2, c0);
+		glm::vec3 n2 = glm::cross(c0, c1);
+
+		float det = glm::dot(c0, n0);
+		if (std::abs(det) < 1e-20f) { return glm::mat3(0.f); }
+
+		float inv_det = 1.f / det;
+		return glm::mat3(n0 * inv_det, n1 * inv_det, n2 * inv_det);
+	}
+
+	void store_frame(size_t slot, const glm::mat4& frame) {
+		auto& batch = self.transforms[slot / 4];
+		size_t lane = slot % 4;
+		for (int c = 0; c < 3; c++) {
+			for (int r = 0; r < 3; r++) {
+				batch.basis[c * 3 + r][lane] = frame[c][r];
+			}
+			batch.translation[c][lane] = frame[3][c];
+		}
+	}
+
+	void store_size(size_t slot, const glm::vec3& size) {
+		auto& batch = self.transforms[slot / 4];
+		for (int c = 0; c < 3; c++) {
+			batch.size[c][slot % 4] = size[c];
+		}
+	}
+
+	void copy_transform(size_t to, size_t from) {
+		auto& target = self.transforms[to / 4];
+		const auto& source = self.transforms[from / 4];
+		size_t t = to % 4;
+		size_t f = from % 4;
+		for (int k = 0; k < 9; k++) {
+			target.basis[k][t] = source.basis[k][f];
+		}
+		for (int k = 0; k < 3; k++) {
+			target.translation[k][t] = source.translation[k][f];
+			target.size[k][t] = source.size[k][f];
+		}
+		target.color[t] = source.color[f];
+	}
+
+	// Composes model = frame * scale(size), stored as rows, and its normal
+	// matrix for the slots of batch within [begin, end), four lanes at a
+	// time, and writes each straight into its instance data and the mapped
+	// segment in use. A slot whose model changed loses its bake.
+	void compose_batch(size_t batch, size_t begin, size_t end) {
+		const TransformBatch& t = self.transforms[batch];
+		size_t first = std::max(batch * 4, begin);
+		size_t last = std::min(batch * 4 + 4, end);
+#ifdef RENDERER_SSE
+		// the scaled columns, component by component
+		__m128 c[3][3];
+		for (int k = 0; k < 3; k++) {
+			__m128 size = _mm_load_ps(t.size[k]);
+			for (int r = 0; r < 3; r++) {
+				c[k][r] = _mm_mul_ps(_mm_load_ps(t.basis[k * 3 + r]), size);
+			}
+		}
+		// rows[r][lane] once transposed
+		__m128 rows[3][4];
+		for (int r = 0; r < 3; r++) {
+			rows[r][0] = c[0][r];
+			rows[r][1] = c[1][r];
+			rows[r][2] = c[2][r];
+			rows[r][3] = _mm_load_ps(t.translation[r]);
+			_MM_TRANSPOSE4_PS(rows[r][0], rows[r][1], rows[r][2], rows[r][3]);
+		}
+
+		// Inverse transpose of the upper 3x3 from its cofactors. n[k] is
+		// column k, component by component, then the scalar after it.
+		auto cross = [](const __m128* a, const __m128* b, __m128* n) {
+			n[0] = _mm_sub_ps(_mm_mul_ps(a[1], b[2]), _mm_mul_ps(a[2], b[1]));
+			n[1] = _mm_sub_ps(_mm_mul_ps(a[2], b[0]), _mm_mul_ps(a[0], b[2]));
+			n[2] = _mm_sub_ps(_mm_mul_ps(a[0], b[1]), _mm_mul_ps(a[1], b[0]));
+		};
+		__m128 n[3][4];
+		cross(c[1], c[2], n[0]);
+		cross(c[2], c[0], n[1]);
+		cross(c[0], c[1], n[2]);
+		__m128 det = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(c[0][0], n[0][0]), _mm_mul_ps(c[0][1], n[0][1])), _mm_mul_ps(c[0][2], n[0][2])
+		);
+		__m128 singular = _mm_cmplt_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), det), _mm_set1_ps(1e-20f));
+		__m128 inv_det = _mm_andnot_ps(singular, _mm_div_ps(_mm_set1_ps(1.f), det));
+		for (int k = 0; k < 3; k++) {
+			for (int r = 0; r < 3; r++) {
+				n[k][r] = _mm_mul_ps(n[k][r], inv_det);
+			}
+		}
+
+		alignas(16) GLint baked[4] = { -1, -1, -1, -1 };
+		for (size_t slot = first; slot < last; slot++) {
+			size_t lane = slot % 4;
+			const InstanceData& data = self.instances[slot];
+			const float* m = glm::value_ptr(data.model[0]);
+			__m128 same = _mm_and_ps(
+				_mm_and_ps(_mm_cmpeq_ps(rows[0][lane], _mm_loadu_ps(m + 0)), _mm_cmpeq_ps(rows[1][lane], _mm_loadu_ps(m + 4))),
+				_mm_cmpeq_ps(rows[2][lane], _mm_loadu_ps(m + 8))
+			);
+			if (_mm_movemask_ps(same) == 0xf) { baked[lane] = data.baked_offset; }
+		}
+		// loads of the bits as they are, nothing is computed on them
+		n[0][3] = _mm_load_ps((const float*) t.color);
+		n[1][3] = _mm_load_ps((const float*) baked);
+		n[2][3] = _mm_setzero_ps();
+		for (int k = 0; k < 3; k++) {
+			_MM_TRANSPOSE4_PS(n[k][0], n[k][1], n[k][2], n[k][3]);
+		}
+
+		// InstanceData is these six in order
+		for (size_t slot = first; slot < last; slot++) {
+			size_t lane = slot % 4;
+			__m128 values[6] = { rows[0][lane], rows[1][lane], rows[2][lane], n[0][lane], n[1][lane], n[2][lane] };
+			float* data = (float*) &self.instances[slot];
+			for (int v = 0; v < 6; v++) {
+				_mm_storeu_ps(data + v * 4, values[v]);
+			}
+			if (InstanceData* mapped = mapped_slot(slot)) {
+				for (int v = 0; v < 6; v++) {
+					_mm_storeu_ps((float*) mapped + v * 4, values[v]);
+				}
+			}
+		}
+#else
+		for (size_t slot = first; slot < last; slot++) {
+			size_t lane = slot % 4;
+			glm::mat4 model = glm::mat4(1.f);
+			for (int k = 0; k < 3; k++) {
+				for (int r = 0; r < 3; r++) {
+					model[k][r] = t.basis[k * 3 + r][lane] * t.size[k][lane];
+				}
+				model[3][k] = t.translation[k][lane];
+			}
+
+			InstanceData& data = self.instances[slot];
+			bool changed = false;
+			for (int row = 0; row < 3; row++) {
+				glm::vec4 values = glm::vec4(model[0][row], model[1][row], model[2][row], model[3][row]);
+				changed = changed || data.model[row] != values;
+				data.model[row] = values;
+			}
+			glm::mat3 normal = normal_matrix(model);
+			data.normal_0 = normal[0];
+			data.normal_1 = normal[1];
+			data.normal_2 = normal[2];
+			data.color = t.color[lane];
+			if (changed) { data.baked_offset = -1; }
+			if (InstanceData* mapped = mapped_slot(slot)) { *mapped = data; }
+		}
+#endif
+		for (size_t slot = first; slot < last; slot++) {
+			if (self.bvh) { update_spatial_index(self.handles[slot], self.instances[slot].get_model()); }
+			mark_written(slot);
+		}
+	}
+
+	int64_t slot_of(int64_t handle) const {
+		if (handle < 0 || handle >= static_cast<int64_t>(self.slots.size())) {
+			return -1;
+		}
+		return self.slots[handle];
+	}
+
+	void compute_bounds() {
+		const auto& vertices = self.mesh.vertices;
+		if (vertices.empty()) { return; }
+
+		glm::vec3 lo = vertices[0].pos;
+		glm::vec3 hi = vertices[0].pos;
+		for (const auto& vertex : vertices) {
+			lo = glm::min(lo, vertex.pos);
+			hi = glm::max(hi, vertex.pos);
+		}
+		glm::vec3 center = (lo + hi) * 0.5f;
+		float radius = 0.f;
+		for (const auto& vertex : vertices) {
+			radius = std::max(radius, glm::length(vertex.pos - center));
+		}
+		self.bounds = glm::vec4(center, radius);
+		self.box_lo = lo;
+		self.box_hi = hi;
+	}
+
+	void update_spatial_index(int64_t handle, const glm::mat4& model) {
+		glm::vec3 center = glm::vec3(model * glm::vec4((self.box_lo + self.box_hi) * 0.5f, 1.f));
+		glm::vec3 half = (self.box_hi - self.box_lo) * 0.5f;
+		glm::vec3 extent =
+			glm::abs(glm::vec3(model[0])) * half.x +
+			glm::abs(glm::vec3(model[1])) * half.y +
+			glm::abs(glm::vec3(model[2])) * half.z;
+		self.bvh->set(InstanceBvh::key(self.bvh_id, handle), center - extent, center + extent);
+	}
+
+	// Draws count instances from slot first on, num_indices indices from
+	// first_index on.
+	void draw_indices(GLuint first_index, GLsizei num_indices, size_t first, size_t count) {
+		glDrawElementsInstancedBaseVertexBaseInstance(
+			self.draw_mode,
+			num_indices,
+			self.arena->get_index_type(),
+			self.arena->index_offset(first_index),
+			static_cast<GLsizei>(count),
+			self.mesh.range.base_vertex,
+			base_instance() + (GLuint) first
+		);
+	}
+
+	// Draws count instances from slot first on, at level of detail lod.
+	void draw_slots(size_t first, size_t count, size_t lod = 0) {
+		const auto& level = self.mesh.lods[lod];
+		draw_indices(level.first_index, level.count, first, count);
+	}
+
+	// Whether any of cluster may show in frustum for the instance data:
+	// its bounding sphere is inside, and it does not face entirely away
+	// from the eye, tested in object space where the cone was made. Draws
+	// cull back faces, and a mirroring model turns those around.
+	static bool cluster_visible(
+		const InstanceData& data, const MeshClusters::Cluster& cluster, const Frustum& frustum
+	) {
+		const auto& rows = data.model;
+		glm::vec4 sphere_center = glm::vec4(glm::vec3(cluster.sphere), 1.f);
+		glm::vec3 center = glm::vec3(
+			glm::dot(rows[0], sphere_center), glm::dot(rows[1], sphere_center), glm::dot(rows[2], sphere_center)
+		);
+		glm::vec3 x = glm::vec3(rows[0].x, rows[1].x, rows[2].x);
+		glm::vec3 y = glm::vec3(rows[0].y, rows[1].y, rows[2].y);
+		glm::vec3 z = glm::vec3(rows[0].z, rows[1].z, rows[2].z);
+		float scale = std::sqrt(std::max({ glm::dot(x, x), glm::dot(y, y), glm::dot(z, z) }));
+		if (!frustum.intersects_sphere(center, cluster.sphere.w * scale)) { return false; }
+
+		glm::vec4 cone = cluster.cone;
+		if (cone.w >= 1.f) { return true; }
+		if (glm::dot(data.normal_0, glm::cross(data.normal_1, data.normal_2)) <= 0.f) { return true; }
+
+		// the normal matrix is the transposed inverse of the model's 3x3
+		glm::vec3 translation = glm::vec3(rows[0].w, rows[1].w, rows[2].w);
+		glm::vec3 eye = glm::vec3(frustum.eye) - translation * frustum.eye.w;
+		eye = glm::vec3(glm::dot(data.normal_0, eye), glm::dot(data.normal_1, eye), glm::dot(data.normal_2, eye));
+
+		glm::vec3 view = glm::vec3(cluster.sphere) * frustum.eye.w - eye;
+		return glm::dot(view, glm::vec3(cone)) < cone.w * glm::length(view) + cluster.sphere.w * frustum.eye.w;
+	}
+
+	// Draws slot's instance in full detail, one draw per run of visible
+	// consecutive clusters.
+	void draw_clusters(size_t slot, const Frustum& frustum) {
+		const auto& clusters = self.mesh.clusters;
+		const auto& data = self.instances[slot];
+		GLuint first_index = self.mesh.lods[0].first_index;
+		size_t c = 0;
+		while (c < clusters.size()) {
+			if (!cluster_visible(data, clusters[c], frustum)) {
+				c++;
+				continue;
+			}
+			size_t end = c + 1;
+			while (end < clusters.size() && cluster_visible(data, clusters[end], frustum)) { end++; }
+			GLuint first = clusters[c].first_index;
+			GLuint last = clusters[end - 1].first_index + clusters[end - 1].count;
+			draw_indices(first_index + first, (GLsizei) (last - first), slot, 1);
+			c = end + 1;
+		}
+	}
+
+	void initialize(GeometryArena* arena, GLenum draw_mode) {
+		if (draw_mode == GL_TRIANGLES) {
+			if (self.mesh.indices.size() / 3 >= MIN_CLUSTERED_TRIANGLES) {
+				// Clustering decides the triangle order across clusters, so
+				// the cache and overdraw order is made within each of them.
+				self.mesh.clusters = MeshClusters::Build(self.mesh.vertices, self.mesh.indices);
+				for (const auto& cluster : self.mesh.clusters) {
+					MeshOptimizer::OptimizeTriangles(
+						self.mesh.vertices, self.mesh.indices, cluster.first_index, cluster.count
+					);
+				}
+				MeshOptimizer::OptimizeVertices(self.mesh.vertices, self.mesh.indices);
+			} else {
+				MeshOptimizer::Optimize(self.mesh.vertices, self.mesh.indices);
+			}
+		}
 		self.indices = static_cast<GLsizei>(self.mesh.indices.size());
-		self.index_type = GL_UNSIGNED_INT;
+		self.arena = arena;
 		self.draw_mode = draw_mode;
-		setup_buffers();
+		compute_bounds();
+		setup_buffers(arena);
 	}
 
 public:
 	~InstantiableMesh() {
+		for (GLsync fence : self.fences) {
+			if (fence) { glDeleteSync(fence); }
+		}
+		if (self.mapped) { glUnmapNamedBuffer(self.vbo_instances); }
 		if (self.vbo_instances) { glDeleteBuffers(1, &self.vbo_instances); }
 	}
 	InstantiableMesh(const InstantiableMesh&) = delete;
@@ -321,72 +889,285 @@ public:
 	InstantiableMesh(InstantiableMesh&& other) = default;
 	InstantiableMesh& operator=(InstantiableMesh&& other) = default;
 
+	// The geometry only reaches the GPU with the arena's next commit().
 	static std::unique_ptr<InstantiableMesh> FromShape(
-		Shape_Creator shape_func, GLenum draw_mode = GL_TRIANGLES
+		GeometryArena* arena, Shape_Creator shape_func, GLenum draw_mode = GL_TRIANGLES,
+		InstanceStorage storage = InstanceStorage::Dynamic
 	) {
 		auto obj = std::unique_ptr<InstantiableMesh>(new InstantiableMesh());
 		auto& self = obj->self;
+		self.storage = storage;
 
 		shape_func(self.mesh.vertices, self.mesh.indices);
-		obj->initialize(draw_mode);
+		obj->initialize(arena, draw_mode);
 
 		return obj;
 	}
 
 	static std::unique_ptr<InstantiableMesh> FromFile(
-		std::string filename, 
-		GLenum draw_mode = GL_TRIANGLES
+		GeometryArena* arena, std::string filename,
+		GLenum draw_mode = GL_TRIANGLES,
+		InstanceStorage storage = InstanceStorage::Dynamic
 	) {
 		auto obj = std::unique_ptr<InstantiableMesh>(new InstantiableMesh());
 		auto& self = obj->self;
+		self.storage = storage;
 
 		std::string base_dir = "objs/" + filename + "/";
 		FileObj::Load(base_dir, filename, self.mesh.vertices, self.mesh.indices);
-		obj->initialize(draw_mode);
+		obj->initialize(arena, draw_mode);
 
 		return obj;
 	}
 
 	std::unique_ptr<Instance> instance() {
-		int64_t index;
-		if (!self.free_indices.empty()) {
-			auto it = self.free_indices.begin();
-			index = *it;
-			self.free_indices.erase(it);
-			self.instances[index] = InstanceData {};
+		int64_t handle;
+		if (!self.free_handles.empty()) {
+			handle = self.free_handles.back();
+			self.free_handles.pop_back();
 		} else {
-			self.instances.push_back(InstanceData {});
-			index = self.instances.size() - 1;
+			handle = self.slots.size();
+			self.slots.push_back(-1);
 		}
 
-		self.dirty_instances.insert(index);
-		auto instance = Instance::New(this, index);
+		int64_t slot = self.instances.size();
+		self.instances.push_back(InstanceData {});
+		if (slot % 4 == 0) { self.transforms.push_back(TransformBatch {}); }
+		store_frame(slot, glm::mat4(1.f));
+		store_size(slot, glm::vec3(1.f));
+		self.transforms[slot / 4].color[slot % 4] = 0xffffffff;
+		self.handles.push_back(handle);
+		self.slots[handle] = slot;
+
+		// composed like any update, which also puts it in the spatial index
+		self.pending.mark(slot);
+		auto instance = Instance::New(this, handle);
 
 		return instance;
 	}
 
-	void update_instance(int64_t index, glm::mat4& frame, glm::vec3& size, glm::vec4& color) {
-		if (index < 0 || index >= static_cast<int64_t>(self.instances.size())) {
-			return;
+	// Setters only store here; the instance data follows with the next
+	// compose_instances().
+	void set_frame(int64_t handle, const glm::mat4& frame) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
+
+		store_frame(slot, frame);
+		self.pending.mark(slot);
+	}
+
+	// frames[k] for handles[k], as one batch; handles of released
+	// instances are skipped.
+	void set_frames(const int64_t* handles, const glm::mat4* frames, size_t count) {
+		for (size_t k = 0; k < count; k++) {
+			int64_t slot = slot_of(handles[k]);
+			if (slot < 0) { continue; }
+
+			store_frame(slot, frames[k]);
+			self.pending.mark(slot);
 		}
+	}
 
-		glm::mat4 scale_matrix = glm::scale(glm::mat4(1.0f), size);
-		self.instances[index].model = frame * scale_matrix;
-		self.instances[index].color = color;
+	void set_size(int64_t handle, const glm::vec3& size) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
 
-		self.dirty_instances.insert(index);
+		store_size(slot, size);
+		self.pending.mark(slot);
 	}
 
-	void release_instance(int64_t index) {
-		if (index < 0 || index >= static_cast<int>(self.instances.size())) {
-			return;
+	void set_transform(int64_t handle, const glm::mat4& frame, const glm::vec3& size) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
+
+		store_frame(slot, frame);
+		store_size(slot, size);
+		self.pending.mark(slot);
+	}
+
+	void set_color(int64_t handle, const glm::vec4& color) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
+
+		self.transforms[slot / 4].color[slot % 4] = glm::packUnorm4x8(color);
+		self.pending.mark(slot);
+	}
+
+	// As last set, composed or not.
+	glm::mat4 get_frame(int64_t handle) const {
+		int64_t slot = slot_of(handle);
+		glm::mat4 frame = glm::mat4(1.f);
+		if (slot < 0) { return frame; }
+
+		const auto& batch = self.transforms[slot / 4];
+		size_t lane = slot % 4;
+		for (int c = 0; c < 3; c++) {
+			for (int r = 0; r < 3; r++) {
+				frame[c][r] = batch.basis[c * 3 + r][lane];
+			}
+			frame[3][c] = batch.translation[c][lane];
+		}
+		return frame;
+	}
+
+	glm::vec3 get_size(int64_t handle) const {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return glm::vec3(1.f); }
+
+		const auto& batch = self.transforms[slot / 4];
+		size_t lane = slot % 4;
+		return glm::vec3(batch.size[0][lane], batch.size[1][lane], batch.size[2][lane]);
+	}
+
+	// Composes the models and normal matrices of every instance updated
+	// since the last call, a batch of four slots at a time, and hands them
+	// on to the instance buffer and the spatial index. Draws do this
+	// themselves; call it before refitting the spatial index.
+	void compose_instances() {
+		if (self.pending.count == 0) { return; }
+
+		self.pending.for_each_range(self.instances.size(), [this](size_t first, size_t count) {
+			for (size_t batch = first / 4; batch * 4 < first + count; batch++) {
+				compose_batch(batch, first, first + count);
+			}
+		});
+		self.pending.clear();
+	}
+
+	// The last live instance moves into the released slot, so draws only
+	// ever cover live instances.
+	void release_instance(int64_t handle) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
+
+		int64_t last = self.instances.size() - 1;
+		if (slot != last) {
+			self.instances[slot] = self.instances[last];
+			copy_transform(slot, last);
+			self.handles[slot] = self.handles[last];
+			self.slots[self.handles[slot]] = slot;
+			self.pending.mark(slot);
+		}
+		self.instances.pop_back();
+		self.transforms.resize((self.instances.size() + 3) / 4);
+		self.handles.pop_back();
+
+		self.slots[handle] = -1;
+		self.free_handles.push_back(handle);
+		if (self.bvh) { self.bvh->remove(InstanceBvh::key(self.bvh_id, handle)); }
+	}
+
+	void set_baked_offset(int64_t handle, GLint offset) {
+		int64_t slot = slot_of(handle);
+		if (slot < 0) { return; }
+
+		// a pending move would drop the new offset
+		compose_instances();
+
+		self.instances[slot].baked_offset = offset;
+		mark_dirty(slot);
+	}
+
+	const Vertices& get_vertices() const {
+		return self.mesh.vertices;
+	}
+
+	const Indices& get_indices() const {
+		return self.mesh.indices;
+	}
+
+	GLsizei get_num_triangles() const {
+		return self.draw_mode == GL_TRIANGLES ? self.indices / 3 : 0;
+	}
+
+	size_t get_num_instances() const {
+		return self.instances.size();
+	}
+
+	const glm::vec4& get_bounds() const {
+		return self.bounds;
+	}
+
+	// Composed data of the instance behind handle, or null if it is gone.
+	const InstanceData* get_instance_data(int64_t handle) const {
+		int64_t slot = slot_of(handle);
+		return slot < 0 ? nullptr : &self.instances[slot];
+	}
+
+	// Projected radius of the instance behind handle, as levels of detail
+	// are picked by.
+	float get_projected_size(int64_t handle, const glm::mat4& view_projection) const {
+		int64_t slot = slot_of(handle);
+		return slot < 0 ? 0.f : projected_size(slot, view_projection);
+	}
+
+	// Keeps every live instance's world box in bvh from now on.
+	void set_spatial_index(InstanceBvh* bvh, uint32_t id) {
+		self.bvh = bvh;
+		self.bvh_id = id;
+		compose_instances();
+		for (size_t slot = 0; slot < self.instances.size(); slot++) {
+			update_spatial_index(self.handles[slot], self.instances[slot].get_model());
+		}
+	}
+
+	const GeometryArena::Range& get_range() const {
+		return self.mesh.range;
+	}
+
+	// The full mesh first, then ever coarser ones.
+	const std::vector<Lod>& get_lods() const {
+		return self.mesh.lods;
+	}
+
+	// Empty unless the mesh is split into clusters.
+	const std::vector<MeshClusters::Cluster>& get_clusters() const {
+		return self.mesh.clusters;
+	}
+
+	// Length of view_projection's y row: a sphere of radius r at clip w
+	// projects to r * LodScale / w, in perspective and orthographic views.
+	static float LodScale(const glm::mat4& view_projection) {
+		return glm::length(glm::vec3(view_projection[0][1], view_projection[1][1], view_projection[2][1]));
+	}
+
+	// Level of detail for a projected radius of size, bias levels coarser.
+	static int SelectLod(float size, int bias, int num_lods) {
+		int lod = bias;
+		if (size < LOD_BASE_SIZE) {
+			lod += (int) std::log2(LOD_BASE_SIZE / std::max(size, 1e-6f));
 		}
+		return std::clamp(lod, 0, num_lods - 1);
+	}
 
-		self.instances[index].model = glm::scale(glm::mat4(1.0f), glm::vec3(0.0f));
-		self.instances[index].color.w = 0.0f;
+	// Flushes pending instance updates, then copies the instance buffer into
+	// buffer at offset bytes, entirely on the GPU.
+	void copy_instances_to(GLuint buffer, GLintptr offset) {
+		if (self.instances.empty()) { return; }
 
-		self.dirty_instances.insert(index);
-		self.free_indices.insert(index);
+		prepare_instance_vbo();
+		glCopyNamedBufferSubData(
+			self.vbo_instances, buffer, base_instance() * sizeof(InstanceData), offset,
+			self.instances.size() * sizeof(InstanceData)
+		);
+	}
+
+	// Persistent storage only: fences the segment the last frame drew from
+	// and moves on to the oldest one, which gets the changes it missed once
+	// the GPU is done reading it.
+	void begin_frame() {
+		if (self.storage != InstanceStorage::Persistent || !self.mapped) { return; }
+
+		self.fences[self.segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		self.segment = (self.segment + 1) % RING_SEGMENTS;
+		wait_fence(self.fences[self.segment]);
+
+		auto& dirty = self.segment_dirty[self.segment];
+		InstanceData* segment = self.mapped + self.segment * self.vbo_capacity;
+		dirty.for_each_range(self.instances.size(), [&](size_t first, size_t count) {
+			std::copy_n(&self.instances[first], count, segment + first);
+		});
+		dirty.clear();
 	}
 
 	void draw() {
@@ -394,24 +1175,85 @@ public:
 
 		prepare_instance_vbo();
 		glBindVertexArray(self.mesh.vao);
-		glDrawElementsInstanced(
-			self.draw_mode,
-			self.indices,
-			self.index_type,
-			(void*) 0,
-			static_cast<GLsizei>(self.instances.size())
-		);
+		draw_slots(0, self.instances.size());
+		glBindVertexArray(0);
+	}
+
+	// Draws only the instances behind handles, each at the level of detail
+	// its size in view_projection calls for, bias levels coarser: one draw
+	// per run of consecutive slots at the same level, or per run of visible
+	// clusters for a clustered mesh in full detail. Leaves the slots in
+	// handles, sorted by level and then slot, the level in the top bits.
+	void draw_handles(std::vector<int64_t>& handles, const glm::mat4& view_projection, int lod_bias = 0) {
+		if (self.mesh.vertices.empty() || self.mesh.indices.empty() || handles.empty()) { return; }
+
+		prepare_instance_vbo();
+		int num_lods = (int) self.mesh.lods.size();
+		for (auto& handle : handles) {
+			int64_t slot = slot_of(handle);
+			if (slot < 0 || num_lods == 1) {
+				handle = slot;
+				continue;
+			}
+			int lod = SelectLod(projected_size(slot, view_projection), lod_bias, num_lods);
+			handle = ((int64_t) lod << LOD_SHIFT) | slot;
+		}
+		handles.erase(std::remove(handles.begin(), handles.end(), -1), handles.end());
+		std::sort(handles.begin(), handles.end());
+
+		bool clustered = !self.mesh.clusters.empty();
+		Frustum frustum = clustered ? Frustum::FromMatrix(view_projection) : Frustum {};
+		glBindVertexArray(self.mesh.vao);
+		size_t i = 0;
+		while (i < handles.size()) {
+			size_t j = i + 1;
+			while (j < handles.size() && handles[j] == handles[j - 1] + 1) { j++; }
+			size_t lod = handles[i] >> LOD_SHIFT;
+			if (clustered && lod == 0) {
+				for (size_t k = i; k < j; k++) {
+					draw_clusters(handles[k] & SLOT_MASK, frustum);
+				}
+			} else {
+				draw_slots(handles[i] & SLOT_MASK, j - i, lod);
+			}
+			i = j;
+		}
 		glBindVertexArray(0);
 	}
 };
 
-void Instance::update_object() {
-	self.object->update_instance(self.index, self.frame, self.size, self.rgba);
+glm::vec3 Instance::get_size() const {
+	return self.object->get_size(self.handle);
+}
+
+void Instance::set_size(glm::vec3 size) {
+	self.object->set_size(self.handle, glm::max(size, 0.f));
+}
+
+glm::mat4 Instance::get_frame() const {
+	return self.object->get_frame(self.handle);
+}
+
+void Instance::set_frame(glm::mat4 frame) {
+	self.object->set_frame(self.handle, frame);
+}
+
+void Instance::set_transform(glm::mat4 frame, glm::vec3 size) {
+	self.object->set_transform(self.handle, frame, glm::max(size, 0.f));
+}
+
+void Instance::set_color(glm::vec4 rgba) {
+	self.rgba = glm::clamp(rgba, 0.f, 1.f);
+	self.object->set_color(self.handle, self.rgba);
+}
+
+void Instance::set_baked_offset(GLint offset) {
+	self.object->set_baked_offset(self.handle, offset);
 }
 
 Instance::~Instance() {
-	if (self.object && self.index != -1) {
-		self.object->release_instance(self.index);
+	if (self.object && self.handle != -1) {
+		self.object->release_instance(self.handle);
 	}
 }
 
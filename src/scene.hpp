@@ -2,13 +2,27 @@
 
 #include "camera.hpp"
 #include "shader_program.hpp"
+#include "frame_uniforms.hpp"
 #include "movement.hpp"
 #include "light_manager.hpp"
 #include "game_map.hpp"
+#include "visibility_buffer.hpp"
+#include "frame_stats.hpp"
+
+enum class RenderMode {
+	Forward,
+	VisibilityBuffer,
+};
 
 class Scene {
 public:
 	using RenderFunction = std::function<void(ShaderProgram*)>;
+
+	static constexpr float FOV = 90.f;
+	static constexpr float NEAR_PLANE = 0.01f;
+	static constexpr float FAR_PLANE = 5000.f;
+	// shadow maps get by with coarser levels of detail than the view
+	static constexpr int SHADOW_LOD_BIAS = 1;
 private:
 	struct Self {
 		WindowManager* wm;
@@ -20,10 +34,42 @@ private:
 		std::unique_ptr<ShaderProgram> program;
 		std::unique_ptr<ShaderProgram> shadow_program;
 		std::unique_ptr<LightManager> light_manager;
+		std::unique_ptr<VisibilityBuffer> visibility_buffer;
+
+		std::unique_ptr<FrameStats> frame_stats;
+		std::unique_ptr<FrameUniforms> frame_uniforms;
+		double time = 0.0;
+
+		RenderMode render_mode = RenderMode::Forward;
+		bool depth_prepass = false;
 	} self;
 
 	Scene() = default;
 
+	void render_forward(
+		LightManager::RenderFunction render_function,
+		const glm::mat4& view_projection, glm::ivec2 res, const GLfloat* bgd
+	) {
+		auto& light_manager = self.light_manager;
+		auto& frame_stats = self.frame_stats;
+		using Pass = FrameStats::Pass;
+
+		frame_stats->begin_frame(self.depth_prepass);
+		if (self.depth_prepass) {
+			frame_stats->begin_pass(Pass::DepthPrepass);
+			light_manager->render_depth_prepass(
+				render_function, view_projection, res.x, res.y
+			);
+			frame_stats->end_pass(Pass::DepthPrepass, res);
+		}
+
+		frame_stats->begin_pass(Pass::Shading);
+		light_manager->render_with_shadows(
+			render_function, view_projection, res.x, res.y, bgd, self.depth_prepass
+		);
+		frame_stats->end_pass(Pass::Shading, res);
+	}
+
 public:
 	Scene(const Scene&) = delete;
 	Scene& operator=(const Scene&) = delete;
@@ -56,6 +102,12 @@ public:
 		auto& light_manager = light_manager_opt.value();
 
 		auto game_map = GameMap::New(camera.get(), light_manager.get(), movement.get());
+
+		auto visibility_buffer_opt = VisibilityBuffer::New(
+			game_map->get_meshes(), game_map->get_arena()
+		);
+		if (!visibility_buffer_opt.has_value()) { return std::nullopt; }
+		auto& visibility_buffer = visibility_buffer_opt.value();
 		
 		auto scene = std::unique_ptr<Scene>(new Scene());
 		auto& self = scene->self;
@@ -70,6 +122,10 @@ public:
 		self.program = std::move(program);
 		self.shadow_program = std::move(shadow_program);
 		self.light_manager = std::move(light_manager);
+		self.visibility_buffer = std::move(visibility_buffer);
+		self.frame_stats = FrameStats::New();
+		self.frame_uniforms = FrameUniforms::New();
+		FrameUniforms::check(self.program.get());
 
 		glEnable(GL_DEPTH_TEST);
 		glEnable(GL_CULL_FACE);
@@ -82,13 +138,16 @@ public:
 		return scene;
 	}
 
+	bool bake_lighting() const {
+		return self.game_map->bake_lighting();
+	}
+
 	void render(double dt) {
 		auto& wm = self.wm;
 		auto& input = self.input;
 		auto& camera = self.camera;
 		auto& movement = self.movement;
 		auto& game_map = self.game_map;
-		auto& program = self.program;
 		auto& shadow_program = self.shadow_program;
 		auto& light_manager = self.light_manager;
 
@@ -99,6 +158,23 @@ public:
 			input->set_mouse_locked(!input->get_mouse_locked());
 		}
 
+		if (movement->get_change_render_mode()) {
+			movement->set_change_render_mode(false);
+			self.render_mode = self.render_mode == RenderMode::Forward
+				? RenderMode::VisibilityBuffer
+				: RenderMode::Forward;
+		}
+
+		if (movement->get_change_depth_prepass()) {
+			movement->set_change_depth_prepass(false);
+			self.depth_prepass = !self.depth_prepass;
+		}
+
+		if (movement->get_change_culling()) {
+			movement->set_change_culling(false);
+			game_map->set_cpu_culling(!game_map->get_cpu_culling());
+		}
+
 		glm::dvec2 delta = input->get_mouse_delta();
 		camera->process_mouse_movement(delta);
 		camera->process_movement_input(movement->get_movement_vec());
@@ -106,22 +182,37 @@ public:
 		camera->process_vertical_input(movement->get_y_axis_vec().x);
 		camera->update(dt);
 
-		program->use();
-		program->uniform(program->location("cam_pos"), camera->get_position());
-		program->uniform(program->location("view"), camera->get_view());
-
 		const float aspect = wm->get_aspect_ratio();
-		glm::mat4 projection = glm::perspective(glm::radians(90.f), aspect, 0.01f, 5000.f);
-		program->uniform(program->location("projection"), projection);
+		glm::mat4 projection = glm::perspective(
+			glm::radians(FOV), aspect, NEAR_PLANE, FAR_PLANE
+		);
+		self.time += dt;
+		self.frame_uniforms->update(
+			camera->get_view(), projection, camera->get_position(), (float) self.time
+		);
+		const glm::mat4& view_projection = self.frame_uniforms->get_data().view_projection;
 
 		self.game_map->update(dt);
+		light_manager->update(view_projection, camera->get_position());
+
+		light_manager->update_clusters(
+			camera->get_view(), projection, NEAR_PLANE, FAR_PLANE, res
+		);
 
-		auto render_function = [this]() {
-			self.game_map->draw();
+		auto render_function = [this](const glm::mat4& pass_view_projection) {
+			self.game_map->draw(pass_view_projection, 0, true);
+		};
+		auto shadow_render_function = [this](const glm::mat4& pass_view_projection) {
+			self.game_map->draw(pass_view_projection, SHADOW_LOD_BIAS);
 		};
 
-		light_manager->generate_depth_maps(render_function);
+		light_manager->generate_depth_maps(shadow_render_function);
 		static const GLfloat bgd[] = { .6745f, .9098f, .9804f, 1.f };
-		light_manager->render_with_shadows(render_function, res.x, res.y, bgd);
+		if (self.render_mode == RenderMode::VisibilityBuffer) {
+			self.visibility_buffer->render(light_manager.get(), res, bgd);
+		} else {
+			game_map->build_occlusion(view_projection, res);
+			render_forward(render_function, view_projection, res, bgd);
+		}
 	}
 };
\ No newline at end of file
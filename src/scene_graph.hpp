@@ -0,0 +1,292 @@
+#pragma once
+
+#include "object.hpp"
+#include "worker_pool.hpp"
+
+// Parent/child transforms for composite objects. Each node has a local
+// transform relative to its parent, and its world transform is the frame of
+// the instance attached to it, if any.
+//
+// Nodes are kept breadth first, one level after another, in parallel
+// arrays, so a level only reads worlds of the level above it. update()
+// sweeps the levels from the shallowest changed node down, recomputing
+// only nodes under a changed one, large levels split over threads, and
+// hands the new frames to each mesh in one batch: moving a whole assembly
+// is one set_local and one update().
+class SceneGraph {
+public:
+	using Node = int32_t;
+	static constexpr Node NONE = -1;
+	// Levels with fewer nodes than this are not worth waking threads for,
+	// and the threads take this many nodes at a time.
+	static constexpr int32_t PARALLEL_NODES = 4096;
+
+private:
+	// Frames for one mesh's instances, gathered by update().
+	struct Batch {
+		InstantiableMesh* mesh = nullptr;
+		std::vector<int64_t> handles;
+		std::vector<glm::mat4> frames;
+	};
+
+	struct Self {
+		// by index, breadth first once sorted
+		std::vector<glm::mat4> local;
+		std::vector<glm::mat4> world;
+		std::vector<int32_t> parent;
+		std::vector<uint8_t> dirty;
+		// the attached instance's handle and its mesh's batch, or -1
+		std::vector<int64_t> handles;
+		std::vector<int32_t> batch;
+		std::vector<Node> nodes;
+		std::vector<int32_t> depth;
+
+		// -1 once removed
+		std::vector<int32_t> index_of;
+		// first index of every level, and one past the last
+		std::vector<int32_t> levels;
+		bool sorted = true;
+		int32_t min_dirty_depth = std::numeric_limits<int32_t>::max();
+
+		std::vector<Batch> batches;
+		std::unordered_map<InstantiableMesh*, int32_t> batch_of;
+		std::unique_ptr<WorkerPool> workers;
+	} self;
+
+	SceneGraph() = default;
+
+	// -1 for nodes that are removed or were never added.
+	int32_t find(Node node) const {
+		if (node < 0 || node >= (Node) self.index_of.size()) { return -1; }
+		return self.index_of[node];
+	}
+
+	// out = a * b, column by column.
+	static void multiply(const glm::mat4& a, const glm::mat4& b, glm::mat4& out) {
+#ifdef RENDERER_SSE
+		const float* pa = glm::value_ptr(a);
+		__m128 a0 = _mm_loadu_ps(pa + 0);
+		__m128 a1 = _mm_loadu_ps(pa + 4);
+		__m128 a2 = _mm_loadu_ps(pa + 8);
+		__m128 a3 = _mm_loadu_ps(pa + 12);
+		for (int c = 0; c < 4; c++) {
+			const float* pb = glm::value_ptr(b[c]);
+			__m128 column = _mm_add_ps(
+				_mm_add_ps(_mm_mul_ps(a0, _mm_set1_ps(pb[0])), _mm_mul_ps(a1, _mm_set1_ps(pb[1]))),
+				_mm_add_ps(_mm_mul_ps(a2, _mm_set1_ps(pb[2])), _mm_mul_ps(a3, _mm_set1_ps(pb[3])))
+			);
+			_mm_storeu_ps(glm::value_ptr(out[c]), column);
+		}
+#else
+		out = a * b;
+#endif
+	}
+
+	// Nodes [first, end) of one level: a node is recomputed if it or its
+	// parent changed.
+	void update_nodes(int32_t first, int32_t end) {
+		for (int32_t i = first; i < end; i++) {
+			int32_t parent = self.parent[i];
+			if (parent >= 0 && self.dirty[parent]) { self.dirty[i] = 1; }
+			if (!self.dirty[i]) { continue; }
+
+			if (parent >= 0) {
+				multiply(self.world[parent], self.local[i], self.world[i]);
+			} else {
+				self.world[i] = self.local[i];
+			}
+		}
+	}
+
+	void mark(int32_t index) {
+		self.dirty[index] = 1;
+		self.min_dirty_depth = std::min(self.min_dirty_depth, self.depth[index]);
+	}
+
+	// Keeps the nodes at order's indices, in that order.
+	void reorder(const std::vector<int32_t>& order) {
+		size_t count = order.size();
+		auto permute = [&order, count](auto& values) {
+			std::remove_reference_t<decltype(values)> kept(count);
+			for (size_t i = 0; i < count; i++) {
+				kept[i] = values[order[i]];
+			}
+			values = std::move(kept);
+		};
+		std::vector<int32_t> new_index(self.nodes.size(), -1);
+		for (size_t i = 0; i < count; i++) {
+			new_index[order[i]] = (int32_t) i;
+		}
+
+		permute(self.local);
+		permute(self.world);
+		permute(self.parent);
+		permute(self.dirty);
+		permute(self.handles);
+		permute(self.batch);
+		permute(self.nodes);
+		permute(self.depth);
+		for (auto& parent : self.parent) {
+			if (parent >= 0) { parent = new_index[parent]; }
+		}
+		for (auto& index : self.index_of) {
+			if (index >= 0) { index = new_index[index]; }
+		}
+	}
+
+	// Nodes are appended as they come, parents always before children;
+	// sorting by depth restores the levels.
+	void sort() {
+		size_t count = self.nodes.size();
+		std::vector<int32_t> order(count);
+		for (size_t i = 0; i < count; i++) {
+			order[i] = (int32_t) i;
+		}
+		std::stable_sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+			return self.depth[a] < self.depth[b];
+		});
+		reorder(order);
+
+		self.levels.clear();
+		for (size_t i = 0; i < count; i++) {
+			while ((int32_t) self.levels.size() <= self.depth[i]) {
+				self.levels.push_back((int32_t) i);
+			}
+		}
+		self.levels.push_back((int32_t) count);
+		self.sorted = true;
+	}
+
+public:
+	SceneGraph(const SceneGraph&) = delete;
+	SceneGraph& operator=(const SceneGraph&) = delete;
+	SceneGraph(SceneGraph&& other) = delete;
+	SceneGraph& operator=(SceneGraph&& other) = delete;
+
+	static std::unique_ptr<SceneGraph> New() {
+		auto graph = std::unique_ptr<SceneGraph>(new SceneGraph());
+		graph->self.workers = WorkerPool::New(std::thread::hardware_concurrency());
+		return graph;
+	}
+
+	// instance, if given, takes the node's world transform as its frame
+	// from the next update() on; remove() the node before destroying it.
+	// Returns NONE if parent is removed.
+	Node add(Node parent, const glm::mat4& local, Instance* instance = nullptr) {
+		int32_t parent_index = parent == NONE ? -1 : find(parent);
+		if (parent != NONE && parent_index < 0) {
+			std::cerr << "Scene graph node " << parent << " is removed, cannot add a child to it.\n";
+			return NONE;
+		}
+		Node node = (Node) self.index_of.size();
+		int32_t index = (int32_t) self.nodes.size();
+
+		int32_t batch = -1;
+		if (instance) {
+			auto [it, inserted] = self.batch_of.try_emplace(instance->get_object(), (int32_t) self.batches.size());
+			if (inserted) { self.batches.push_back(Batch { instance->get_object() }); }
+			batch = it->second;
+		}
+
+		self.index_of.push_back(index);
+		self.nodes.push_back(node);
+		self.local.push_back(local);
+		self.world.push_back(local);
+		self.parent.push_back(parent_index);
+		self.dirty.push_back(0);
+		self.handles.push_back(instance ? instance->get_handle() : -1);
+		self.batch.push_back(batch);
+		self.depth.push_back(parent_index < 0 ? 0 : self.depth[parent_index] + 1);
+		self.sorted = false;
+
+		mark(index);
+		return node;
+	}
+
+	// Removes node and every node under it. Their instances keep the
+	// frames they have.
+	void remove(Node node) {
+		int32_t index = find(node);
+		if (index < 0) { return; }
+
+		// children always come after their parents
+		std::vector<uint8_t> removed(self.nodes.size(), 0);
+		removed[index] = 1;
+		for (size_t i = index + 1; i < self.nodes.size(); i++) {
+			if (self.parent[i] >= 0 && removed[self.parent[i]]) { removed[i] = 1; }
+		}
+
+		std::vector<int32_t> kept;
+		kept.reserve(self.nodes.size());
+		for (size_t i = 0; i < self.nodes.size(); i++) {
+			if (removed[i]) {
+				self.index_of[self.nodes[i]] = -1;
+			} else {
+				kept.push_back((int32_t) i);
+			}
+		}
+		reorder(kept);
+		self.sorted = false;
+	}
+
+	// Removed nodes are ignored.
+	void set_local(Node node, const glm::mat4& local) {
+		int32_t index = find(node);
+		if (index < 0) { return; }
+
+		self.local[index] = local;
+		mark(index);
+	}
+
+	// Identity for removed nodes.
+	glm::mat4 get_local(Node node) const {
+		int32_t index = find(node);
+		return index < 0 ? glm::mat4(1.f) : self.local[index];
+	}
+
+	// As of the last update(); identity for removed nodes.
+	glm::mat4 get_world(Node node) const {
+		int32_t index = find(node);
+		return index < 0 ? glm::mat4(1.f) : self.world[index];
+	}
+
+	void update() {
+		if (self.min_dirty_depth == std::numeric_limits<int32_t>::max()) { return; }
+		if (!self.sorted) { sort(); }
+
+		int32_t levels = (int32_t) self.levels.size() - 1;
+		for (int32_t d = self.min_dirty_depth; d < levels; d++) {
+			int32_t first = self.levels[d];
+			int32_t end = self.levels[d + 1];
+			if (end - first < PARALLEL_NODES) {
+				update_nodes(first, end);
+				continue;
+			}
+			size_t chunks = (size_t) (end - first + PARALLEL_NODES - 1) / PARALLEL_NODES;
+			self.workers->run(chunks, [this, first, end](size_t chunk) {
+				int32_t chunk_first = first + (int32_t) chunk * PARALLEL_NODES;
+				update_nodes(chunk_first, std::min(chunk_first + PARALLEL_NODES, end));
+			});
+		}
+
+		for (auto& batch : self.batches) {
+			batch.handles.clear();
+			batch.frames.clear();
+		}
+		int32_t first = self.min_dirty_depth < levels ? self.levels[self.min_dirty_depth] : 0;
+		for (size_t i = first; i < self.nodes.size(); i++) {
+			if (!self.dirty[i]) { continue; }
+			self.dirty[i] = 0;
+			if (self.batch[i] < 0) { continue; }
+
+			auto& batch = self.batches[self.batch[i]];
+			batch.handles.push_back(self.handles[i]);
+			batch.frames.push_back(self.world[i]);
+		}
+		for (auto& batch : self.batches) {
+			if (batch.handles.empty()) { continue; }
+			batch.mesh->set_frames(batch.handles.data(), batch.frames.data(), batch.handles.size());
+		}
+		self.min_dirty_depth = std::numeric_limits<int32_t>::max();
+	}
+};
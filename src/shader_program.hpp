@@ -3,11 +3,37 @@
 #include "file.hpp"
 
 class ShaderProgram {
+public:
+	using Defines = std::vector<std::pair<std::string, std::string>>;
+
+	static constexpr int MAX_INCLUDE_DEPTH = 8;
+	static constexpr const char* CACHE_DIR = "shader_cache";
+
+	static constexpr uint64_t hash(std::string_view name) {
+		uint64_t h = 14695981039346656037ull;
+		for (char c : name) {
+			h = (h ^ (unsigned char) c) * 1099511628211ull;
+		}
+		return h;
+	}
+
+	// Name of a uniform or block, hashed where it is declared so lookups
+	// never touch a string.
+	struct Uniform {
+		uint64_t hash;
+
+		constexpr explicit Uniform(std::string_view name) : hash(ShaderProgram::hash(name)) {}
+	};
 private:
 	struct Self {
 		GLuint pid = 0;
 		GLuint vertex = 0;
 		GLuint fragment = 0;
+		GLuint compute = 0;
+
+		// active uniforms and blocks by name hash, filled once after linking
+		std::unordered_map<uint64_t, GLint> locations;
+		std::unordered_map<uint64_t, GLint> block_bindings;
 	} self;
 	ShaderProgram() = default;
 
@@ -36,10 +62,67 @@ private:
 		return success;
 	}
 
-	static GLuint compile(const std::string& filename, GLenum shader_type, GLuint pid) {
-		auto shader_source_opt = read_file(filename);
-		if (!shader_source_opt.has_value()) { return 0; }
-		const char* shader_source = shader_source_opt.value().c_str();
+	// Expands `#include "file"` lines, resolved relative to the including
+	// file, so stages can share GLSL code.
+	static std::optional<std::string> load_source(const std::string& filename, int depth = 0) {
+		if (depth > MAX_INCLUDE_DEPTH) {
+			std::cerr << "Include depth exceeded while loading: " << filename << "\n";
+			return std::nullopt;
+		}
+
+		auto source_opt = read_file(filename);
+		if (!source_opt.has_value()) { return std::nullopt; }
+
+		std::filesystem::path dir = std::filesystem::path(filename).parent_path();
+		std::istringstream lines(source_opt.value());
+		std::string source;
+		std::string line;
+		while (std::getline(lines, line)) {
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string::npos || line.compare(start, 8, "#include") != 0) {
+				source += line + "\n";
+				continue;
+			}
+
+			size_t open = line.find('"', start);
+			size_t close = line.find('"', open + 1);
+			if (open == std::string::npos || close == std::string::npos) {
+				std::cerr << "Malformed include in " << filename << ": " << line << "\n";
+				return std::nullopt;
+			}
+
+			std::string include = (dir / line.substr(open + 1, close - open - 1)).string();
+			auto included_opt = load_source(include, depth + 1);
+			if (!included_opt.has_value()) { return std::nullopt; }
+			source += included_opt.value();
+		}
+		return source;
+	}
+
+	// Inserts the defines right after the #version line, which must stay
+	// first in the source.
+	static std::string apply_defines(const std::string& source, const Defines& defines) {
+		if (defines.empty()) { return source; }
+
+		std::string block;
+		for (const auto& [name, value] : defines) {
+			block += "#define " + name + " " + value + "\n";
+		}
+
+		size_t version = source.find("#version");
+		size_t insert_at = 0;
+		if (version != std::string::npos) {
+			size_t line_end = source.find('\n', version);
+			insert_at = line_end == std::string::npos ? source.size() : line_end + 1;
+		}
+		return source.substr(0, insert_at) + block + source.substr(insert_at);
+	}
+
+	static GLuint compile(
+		const std::string& filename, const std::string& source,
+		GLenum shader_type, GLuint pid
+	) {
+		const char* shader_source = source.c_str();
 
 		GLuint sid = glCreateShader(shader_type);
 		if (!sid) { return 0; }
@@ -49,6 +132,7 @@ private:
 
 		GLint success = gl_log(sid, true);
 		if (!success) { 
+			std::cout << "Compile error happened in shader: " << filename << "\n";
 			glDeleteShader(sid);
 			return 0; 
 		}
@@ -58,6 +142,122 @@ private:
 		return sid;
 	}
 
+	// Program binaries are keyed by the final sources and the driver, so a
+	// stale or foreign binary is never even offered to glProgramBinary.
+	static std::filesystem::path binary_path(
+		const std::string& vertex_source, const std::string& fragment_source
+	) {
+		const char* renderer = (const char*) glGetString(GL_RENDERER);
+		const char* version = (const char*) glGetString(GL_VERSION);
+
+		uint64_t hash = 14695981039346656037ull;
+		auto mix = [&hash](const std::string& data) {
+			for (unsigned char c : data) {
+				hash = (hash ^ c) * 1099511628211ull;
+			}
+			hash = (hash ^ 0xff) * 1099511628211ull;
+		};
+		mix(vertex_source);
+		mix(fragment_source);
+		mix(renderer ? renderer : "");
+		mix(version ? version : "");
+
+		std::ostringstream name;
+		name << std::hex << hash << ".bin";
+		return get_executable_dir() / CACHE_DIR / name.str();
+	}
+
+	static bool binaries_supported() {
+		GLint formats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		return formats > 0;
+	}
+
+	static bool load_binary(GLuint pid, const std::filesystem::path& path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) { return false; }
+
+		GLenum format = 0;
+		file.read(reinterpret_cast<char*>(&format), sizeof(format));
+		std::vector<char> binary(
+			(std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>()
+		);
+		if (!file.eof() || binary.empty()) { return false; }
+
+		glProgramBinary(pid, format, binary.data(), (GLsizei) binary.size());
+		GLint success = 0;
+		glGetProgramiv(pid, GL_LINK_STATUS, &success);
+		return success;
+	}
+
+	static void save_binary(GLuint pid, const std::filesystem::path& path) {
+		GLint length = 0;
+		glGetProgramiv(pid, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (length <= 0) { return; }
+
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(pid, length, nullptr, &format, binary.data());
+
+		std::error_code error;
+		std::filesystem::create_directories(path.parent_path(), error);
+		std::ofstream file(path, std::ios::binary);
+		if (error || !file.is_open()) {
+			std::cerr << "Could not write shader cache: " << path << "\n";
+			return;
+		}
+		file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+		file.write(binary.data(), binary.size());
+	}
+
+	// Every element of an array of basic types gets its own entry, so
+	// "a", "a[0]" and "a[3]" all resolve without a driver query.
+	void reflect() {
+		GLuint pid = self.pid;
+		GLint count = 0;
+		GLint max_length = 0;
+		glGetProgramInterfaceiv(pid, GL_UNIFORM, GL_ACTIVE_RESOURCES, &count);
+		glGetProgramInterfaceiv(pid, GL_UNIFORM, GL_MAX_NAME_LENGTH, &max_length);
+		std::vector<char> name(std::max(max_length, 1));
+
+		const GLenum props[] = { GL_LOCATION, GL_ARRAY_SIZE };
+		for (GLint i = 0; i < count; i++) {
+			GLint values[2] = { -1, 0 };
+			glGetProgramResourceiv(pid, GL_UNIFORM, i, 2, props, 2, nullptr, values);
+			if (values[0] == -1) { continue; } // block member
+
+			glGetProgramResourceName(pid, GL_UNIFORM, i, (GLsizei) name.size(), nullptr, name.data());
+			std::string_view full = name.data();
+			size_t suffix = full.size() >= 3 ? full.size() - 3 : 0;
+			if (full.compare(suffix, 3, "[0]") != 0) {
+				self.locations[hash(full)] = values[0];
+				continue;
+			}
+
+			std::string base = std::string(full.substr(0, suffix));
+			self.locations[hash(base)] = values[0];
+			for (GLint k = 0; k < values[1]; k++) {
+				std::string element = base + "[" + std::to_string(k) + "]";
+				self.locations[hash(element)] =
+					glGetProgramResourceLocation(pid, GL_UNIFORM, element.c_str());
+			}
+		}
+
+		for (GLenum block_interface : { GL_UNIFORM_BLOCK, GL_SHADER_STORAGE_BLOCK }) {
+			glGetProgramInterfaceiv(pid, block_interface, GL_ACTIVE_RESOURCES, &count);
+			glGetProgramInterfaceiv(pid, block_interface, GL_MAX_NAME_LENGTH, &max_length);
+			name.resize(std::max(max_length, 1));
+
+			const GLenum binding_prop = GL_BUFFER_BINDING;
+			for (GLint i = 0; i < count; i++) {
+				GLint binding = -1;
+				glGetProgramResourceiv(pid, block_interface, i, 1, &binding_prop, 1, nullptr, &binding);
+				glGetProgramResourceName(pid, block_interface, i, (GLsizei) name.size(), nullptr, name.data());
+				self.block_bindings[hash(name.data())] = binding;
+			}
+		}
+	}
+
 	static void detach_and_delete_shaders(Self& self) {
 		if (self.pid == 0) { return; }
 		if (self.vertex) {
@@ -70,6 +270,30 @@ private:
 			glDeleteShader(self.fragment);
 			self.fragment = 0;
 		}
+		if (self.compute) {
+			glDetachShader(self.pid, self.compute);
+			glDeleteShader(self.compute);
+			self.compute = 0;
+		}
+	}
+
+	// Links the attached stages, then caches the binary and reflects.
+	bool link(bool use_binaries, const std::filesystem::path& cached) {
+		if (use_binaries) {
+			glProgramParameteri(self.pid, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+		}
+		glLinkProgram(self.pid);
+		if (!gl_log(self.pid, false)) {
+			std::cout << "Linking error occurred. (pid = " << self.pid <<")\n";
+			return false;
+		}
+
+		detach_and_delete_shaders(self);
+		if (use_binaries) {
+			save_binary(self.pid, cached);
+		}
+		reflect();
+		return true;
 	}
 
 
@@ -86,8 +310,16 @@ public:
 	ShaderProgram& operator=(ShaderProgram&& other) = delete;
 
 	static std::optional<std::unique_ptr<ShaderProgram>> 
-	New(std::string vertex_file, std::string fragment_file) 
+	New(std::string vertex_file, std::string fragment_file, const Defines& defines = {}) 
 	{
+		auto vertex_source_opt = load_source(vertex_file);
+		auto fragment_source_opt = load_source(fragment_file);
+		if (!vertex_source_opt.has_value() || !fragment_source_opt.has_value()) {
+			return std::nullopt;
+		}
+		std::string vertex_source = apply_defines(vertex_source_opt.value(), defines);
+		std::string fragment_source = apply_defines(fragment_source_opt.value(), defines);
+
 		auto shader = std::unique_ptr<ShaderProgram>(new ShaderProgram());
 		auto& self = shader->self;
 
@@ -97,18 +329,22 @@ public:
 			return std::nullopt;
 		}
 
-		self.vertex = compile(vertex_file, GL_VERTEX_SHADER, self.pid);
-		self.fragment = compile(fragment_file, GL_FRAGMENT_SHADER, self.pid);
+		bool use_binaries = binaries_supported();
+		std::filesystem::path cached = binary_path(vertex_source, fragment_source);
+		if (use_binaries && load_binary(self.pid, cached)) {
+			shader->reflect();
+			return shader;
+		}
+
+		self.vertex = compile(vertex_file, vertex_source, GL_VERTEX_SHADER, self.pid);
+		self.fragment = compile(fragment_file, fragment_source, GL_FRAGMENT_SHADER, self.pid);
 
 		if (!(self.vertex && self.fragment)) {
 			detach_and_delete_shaders(self);
 			return std::nullopt;
 		}
 
-		glLinkProgram(self.pid);
-		GLint success = gl_log(self.pid, false);
-		if (!success) {
-			std::cout << "Linking error occurred. (pid = " << self.pid <<")\n";
+		if (!shader->link(use_binaries, cached)) {
 			std::cout << "Error happened with input shaders:"
 				<< "\n\t  Vertex: " << vertex_file
 				<< "\n\tFragment: " << fragment_file
@@ -116,7 +352,43 @@ public:
 			return std::nullopt;
 		}
 
-		detach_and_delete_shaders(self);
+		return shader;
+	}
+
+	static std::optional<std::unique_ptr<ShaderProgram>>
+	NewCompute(std::string compute_file, const Defines& defines = {})
+	{
+		auto compute_source_opt = load_source(compute_file);
+		if (!compute_source_opt.has_value()) { return std::nullopt; }
+		std::string compute_source = apply_defines(compute_source_opt.value(), defines);
+
+		auto shader = std::unique_ptr<ShaderProgram>(new ShaderProgram());
+		auto& self = shader->self;
+
+		self.pid = glCreateProgram();
+		if (!self.pid) {
+			std::cerr << "Failed to create program!\n";
+			return std::nullopt;
+		}
+
+		bool use_binaries = binaries_supported();
+		std::filesystem::path cached = binary_path(compute_source, "");
+		if (use_binaries && load_binary(self.pid, cached)) {
+			shader->reflect();
+			return shader;
+		}
+
+		self.compute = compile(compute_file, compute_source, GL_COMPUTE_SHADER, self.pid);
+		if (!self.compute) {
+			return std::nullopt;
+		}
+
+		if (!shader->link(use_binaries, cached)) {
+			std::cout << "Error happened with input shader:"
+				<< "\n\tCompute: " << compute_file
+				<< "\n";
+			return std::nullopt;
+		}
 
 		return shader;
 	}
@@ -129,14 +401,42 @@ public:
 		glUseProgram(self.pid);
 	}
 
-	inline GLint location(std::string name) const {
-		return glGetUniformLocation(self.pid, name.c_str());
+	inline GLint location(Uniform uniform) const {
+		auto it = self.locations.find(uniform.hash);
+		return it == self.locations.end() ? -1 : it->second;
+	}
+
+	inline GLint location(std::string_view name) const {
+		return location(Uniform(name));
 	}
 
+	// Binding point of a uniform or shader storage block, -1 if inactive.
+	inline GLint block_binding(Uniform block) const {
+		auto it = self.block_bindings.find(block.hash);
+		return it == self.block_bindings.end() ? -1 : it->second;
+	}
+
+	inline void uniform(GLint location, const glm::vec2& vec) const {
+		glUniform2f(location, vec.x, vec.y);
+	};
+
+	inline void uniform(GLint location, const glm::uvec3& vec) const {
+		glUniform3ui(location, vec.x, vec.y, vec.z);
+	};
+
 	inline void uniform(GLint location, const glm::vec3& vec) const {
 		glUniform3f(location, vec.x, vec.y, vec.z);
 	};
 
+	inline void uniform(GLint location, const glm::vec4& vec) const {
+		glUniform4f(location, vec.x, vec.y, vec.z, vec.w);
+	};
+
+	template<size_t N>
+	inline void uniform(GLint location, const std::array<glm::vec4, N>& vecs) const {
+		glUniform4fv(location, (GLsizei) N, glm::value_ptr(vecs[0]));
+	}
+
 	inline void uniform(GLint location, const glm::mat4 matrix) const {
 		glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(matrix));
 	}
@@ -145,6 +445,10 @@ public:
 		glUniform1i(location, x);
 	}
 
+	inline void uniform(GLint location, const GLuint x) const {
+		glUniform1ui(location, x);
+	}
+
 	inline void uniform(GLint location, const float x) const {
 		glUniform1f(location, x);
 	}
@@ -4,14 +4,13 @@ layout(location = 0) in vec4 v_pos;
 layout(location = 1) in vec3 v_nor;
 layout(location = 2) in vec2 v_tex;
 
-layout(location = 3) in mat4 model;
-layout(location = 7) in vec4 v_col;
+#include "instance.glsl"
 
 uniform mat4 light_space_matrix;
 
 out vec3 v_frag_pos_world;
 
 void main() {
-    v_frag_pos_world = vec3(model * v_pos);
+    v_frag_pos_world = vec3(instance_position(v_pos));
     gl_Position = light_space_matrix * vec4(v_frag_pos_world, 1.0);
 }
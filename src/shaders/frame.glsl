@@ -0,0 +1,15 @@
+// Camera data shared by every program, written once per frame by
+// FrameUniforms into uniform block binding 0.
+#ifndef FRAME_GLSL
+#define FRAME_GLSL
+
+layout(std140, binding = 0) uniform Frame {
+	mat4 view;
+	mat4 projection;
+	mat4 view_projection;
+	mat4 inv_view_projection;
+	vec3 cam_pos;
+	float time;
+};
+
+#endif
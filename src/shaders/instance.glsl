@@ -0,0 +1,16 @@
+// Per instance attributes, see InstanceData and
+// GeometryArena::setup_instance_attributes.
+#ifndef INSTANCE_GLSL
+#define INSTANCE_GLSL
+
+layout(location = 3) in vec4 model_rows[3];
+layout(location = 6) in vec4 v_col;
+layout(location = 7) in mat3 normal_matrix;
+layout(location = 10) in int baked_offset;
+
+// Every pass transforms positions through this, so their depths agree.
+vec4 instance_position(vec4 pos) {
+	return vec4(dot(model_rows[0], pos), dot(model_rows[1], pos), dot(model_rows[2], pos), pos.w);
+}
+
+#endif
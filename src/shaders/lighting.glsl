@@ -0,0 +1,290 @@
+// Phong lighting shared by the forward and visibility buffer paths.
+// Light-space positions are computed here, only for lights that sample a
+// 2D shadow map (shadow_map >= 0). Define LIGHT_SPACE_VARYINGS to read
+// them from the vertex shader instead, packed by shadow_map index.
+//
+// LIGHT_VARIANT specializes the shader for one light mix: lights are sorted
+// directional, spot, point, the NUM_*_LIGHTS loops have constant bounds and
+// *_SHADOWS set to 0 drops the matching shadow lookups and samplers.
+
+#include "frame.glsl"
+
+#ifndef MAX_LIGHTS
+#define MAX_LIGHTS 10
+#endif
+
+#ifndef MAX_SHADOW_MAPS_2D
+#define MAX_SHADOW_MAPS_2D MAX_LIGHTS
+#endif
+
+#ifndef LIGHT_VARIANT
+#define DIR_SHADOWS 1
+#define SPOT_SHADOWS 1
+#define POINT_SHADOWS 1
+#endif
+
+struct Light {
+	int type;
+	vec3 dir;
+	vec3 pos;
+	vec3 col;
+	float range;
+	float attl;
+	float attq;
+	float spinn;
+	float spout;
+	mat4 projlmat;
+	int shadow_map;
+};
+
+struct ClusterLight {
+	vec4 pos_range;
+	vec4 dir_type;
+	vec4 col_attq;
+	vec4 cone;
+};
+
+struct Surface {
+	vec3 pos;
+	vec3 nor;
+	vec4 col;
+	float view_depth;
+	vec4 baked; // baked lights' diffuse light, w = 1 where baked
+};
+
+#ifdef LIGHT_SPACE_VARYINGS
+in vec4 fragpos_projls_2d[MAX_SHADOW_MAPS_2D];
+#endif
+
+uniform Light lights[MAX_LIGHTS];
+uniform int num_lights = 0;
+#if DIR_SHADOWS || SPOT_SHADOWS
+uniform sampler2DShadow shadow_maps_2d[MAX_LIGHTS];
+#endif
+#if POINT_SHADOWS
+uniform samplerCube shadow_maps_cube[MAX_LIGHTS];
+#endif
+
+layout(std430, binding = 0) readonly buffer ClusterLights {
+	ClusterLight cluster_lights[];
+};
+layout(std430, binding = 1) readonly buffer ClusterCells {
+	uvec2 cluster_cells[];
+};
+layout(std430, binding = 2) readonly buffer ClusterIndices {
+	uint cluster_indices[];
+};
+
+uniform int num_cluster_lights = 0;
+uniform uvec3 cluster_grid;
+uniform vec2 cluster_tile_size;
+uniform vec2 cluster_slice;
+
+const float ambient = 0.1f;
+const float diff_strength = 1.0f;
+const float spec_strength = 0.25f;
+const float shininess = 132.f;
+const float attc = 1.f;
+const float bias_s = 0.007f;
+const float bias_m = 0.007f;
+const float point_bias = 0.005f;
+const float shadow_min = 0.25f;
+
+vec4 light_space_position(int i, Surface s) {
+#ifdef LIGHT_SPACE_VARYINGS
+	return fragpos_projls_2d[lights[i].shadow_map];
+#else
+	return lights[i].projlmat * vec4(s.pos, 1.0f);
+#endif
+}
+
+vec3 calc_diff_spec(float diff, float spec, vec3 light_col, Surface s) {
+	vec3 diff_l = diff * diff_strength * light_col * s.col.xyz;
+	vec3 spec_l = spec * spec_strength * light_col;
+	return diff_l + spec_l;
+}
+
+#if DIR_SHADOWS || SPOT_SHADOWS
+float shadow_frag(int i, vec3 L_direction_to_light, Surface s) {
+	if (lights[i].shadow_map < 0) {
+		return 1.0f;
+	}
+	vec4 projls = light_space_position(i, s);
+	vec3 ndc = projls.xyz / projls.w;
+	vec3 ss = (ndc + 1) * 0.5f;
+
+	float frag_depth = ss.z;
+	if (frag_depth > 1.0f || frag_depth < 0.0f) {
+		return 1.0f;
+	}
+
+	float bias = max(bias_s * (1.0f - dot(s.nor, L_direction_to_light)), bias_m);
+
+	return texture(shadow_maps_2d[i], vec3(ss.xy, frag_depth - bias));
+}
+#endif
+#if POINT_SHADOWS
+float shadow_frag_positional(int i, Surface s) {
+	vec3 light_to_frag_vec = s.pos - lights[i].pos;
+	float current_linear_depth = length(light_to_frag_vec);
+	float depth_map_far_plane = 400.0f; // ideally not hardcoded...
+	float current_normalized_depth = current_linear_depth / depth_map_far_plane;
+	if (current_normalized_depth > 1.0f) {
+		return 1.0f;
+	}
+	float sampled_normalized_depth = texture(shadow_maps_cube[i], normalize(light_to_frag_vec)).r;
+	float shadow_factor = 1.0f;
+	if (sampled_normalized_depth < current_normalized_depth - point_bias) {
+		shadow_factor = 0.0f;
+	}
+
+	return shadow_factor;
+}
+#endif
+
+vec3 calculate_directional_contribution(int i, Surface s) {
+	vec3 light_dir = normalize(-lights[i].dir);
+	float diff = max(dot(s.nor, light_dir), 0.0f);
+
+	vec3 cam_dir = normalize(cam_pos - s.pos);
+	vec3 reflect_dir = reflect(-light_dir, s.nor);
+	float spec = pow(max(dot(cam_dir, reflect_dir), 0.0f), shininess);
+
+#if DIR_SHADOWS
+	float shadow = max(shadow_frag(i, light_dir, s), shadow_min);
+#else
+	float shadow = 1.0f;
+#endif
+	vec3 diff_spec = calc_diff_spec(diff, spec, lights[i].col, s);
+	vec3 phong = shadow * diff_spec;
+
+	return phong;
+}
+
+vec3 calculate_spot_contribution(int i, Surface s) {
+	vec3 dfrag = lights[i].pos - s.pos;
+	float d = length(dfrag);
+	vec3 to_light = normalize(dfrag);
+
+	float diff = max(dot(s.nor, to_light), 0.0f);
+
+	vec3 ref_light = reflect(-to_light, s.nor);
+	vec3 cam_direction = normalize(cam_pos - s.pos);
+	float spec = pow(max(dot(cam_direction, ref_light), 0.0f), shininess);
+
+	float att = 1.0f / (attc + (lights[i].attl * d) + (lights[i].attq * d * d));
+
+	vec3 spot_dir = normalize(lights[i].dir);
+	float theta = dot(to_light, -spot_dir);
+
+	float cos_inner = cos(lights[i].spinn);
+	float cos_outer = cos(lights[i].spout);
+	float intensity = smoothstep(cos_outer, cos_inner, theta);
+
+#if SPOT_SHADOWS
+	float shadow = max(shadow_frag(i, to_light, s), shadow_min);
+#else
+	float shadow = 1.0f;
+#endif
+	vec3 diff_spec = calc_diff_spec(diff, spec, lights[i].col, s);
+	vec3 phong = shadow * diff_spec * att * intensity;
+
+	return phong;
+}
+
+vec3 calculate_positional_contribution(int i, Surface s) {
+	vec3 dfrag = lights[i].pos - s.pos;
+	float d = length(dfrag);
+	vec3 light_dir = normalize(dfrag);
+
+	float diff = max(dot(s.nor, light_dir), 0.0f);
+
+	vec3 view_dir = normalize(cam_pos - s.pos);
+	vec3 reflect_dir = reflect(-light_dir, s.nor);
+	float spec = pow(max(dot(view_dir, reflect_dir), 0.0f), shininess);
+
+	float att = 1.0 / (attc + (lights[i].attl * d) + (lights[i].attq * d * d));
+
+#if POINT_SHADOWS
+	float shadow = max(shadow_frag_positional(i, s), shadow_min);
+#else
+	float shadow = 1.0f;
+#endif
+	vec3 diff_spec = calc_diff_spec(diff, spec, lights[i].col, s);
+	vec3 phong = shadow * diff_spec * att;
+
+	return phong;
+}
+
+vec3 calculate_cluster_contribution(uint i, Surface s) {
+	ClusterLight light = cluster_lights[i];
+	if (light.cone.w > 0.0f && s.baked.w > 0.0f) {
+		return vec3(0.0f);
+	}
+	vec3 dfrag = light.pos_range.xyz - s.pos;
+	float d = length(dfrag);
+	if (d > light.pos_range.w) {
+		return vec3(0.0f);
+	}
+	vec3 to_light = dfrag / d;
+
+	float diff = max(dot(s.nor, to_light), 0.0f);
+
+	vec3 ref_light = reflect(-to_light, s.nor);
+	vec3 cam_direction = normalize(cam_pos - s.pos);
+	float spec = pow(max(dot(cam_direction, ref_light), 0.0f), shininess);
+
+	float att = 1.0f / (attc + (light.cone.z * d) + (light.col_attq.w * d * d));
+
+	float intensity = 1.0f;
+	if (int(light.dir_type.w) == 2) {
+		float theta = dot(to_light, -normalize(light.dir_type.xyz));
+		intensity = smoothstep(light.cone.y, light.cone.x, theta);
+	}
+
+	return calc_diff_spec(diff, spec, light.col_attq.xyz, s) * att * intensity;
+}
+
+uint cluster_index(Surface s) {
+	uvec2 tile = min(uvec2(gl_FragCoord.xy / cluster_tile_size), cluster_grid.xy - 1u);
+	uint slice = 0u;
+	if (s.view_depth >= 1.0f) {
+		float z = log(s.view_depth) * cluster_slice.x + cluster_slice.y;
+		slice = clamp(uint(z), 1u, cluster_grid.z - 1u);
+	}
+	return (slice * cluster_grid.y + tile.y) * cluster_grid.x + tile.x;
+}
+
+vec3 shade(Surface s) {
+	vec3 final_col = (ambient + s.baked.xyz) * s.col.xyz;
+#ifdef LIGHT_VARIANT
+	const int spot_begin = NUM_DIR_LIGHTS;
+	const int point_begin = spot_begin + NUM_SPOT_LIGHTS;
+	for (int i = 0; i < spot_begin; i++) {
+		final_col += calculate_directional_contribution(i, s);
+	}
+	for (int i = spot_begin; i < point_begin; i++) {
+		final_col += calculate_spot_contribution(i, s);
+	}
+	for (int i = point_begin; i < point_begin + NUM_POINT_LIGHTS; i++) {
+		final_col += calculate_positional_contribution(i, s);
+	}
+#else
+	for (int i = 0; i < num_lights; i++) {
+		if (lights[i].type == 0) {
+			final_col += calculate_directional_contribution(i, s);
+		} else if (lights[i].type == 1) {
+			final_col += calculate_positional_contribution(i, s);
+		} else if (lights[i].type == 2) {
+			final_col += calculate_spot_contribution(i, s);
+		}
+	}
+#endif
+	if (num_cluster_lights > 0) {
+		uvec2 cell = cluster_cells[cluster_index(s)];
+		for (uint k = 0u; k < cell.y; k++) {
+			final_col += calculate_cluster_contribution(cluster_indices[cell.x + k], s);
+		}
+	}
+	return final_col;
+}
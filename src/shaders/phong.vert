@@ -1,7 +1,27 @@
 #version 450 core
+#extension GL_ARB_shader_draw_parameters : require
 
+#ifndef MAX_LIGHTS
 #define MAX_LIGHTS 10
+#endif
+#ifndef MAX_SHADOW_MAPS_2D
+#define MAX_SHADOW_MAPS_2D MAX_LIGHTS
+#endif
 
+#include "frame.glsl"
+
+layout(location = 0) in vec4 v_pos;
+layout(location = 1) in vec3 v_nor;
+layout(location = 2) in vec2 v_tex;
+
+#include "instance.glsl"
+
+layout(std430, binding = 7) readonly buffer BakedLighting {
+	vec4 baked_lighting[];
+};
+
+
+#ifdef LIGHT_SPACE_VARYINGS
 struct Light {
 	int type;
 	vec3 dir;
@@ -13,35 +33,41 @@ struct Light {
 	float spinn;
 	float spout;
 	mat4 projlmat;
+	int shadow_map;
 };
 
-layout(location = 0) in vec4 v_pos;
-layout(location = 1) in vec3 v_nor;
-layout(location = 2) in vec2 v_tex;
-
-layout(location = 3) in mat4 model;
-layout(location = 7) in vec4 v_col;
-
-
-uniform mat4 view;
-uniform mat4 projection;
-
 uniform Light lights[MAX_LIGHTS];
-uniform int num_lights = 0;
+// light indices of the 2D shadow maps, compacted
+uniform int shadow_2d_lights[MAX_SHADOW_MAPS_2D];
+uniform int num_shadow_2d_lights = 0;
+#endif
 
 
 out vec4 frag_col;
 out vec3 frag_nor;
 out vec3 frag_pos;
-out vec4 fragpos_projls_2d[MAX_LIGHTS];
+out float frag_view_depth;
+out vec4 frag_baked;
+#ifdef LIGHT_SPACE_VARYINGS
+out vec4 fragpos_projls_2d[MAX_SHADOW_MAPS_2D];
+#endif
+
+invariant gl_Position;
 
 void main() {
-	vec4 mvpos = model * v_pos;
-	gl_Position = projection * view * mvpos;
+	vec4 mvpos = instance_position(v_pos);
+	gl_Position = view_projection * mvpos;
 	frag_col = v_col;
-	frag_nor = mat3(transpose(inverse(model))) * v_nor;
+	frag_nor = normal_matrix * v_nor;
 	frag_pos = vec3(mvpos);
-	for (int i = 0; i < num_lights; i++) {
-		fragpos_projls_2d[i] = lights[i].projlmat * mvpos;
+	frag_view_depth = -(view * mvpos).z;
+	// gl_VertexID counts from the start of the shared arena, the bake from
+	// the start of the mesh
+	frag_baked = baked_offset >= 0
+		? baked_lighting[baked_offset + gl_VertexID - gl_BaseVertexARB] : vec4(0.0f);
+#ifdef LIGHT_SPACE_VARYINGS
+	for (int k = 0; k < num_shadow_2d_lights; k++) {
+		fragpos_projls_2d[k] = lights[shadow_2d_lights[k]].projlmat * mvpos;
 	}
+#endif
 }
@@ -4,12 +4,14 @@ layout(location = 0) in vec4 v_pos;
 layout(location = 1) in vec3 v_nor;
 layout(location = 2) in vec2 v_tex;
 
-layout(location = 3) in mat4 model;
-layout(location = 7) in vec4 v_col;
+#include "instance.glsl"
 
 uniform mat4 projlmat;
 
+// Also the camera depth pre-pass, which must match phong.vert bit for bit.
+invariant gl_Position;
+
 void main()
 {
-	gl_Position = projlmat * model * v_pos;
+	gl_Position = projlmat * instance_position(v_pos);
 }
\ No newline at end of file
@@ -0,0 +1,12 @@
+#version 450 core
+
+flat in uint frag_instance;
+
+uniform uint id_base;
+uniform uint num_triangles;
+
+layout(location = 0) out uint out_id;
+
+void main() {
+	out_id = id_base + frag_instance * num_triangles + uint(gl_PrimitiveID);
+}
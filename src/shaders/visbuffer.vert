@@ -0,0 +1,16 @@
+#version 450 core
+
+layout(location = 0) in vec4 v_pos;
+layout(location = 1) in vec3 v_nor;
+layout(location = 2) in vec2 v_tex;
+
+#include "instance.glsl"
+
+#include "frame.glsl"
+
+flat out uint frag_instance;
+
+void main() {
+	gl_Position = projection * view * instance_position(v_pos);
+	frag_instance = uint(gl_InstanceID);
+}
@@ -0,0 +1,142 @@
+#version 450 core
+
+#include "lighting.glsl"
+
+struct DrawRecord {
+	uint id_base;
+	uint num_triangles;
+	uint first_index;
+	uint base_vertex;
+	uint first_instance;
+	uint pad[3];
+};
+
+struct InstanceData {
+	vec4 model_rows[3];
+	vec3 normal_0;
+	uint color;
+	vec3 normal_1;
+	int baked_offset;
+	vec3 normal_2;
+	uint padding;
+};
+
+layout(std430, binding = 3) readonly buffer Vertices {
+	uint vertex_data[]; // pos.xyz as float bits, nor as 2_10_10_10, tex as two halves
+};
+layout(std430, binding = 4) readonly buffer Indices {
+	uint index_data[]; // two to a word when short_indices
+};
+layout(std430, binding = 5) readonly buffer Instances {
+	InstanceData instances[];
+};
+layout(std430, binding = 6) readonly buffer Draws {
+	DrawRecord draws[];
+};
+layout(std430, binding = 7) readonly buffer BakedLighting {
+	vec4 baked_lighting[];
+};
+
+const uint VERTEX_STRIDE = 5u;
+
+uniform usampler2D ids;
+uniform int num_draws;
+uniform bool short_indices;
+
+out vec4 out_colour;
+
+int find_draw(uint id) {
+	int lo = 0;
+	int hi = num_draws - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (draws[mid].id_base <= id) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+vec3 vertex_pos(uint v) {
+	uint o = v * VERTEX_STRIDE;
+	return uintBitsToFloat(uvec3(vertex_data[o], vertex_data[o + 1u], vertex_data[o + 2u]));
+}
+
+vec3 vertex_nor(uint v) {
+	int bits = int(vertex_data[v * VERTEX_STRIDE + 3u]);
+	ivec3 n = ivec3(
+		bitfieldExtract(bits, 0, 10), bitfieldExtract(bits, 10, 10), bitfieldExtract(bits, 20, 10)
+	);
+	return max(vec3(n) / 511.0f, -1.0f);
+}
+
+vec3 world_pos(InstanceData data, vec3 pos) {
+	vec4 p = vec4(pos, 1.0f);
+	return vec3(dot(data.model_rows[0], p), dot(data.model_rows[1], p), dot(data.model_rows[2], p));
+}
+
+uint index_at(uint i) {
+	if (short_indices) {
+		return bitfieldExtract(index_data[i >> 1u], int(i & 1u) * 16, 16);
+	}
+	return index_data[i];
+}
+
+void main() {
+	uint id = texelFetch(ids, ivec2(gl_FragCoord.xy), 0).r;
+	if (id == 0u) {
+		discard;
+	}
+
+	DrawRecord draw = draws[find_draw(id)];
+	uint local = id - draw.id_base;
+	uint instance = draw.first_instance + local / draw.num_triangles;
+	uint triangle = local % draw.num_triangles;
+
+	InstanceData data = instances[instance];
+	uint first = draw.first_index + triangle * 3u;
+	uvec3 tri = uvec3(index_at(first), index_at(first + 1u), index_at(first + 2u));
+	uint v0 = draw.base_vertex + tri.x;
+	uint v1 = draw.base_vertex + tri.y;
+	uint v2 = draw.base_vertex + tri.z;
+
+	vec3 p0 = world_pos(data, vertex_pos(v0));
+	vec3 p1 = world_pos(data, vertex_pos(v1));
+	vec3 p2 = world_pos(data, vertex_pos(v2));
+
+	// Barycentrics of the camera ray through this pixel against the
+	// triangle's plane.
+	vec2 ndc = gl_FragCoord.xy / vec2(textureSize(ids, 0)) * 2.0f - 1.0f;
+	vec4 far_point = inv_view_projection * vec4(ndc, 1.0f, 1.0f);
+	vec3 ray = normalize(far_point.xyz / far_point.w - cam_pos);
+
+	vec3 e1 = p1 - p0;
+	vec3 e2 = p2 - p0;
+	vec3 pv = cross(ray, e2);
+	float inv_det = 1.0f / dot(e1, pv);
+	vec3 tv = cam_pos - p0;
+	float b1 = dot(tv, pv) * inv_det;
+	vec3 qv = cross(tv, e1);
+	float b2 = dot(ray, qv) * inv_det;
+	float t = dot(e2, qv) * inv_det;
+	float b0 = 1.0f - b1 - b2;
+
+	vec3 nor = b0 * vertex_nor(v0) + b1 * vertex_nor(v1) + b2 * vertex_nor(v2);
+	vec3 pos = cam_pos + ray * t;
+
+	Surface s;
+	s.pos = pos;
+	s.nor = normalize(mat3(data.normal_0, data.normal_1, data.normal_2) * nor);
+	s.col = unpackUnorm4x8(data.color);
+	s.view_depth = -(view * vec4(pos, 1.0f)).z;
+	s.baked = vec4(0.0f);
+	int baked_offset = data.baked_offset;
+	if (baked_offset >= 0) {
+		uvec3 baked = uint(baked_offset) + tri;
+		s.baked = b0 * baked_lighting[baked.x] + b1 * baked_lighting[baked.y] + b2 * baked_lighting[baked.z];
+	}
+
+	out_colour = vec4(shade(s), s.col.w);
+}
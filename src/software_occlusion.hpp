@@ -0,0 +1,282 @@
+#pragma once
+
+#include "worker_pool.hpp"
+
+// Occlusion culling for the CPU culling path. The large, coarse occluders
+// of a view are rasterized into a small buffer holding the nearest occluder
+// per pixel, one band of rows per thread at a time and, with SSE, four
+// pixels per step. Each instance's world box is then tested against the
+// buffer under its screen rectangle before anything is drawn, so hidden
+// instances cost no draw calls either.
+//
+// The buffer holds 1 / w, which varies linearly across a triangle on
+// screen and keeps its precision far from the camera, unlike z / w, so it
+// needs a perspective view; with an orthographic one nothing is culled.
+//
+// Coverage is sampled at pixel centers at a fraction of the screen's
+// resolution, so slivers of an instance peeking past an occluder's edge
+// by less than a buffer pixel may be culled.
+class SoftwareOcclusion {
+public:
+	static constexpr int WIDTH = 256;
+	static constexpr int HEIGHT = 128;
+	static constexpr int BAND_HEIGHT = 16;
+	// meshes with more triangles cost more to rasterize than they hide
+	static constexpr GLsizei MAX_OCCLUDER_TRIANGLES = 64;
+	// fewer are rasterized on the calling thread, waking the workers
+	// would cost more
+	static constexpr size_t PARALLEL_TRIANGLES = 64;
+	// Occluders are clipped this many times the screen's half size out
+	// from its center, so edge functions stay well within float precision.
+	static constexpr float GUARD_BAND = 2.f;
+	// relative 1 / w difference taken as the same depth, so occluders
+	// never hide themselves
+	static constexpr float DEPTH_TOLERANCE = 1e-4f;
+
+private:
+	struct Triangle {
+		// edge functions a * x + b * y + c, not negative inside
+		glm::vec3 edges[3];
+		// 1 / w as a * x + b * y + c
+		glm::vec3 depth;
+		// inclusive pixel bounds x0, y0, x1, y1
+		glm::ivec4 bounds;
+	};
+
+	struct Self {
+		// 1 / w of the nearest occluder, 0 where there is none
+		std::vector<float> depth;
+		std::vector<Triangle> triangles;
+		glm::mat4 view_projection = glm::mat4(1.f);
+		// one band each at a time
+		std::unique_ptr<WorkerPool> workers;
+	} self;
+
+	SoftwareOcclusion() = default;
+
+	// Screen position in pixels, as GL would map it, and 1 / w.
+	static glm::vec3 to_screen(const glm::vec4& clip) {
+		float inv_w = 1.f / clip.w;
+		return glm::vec3(
+			(clip.x * inv_w * 0.5f + 0.5f) * WIDTH, (clip.y * inv_w * 0.5f + 0.5f) * HEIGHT, inv_w
+		);
+	}
+
+	void setup_triangle(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+		float area = (p1.x - p0.x) * (p2.y - p0.y) - (p2.x - p0.x) * (p1.y - p0.y);
+		// back facing or degenerate
+		if (!(area > 0.f)) { return; }
+
+		glm::vec3 lo = glm::min(glm::min(p0, p1), p2);
+		glm::vec3 hi = glm::max(glm::max(p0, p1), p2);
+		glm::ivec4 bounds = glm::ivec4(
+			std::max((int) std::floor(lo.x), 0), std::max((int) std::floor(lo.y), 0),
+			std::min((int) std::floor(hi.x), WIDTH - 1), std::min((int) std::floor(hi.y), HEIGHT - 1)
+		);
+		if (bounds.x > bounds.z || bounds.y > bounds.w) { return; }
+
+		Triangle triangle;
+		glm::vec3 p[3] = { p0, p1, p2 };
+		for (int k = 0; k < 3; k++) {
+			const glm::vec3& a = p[k];
+			const glm::vec3& b = p[(k + 1) % 3];
+			triangle.edges[k] = glm::vec3(a.y - b.y, b.x - a.x, (b.y - a.y) * a.x - (b.x - a.x) * a.y);
+		}
+		float dz_dx = ((p1.z - p0.z) * (p2.y - p0.y) - (p2.z - p0.z) * (p1.y - p0.y)) / area;
+		float dz_dy = ((p2.z - p0.z) * (p1.x - p0.x) - (p1.z - p0.z) * (p2.x - p0.x)) / area;
+		triangle.depth = glm::vec3(dz_dx, dz_dy, p0.z - dz_dx * p0.x - dz_dy * p0.y);
+		triangle.bounds = bounds;
+		self.triangles.push_back(triangle);
+	}
+
+	// Cuts the triangle at the near plane, z = -w, and at the guard band,
+	// and sets up what is left.
+	void clip_triangle(const glm::vec4 clip[3]) {
+		// each plane adds at most one vertex
+		glm::vec4 polygon[8] = { clip[0], clip[1], clip[2] };
+		glm::vec4 clipped[8];
+		int count = 3;
+		const glm::vec4 planes[5] = {
+			glm::vec4(0.f, 0.f, 1.f, 1.f),
+			glm::vec4(1.f, 0.f, 0.f, GUARD_BAND), glm::vec4(-1.f, 0.f, 0.f, GUARD_BAND),
+			glm::vec4(0.f, 1.f, 0.f, GUARD_BAND), glm::vec4(0.f, -1.f, 0.f, GUARD_BAND),
+		};
+		for (const auto& plane : planes) {
+			int clipped_count = 0;
+			for (int k = 0; k < count; k++) {
+				const glm::vec4& a = polygon[k];
+				const glm::vec4& b = polygon[(k + 1) % count];
+				float da = glm::dot(plane, a);
+				float db = glm::dot(plane, b);
+				if (da >= 0.f) { clipped[clipped_count++] = a; }
+				if ((da >= 0.f) != (db >= 0.f)) {
+					clipped[clipped_count++] = a + (b - a) * (da / (da - db));
+				}
+			}
+			count = clipped_count;
+			if (count < 3) { return; }
+			std::copy(clipped, clipped + count, polygon);
+		}
+
+		glm::vec3 screen[8];
+		for (int k = 0; k < count; k++) {
+			screen[k] = to_screen(polygon[k]);
+		}
+		for (int k = 1; k + 1 < count; k++) {
+			setup_triangle(screen[0], screen[k], screen[k + 1]);
+		}
+	}
+
+	void rasterize_band(int band) {
+		int band_y0 = band * BAND_HEIGHT;
+		int band_y1 = band_y0 + BAND_HEIGHT - 1;
+		float* depth = self.depth.data();
+
+		for (const auto& triangle : self.triangles) {
+			int y0 = std::max(triangle.bounds.y, band_y0);
+			int y1 = std::min(triangle.bounds.w, band_y1);
+			int x0 = triangle.bounds.x & ~3;
+			int x1 = triangle.bounds.z;
+			const glm::vec3* e = triangle.edges;
+			const glm::vec3& z = triangle.depth;
+
+			for (int y = y0; y <= y1; y++) {
+				float cy = (float) y + 0.5f;
+				float* row = depth + y * WIDTH;
+#ifdef RENDERER_SSE
+				__m128 zero = _mm_setzero_ps();
+				__m128 a0 = _mm_set1_ps(e[0].x);
+				__m128 a1 = _mm_set1_ps(e[1].x);
+				__m128 a2 = _mm_set1_ps(e[2].x);
+				__m128 az = _mm_set1_ps(z.x);
+				__m128 r0 = _mm_set1_ps(e[0].y * cy + e[0].z);
+				__m128 r1 = _mm_set1_ps(e[1].y * cy + e[1].z);
+				__m128 r2 = _mm_set1_ps(e[2].y * cy + e[2].z);
+				__m128 rz = _mm_set1_ps(z.y * cy + z.z);
+				for (int x = x0; x <= x1; x += 4) {
+					__m128 cx = _mm_add_ps(_mm_set1_ps((float) x), _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f));
+					__m128 inside = _mm_and_ps(
+						_mm_and_ps(
+							_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, cx), r0), zero),
+							_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, cx), r1), zero)
+						),
+						_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, cx), r2), zero)
+					);
+					if (_mm_movemask_ps(inside) == 0) { continue; }
+
+					__m128 old_depth = _mm_loadu_ps(row + x);
+					__m128 new_depth = _mm_max_ps(old_depth, _mm_add_ps(_mm_mul_ps(az, cx), rz));
+					_mm_storeu_ps(row + x, _mm_or_ps(
+						_mm_and_ps(inside, new_depth), _mm_andnot_ps(inside, old_depth)
+					));
+				}
+#else
+				for (int x = triangle.bounds.x; x <= x1; x++) {
+					float cx = (float) x + 0.5f;
+					if (e[0].x * cx + e[0].y * cy + e[0].z < 0.f) { continue; }
+					if (e[1].x * cx + e[1].y * cy + e[1].z < 0.f) { continue; }
+					if (e[2].x * cx + e[2].y * cy + e[2].z < 0.f) { continue; }
+					row[x] = std::max(row[x], z.x * cx + z.y * cy + z.z);
+				}
+#endif
+			}
+		}
+	}
+
+public:
+	SoftwareOcclusion(const SoftwareOcclusion&) = delete;
+	SoftwareOcclusion& operator=(const SoftwareOcclusion&) = delete;
+	SoftwareOcclusion(SoftwareOcclusion&& other) = delete;
+	SoftwareOcclusion& operator=(SoftwareOcclusion&& other) = delete;
+
+	static std::unique_ptr<SoftwareOcclusion> New() {
+		auto occlusion = std::unique_ptr<SoftwareOcclusion>(new SoftwareOcclusion());
+		auto& self = occlusion->self;
+
+		self.depth.assign(WIDTH * HEIGHT, 0.f);
+		self.workers = WorkerPool::New(HEIGHT / BAND_HEIGHT);
+
+		return occlusion;
+	}
+
+	// Clears the buffer for the occluders of view_projection.
+	void begin(const glm::mat4& view_projection) {
+		self.view_projection = view_projection;
+		self.triangles.clear();
+		std::fill(self.depth.begin(), self.depth.end(), 0.f);
+	}
+
+	// Adds the front faces of a triangle list under model.
+	void add_occluder(const glm::mat4& model, const Vertices& vertices, const Indices& indices) {
+		glm::mat4 mvp = self.view_projection * model;
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			glm::vec4 clip[3];
+			for (int k = 0; k < 3; k++) {
+				clip[k] = mvp * glm::vec4(vertices[indices[i + k]].pos, 1.f);
+			}
+			clip_triangle(clip);
+		}
+	}
+
+	// Rasterizes the occluders added since begin().
+	void rasterize() {
+		if (self.triangles.empty()) { return; }
+
+		int num_bands = HEIGHT / BAND_HEIGHT;
+		if (self.triangles.size() < PARALLEL_TRIANGLES) {
+			for (int band = 0; band < num_bands; band++) {
+				rasterize_band(band);
+			}
+			return;
+		}
+		self.workers->run(num_bands, [this](size_t band) {
+			rasterize_band((int) band);
+		});
+	}
+
+	// Whether any of the world box lo, hi may be in front of the occluders.
+	bool is_visible(glm::vec3 lo, glm::vec3 hi) const {
+		glm::vec3 screen_lo = glm::vec3(std::numeric_limits<float>::max());
+		glm::vec3 screen_hi = glm::vec3(std::numeric_limits<float>::lowest());
+		for (int k = 0; k < 8; k++) {
+			glm::vec4 clip = self.view_projection * glm::vec4(
+				k & 1 ? hi.x : lo.x, k & 2 ? hi.y : lo.y, k & 4 ? hi.z : lo.z, 1.f
+			);
+			// crosses the near plane
+			if (clip.z < -clip.w) { return true; }
+			glm::vec3 screen = to_screen(clip);
+			screen_lo = glm::min(screen_lo, screen);
+			screen_hi = glm::max(screen_hi, screen);
+		}
+		if (screen_hi.x < 0.f || screen_hi.y < 0.f || screen_lo.x >= WIDTH || screen_lo.y >= HEIGHT) {
+			return true;
+		}
+
+		int x0 = std::max((int) std::floor(screen_lo.x), 0);
+		int y0 = std::max((int) std::floor(screen_lo.y), 0);
+		int x1 = std::min((int) std::floor(screen_hi.x), WIDTH - 1);
+		int y1 = std::min((int) std::floor(screen_hi.y), HEIGHT - 1);
+		float nearest = screen_hi.z * (1.f + DEPTH_TOLERANCE);
+		const float* depth = self.depth.data();
+
+		for (int y = y0; y <= y1; y++) {
+			const float* row = depth + y * WIDTH;
+#ifdef RENDERER_SSE
+			__m128 near_depth = _mm_set1_ps(nearest);
+			__m128 first = _mm_set1_ps((float) x0);
+			__m128 last = _mm_set1_ps((float) x1);
+			for (int x = x0 & ~3; x <= x1; x += 4) {
+				__m128 lanes = _mm_add_ps(_mm_set1_ps((float) x), _mm_setr_ps(0.f, 1.f, 2.f, 3.f));
+				__m128 in_rect = _mm_and_ps(_mm_cmpge_ps(lanes, first), _mm_cmple_ps(lanes, last));
+				__m128 uncovered = _mm_cmple_ps(_mm_loadu_ps(row + x), near_depth);
+				if (_mm_movemask_ps(_mm_and_ps(uncovered, in_rect))) { return true; }
+			}
+#else
+			for (int x = x0; x <= x1; x++) {
+				if (row[x] <= nearest) { return true; }
+			}
+#endif
+		}
+		return false;
+	}
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "light_manager.hpp"
+
+// Deferred render path: the scene is rasterized once into a 32-bit id
+// buffer, then a single full-screen pass reconstructs the surface under each
+// pixel and runs the lighting exactly once, whatever the overdraw.
+//
+// A pixel id is 1 + the running triangle number over every drawn instance,
+// so 0 stays free for the background. Each mesh owns the id range starting
+// at its id_base, which the resolve pass finds with a binary search.
+class VisibilityBuffer {
+public:
+	static constexpr GLuint VERTICES_BINDING = 3;
+	static constexpr GLuint INDICES_BINDING = 4;
+	static constexpr GLuint INSTANCES_BINDING = 5;
+	static constexpr GLuint DRAWS_BINDING = 6;
+	static constexpr GLint ID_TEXTURE_UNIT = 2 * LightManager::MAX_SHADER_LIGHTS;
+
+	struct DrawRecord {
+		GLuint id_base;
+		GLuint num_triangles;
+		GLuint first_index;
+		GLuint base_vertex;
+		GLuint first_instance;
+		GLuint pad[3];
+	};
+
+private:
+	struct MeshRange {
+		InstantiableMesh* mesh;
+		GLuint first_index;
+		GLuint base_vertex;
+	};
+
+	struct Self {
+		std::unique_ptr<ShaderProgram> id_program;
+		std::unique_ptr<ShaderProgram> resolve_program;
+
+		GLint l_id_base = -1;
+		GLint l_id_num_triangles = -1;
+
+		GLint l_resolve_num_draws = -1;
+		GLint l_resolve_ids = -1;
+		GLint l_resolve_short_indices = -1;
+
+		GLuint fbo = 0;
+		GLuint id_texture = 0;
+		GLuint depth_texture = 0;
+		glm::ivec2 resolution = glm::ivec2(0);
+
+		GLuint empty_vao = 0;
+		GeometryArena* arena = nullptr;
+		// owned by the geometry arena
+		GLuint ssbo_vertices = 0;
+		GLuint ssbo_indices = 0;
+		GLuint ssbo_instances = 0;
+		GLuint ssbo_draws = 0;
+		size_t instances_capacity = 0;
+		size_t draws_capacity = 0;
+
+		std::vector<MeshRange> meshes;
+		std::vector<DrawRecord> draws;
+	} self;
+
+	VisibilityBuffer() = default;
+
+	void setup_uniforms() {
+		auto& id_program = self.id_program;
+		auto& resolve_program = self.resolve_program;
+
+		id_program->use();
+		self.l_id_base = id_program->location("id_base");
+		self.l_id_num_triangles = id_program->location("num_triangles");
+
+		resolve_program->use();
+		self.l_resolve_num_draws = resolve_program->location("num_draws");
+		self.l_resolve_ids = resolve_program->location("ids");
+		self.l_resolve_short_indices = resolve_program->location("short_indices");
+		resolve_program->uniform(self.l_resolve_ids, ID_TEXTURE_UNIT);
+	}
+
+	// The resolve pass reads mesh geometry straight from the arena, at the
+	// same first index and base vertex the draws use.
+	void setup_geometry(const std::vector<InstantiableMesh*>& meshes, GeometryArena* arena) {
+		for (auto mesh : meshes) {
+			if (mesh->get_num_triangles() == 0) { continue; }
+
+			const auto& range = mesh->get_range();
+			self.meshes.push_back(MeshRange {
+				mesh, range.first_index, (GLuint) range.base_vertex
+			});
+		}
+
+		self.arena = arena;
+		self.ssbo_vertices = arena->get_vertex_buffer();
+		self.ssbo_indices = arena->get_index_buffer();
+		glCreateBuffers(1, &self.ssbo_instances);
+		glCreateBuffers(1, &self.ssbo_draws);
+
+		glGenVertexArrays(1, &self.empty_vao);
+	}
+
+	void resize(glm::ivec2 res) {
+		if (res == self.resolution) { return; }
+		self.resolution = res;
+
+		if (self.fbo) {
+			glDeleteFramebuffers(1, &self.fbo);
+			glDeleteTextures(1, &self.id_texture);
+			glDeleteTextures(1, &self.depth_texture);
+		}
+
+		glCreateTextures(GL_TEXTURE_2D, 1, &self.id_texture);
+		glTextureStorage2D(self.id_texture, 1, GL_R32UI, res.x, res.y);
+		glTextureParameteri(self.id_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(self.id_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glCreateTextures(GL_TEXTURE_2D, 1, &self.depth_texture);
+		glTextureStorage2D(self.depth_texture, 1, GL_DEPTH_COMPONENT32F, res.x, res.y);
+
+		glCreateFramebuffers(1, &self.fbo);
+		glNamedFramebufferTexture(self.fbo, GL_COLOR_ATTACHMENT0, self.id_texture, 0);
+		glNamedFramebufferTexture(self.fbo, GL_DEPTH_ATTACHMENT, self.depth_texture, 0);
+
+		if (glCheckNamedFramebufferStatus(self.fbo, GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+			std::cerr << "ERROR::FRAMEBUFFER:: Visibility buffer is not complete!\n";
+		}
+	}
+
+	// Gathers this frame's instances of every mesh into one storage buffer
+	// and records the id range each mesh will write.
+	void gather_instances() {
+		size_t total_instances = 0;
+		for (const auto& range : self.meshes) {
+			total_instances += range.mesh->get_num_instances();
+		}
+
+		if (total_instances > self.instances_capacity) {
+			self.instances_capacity = std::max(total_instances, self.instances_capacity * 2);
+			glNamedBufferData(
+				self.ssbo_instances, self.instances_capacity * sizeof(InstanceData),
+				nullptr, GL_DYNAMIC_DRAW
+			);
+		}
+
+		self.draws.clear();
+		GLuint id_base = 1;
+		GLuint first_instance = 0;
+		for (const auto& range : self.meshes) {
+			auto mesh = range.mesh;
+			GLuint num_instances = (GLuint) mesh->get_num_instances();
+			if (num_instances == 0) { continue; }
+
+			mesh->copy_instances_to(
+				self.ssbo_instances, first_instance * sizeof(InstanceData)
+			);
+
+			GLuint num_triangles = (GLuint) mesh->get_num_triangles();
+			self.draws.push_back(DrawRecord {
+				id_base, num_triangles, range.first_index, range.base_vertex,
+				first_instance, { 0, 0, 0 }
+			});
+			id_base += num_triangles * num_instances;
+			first_instance += num_instances;
+		}
+
+		size_t count = std::max(self.draws.size(), (size_t) 1);
+		if (count > self.draws_capacity) {
+			self.draws_capacity = std::max(count, self.draws_capacity * 2);
+			glNamedBufferData(
+				self.ssbo_draws, self.draws_capacity * sizeof(DrawRecord),
+				nullptr, GL_DYNAMIC_DRAW
+			);
+		}
+		if (!self.draws.empty()) {
+			glNamedBufferSubData(
+				self.ssbo_draws, 0, self.draws.size() * sizeof(DrawRecord),
+				self.draws.data()
+			);
+		}
+	}
+
+	void draw_ids() {
+		static const GLuint background_id[] = { 0, 0, 0, 0 };
+
+		glBindFramebuffer(GL_FRAMEBUFFER, self.fbo);
+		glViewport(0, 0, self.resolution.x, self.resolution.y);
+		glClearBufferuiv(GL_COLOR, 0, background_id);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glEnable(GL_DEPTH_TEST);
+
+		auto& program = self.id_program;
+		program->use();
+
+		size_t draw = 0;
+		for (const auto& range : self.meshes) {
+			if (range.mesh->get_num_instances() == 0) { continue; }
+
+			const auto& record = self.draws[draw++];
+			program->uniform(self.l_id_base, record.id_base);
+			program->uniform(self.l_id_num_triangles, record.num_triangles);
+			range.mesh->draw();
+		}
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+
+	void resolve(LightManager* light_manager, const GLfloat* bgd) {
+		glViewport(0, 0, self.resolution.x, self.resolution.y);
+		glClearBufferfv(GL_COLOR, 0, bgd);
+		glClear(GL_DEPTH_BUFFER_BIT);
+		glDisable(GL_DEPTH_TEST);
+
+		auto& program = self.resolve_program;
+		light_manager->bind_lighting(program.get());
+		program->uniform(self.l_resolve_num_draws, (GLint) self.draws.size());
+		program->uniform(
+			self.l_resolve_short_indices, (GLint) (self.arena->get_index_type() == GL_UNSIGNED_SHORT)
+		);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTICES_BINDING, self.ssbo_vertices);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INDICES_BINDING, self.ssbo_indices);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCES_BINDING, self.ssbo_instances);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAWS_BINDING, self.ssbo_draws);
+		glBindTextureUnit(ID_TEXTURE_UNIT, self.id_texture);
+
+		glBindVertexArray(self.empty_vao);
+		glDrawArrays(GL_TRIANGLES, 0, 3);
+		glBindVertexArray(0);
+
+		glEnable(GL_DEPTH_TEST);
+	}
+
+public:
+	VisibilityBuffer(const VisibilityBuffer&) = delete;
+	VisibilityBuffer& operator=(const VisibilityBuffer&) = delete;
+	VisibilityBuffer(VisibilityBuffer&& other) = delete;
+	VisibilityBuffer& operator=(VisibilityBuffer&& other) = delete;
+
+	~VisibilityBuffer() {
+		GLuint buffers[] = { self.ssbo_instances, self.ssbo_draws };
+		glDeleteBuffers(2, buffers);
+		glDeleteVertexArrays(1, &self.empty_vao);
+		glDeleteFramebuffers(1, &self.fbo);
+		glDeleteTextures(1, &self.id_texture);
+		glDeleteTextures(1, &self.depth_texture);
+	}
+
+	static std::optional<std::unique_ptr<VisibilityBuffer>>
+	New(const std::vector<InstantiableMesh*>& meshes, GeometryArena* arena) {
+		auto id_program_opt = ShaderProgram::New(
+			"shaders/visbuffer.vert", "shaders/visbuffer.frag"
+		);
+		if (!id_program_opt.has_value()) {
+			std::cerr << "Could not load visibility buffer shader program.\n";
+			return std::nullopt;
+		}
+
+		auto resolve_program_opt = ShaderProgram::New(
+			"shaders/visbuffer_resolve.vert", "shaders/visbuffer_resolve.frag"
+		);
+		if (!resolve_program_opt.has_value()) {
+			std::cerr << "Could not load visibility resolve shader program.\n";
+			return std::nullopt;
+		}
+
+		auto visibility_buffer = std::unique_ptr<VisibilityBuffer>(new VisibilityBuffer());
+		auto& self = visibility_buffer->self;
+
+		self.id_program = std::move(id_program_opt.value());
+		self.resolve_program = std::move(resolve_program_opt.value());
+
+		visibility_buffer->setup_uniforms();
+		visibility_buffer->setup_geometry(meshes, arena);
+
+		return visibility_buffer;
+	}
+
+	// Camera matrices come from the Frame uniform block.
+	void render(LightManager* light_manager, glm::ivec2 res, const GLfloat* bgd) {
+		resize(res);
+		gather_instances();
+		draw_ids();
+		resolve(light_manager, bgd);
+	}
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+// Threads kept asleep between calls to run(), so parallel loops run every
+// frame pay for waking them, not for starting them. The calling thread
+// takes items along with the workers.
+class WorkerPool {
+private:
+	struct Self {
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable wake;
+		std::condition_variable done;
+
+		// the current run(): its job, item count and next item
+		const std::function<void(size_t)>* job = nullptr;
+		size_t count = 0;
+		std::atomic<size_t> next = 0;
+		// workers not yet through the current run()
+		size_t busy = 0;
+		uint64_t generation = 0;
+		bool stop = false;
+	} self;
+
+	WorkerPool() = default;
+
+	void drain(const std::function<void(size_t)>& job, size_t count) {
+		for (size_t i = self.next.fetch_add(1); i < count; i = self.next.fetch_add(1)) {
+			job(i);
+		}
+	}
+
+	void work() {
+		uint64_t seen = 0;
+		std::unique_lock<std::mutex> lock(self.mutex);
+		while (true) {
+			self.wake.wait(lock, [&]() { return self.stop || self.generation != seen; });
+			if (self.stop) { return; }
+			seen = self.generation;
+			const auto* job = self.job;
+			size_t count = self.count;
+
+			lock.unlock();
+			drain(*job, count);
+			lock.lock();
+			if (--self.busy == 0) { self.done.notify_one(); }
+		}
+	}
+
+public:
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+	WorkerPool(WorkerPool&& other) = delete;
+	WorkerPool& operator=(WorkerPool&& other) = delete;
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(self.mutex);
+			self.stop = true;
+		}
+		self.wake.notify_all();
+		for (auto& thread : self.threads) {
+			thread.join();
+		}
+	}
+
+	// Up to max_threads threads in all, the caller's included.
+	static std::unique_ptr<WorkerPool> New(unsigned max_threads) {
+		auto pool = std::unique_ptr<WorkerPool>(new WorkerPool());
+		unsigned threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), std::max(max_threads, 1u));
+		for (unsigned t = 1; t < threads; t++) {
+			pool->self.threads.emplace_back([p = pool.get()]() { p->work(); });
+		}
+		return pool;
+	}
+
+	// Threads run() spreads items over, the caller's included.
+	size_t get_num_threads() const {
+		return self.threads.size() + 1;
+	}
+
+	// Calls job(i) for every i below count, spread over the threads, and
+	// returns once all are done.
+	void run(size_t count, const std::function<void(size_t)>& job) {
+		if (count == 0) { return; }
+		if (self.threads.empty() || count == 1) {
+			for (size_t i = 0; i < count; i++) {
+				job(i);
+			}
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(self.mutex);
+			self.job = &job;
+			self.count = count;
+			self.next = 0;
+			self.busy = self.threads.size();
+			self.generation++;
+		}
+		self.wake.notify_all();
+		drain(job, count);
+
+		std::unique_lock<std::mutex> lock(self.mutex);
+		self.done.wait(lock, [&]() { return self.busy == 0; });
+	}
+};